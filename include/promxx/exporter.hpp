@@ -0,0 +1,47 @@
+#ifndef PROMXX_EXPORTER_HPP
+#define PROMXX_EXPORTER_HPP
+
+#include <promxx/registry.hpp>
+
+namespace promxx
+{
+
+//
+// Scrape endpoint: a single-threaded epoll HTTP/1.1 server running on
+// its own thread, see the promxx_exporter target.
+//
+// Serves GET and HEAD of /metrics in the format negotiated from Accept,
+// gzip compressed if accepted, with keep-alive. A response is chunked
+// output written from a snapshot piece by piece as the socket drains, so
+// it's never built up in full and a slow client holds up nothing but
+// itself. Application threads only ever meet it on the registry lock,
+// for as long as taking a snapshot. Memory is bounded by MAX_CONNECTIONS,
+// each with its snapshot, a request of up to MAX_REQUEST and one chunk.
+// The last compressed body of up to MAX_CACHE is kept, and sent again
+// while the values in the registry are the same.
+//
+class Exporter: detail::NoCopyMove
+{
+    struct Data;
+    Data *data_;
+
+public:
+    static std::size_t const MAX_CONNECTIONS = 16;
+    static std::size_t const MAX_REQUEST = 8192;
+    static std::size_t const CHUNK_SIZE = 16384;
+    static std::size_t const MAX_CACHE = 16 << 20;
+    static int const IDLE_TIMEOUT = 60; // seconds
+
+    // Listens on host and port, 0 picks a free port, see port()
+    Exporter(std::string const& host, unsigned short port,
+             Registry& r = Registry::global());
+
+    // Closes all connections
+    ~Exporter();
+
+    unsigned short port() const noexcept;
+};
+
+} // namespace promxx
+
+#endif
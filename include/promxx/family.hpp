@@ -0,0 +1,292 @@
+#ifndef PROMXX_FAMILY_HPP
+#define PROMXX_FAMILY_HPP
+
+#include <promxx/registry.hpp>
+#include <promxx/native_histogram.hpp>
+#include <promxx/summary.hpp>
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+
+namespace promxx
+{
+namespace detail
+{
+
+// FNV-1a over label values, with the length mixed in as a separator
+std::size_t hash_values(StringRef const* values, std::size_t n) noexcept;
+
+class FamilyBase: NoCopyMove
+{
+public:
+    virtual ~FamilyBase();
+
+    // Drops lookups of a series removed from the registry
+    virtual void forget(Metric const* m) = 0;
+};
+
+// Copy of a descriptor with other label names
+template<class T>
+T with_keys(T const& desc, std::vector<std::string> keys)
+{
+    return T(desc.name(), desc.help(), std::move(keys));
+}
+
+inline Histogram with_keys(Histogram const& desc, std::vector<std::string> keys)
+{
+    return Histogram(desc, std::move(keys));
+}
+
+inline Summary with_keys(Summary const& desc, std::vector<std::string> keys)
+{
+    return Summary(desc.name(), desc.quantiles(), desc.help(), std::move(keys),
+                   desc.max_age(), desc.age_buckets(), desc.accuracy());
+}
+
+inline NativeHistogram with_keys(NativeHistogram const& desc, std::vector<std::string> keys)
+{
+    return NativeHistogram(desc.name(), desc.schema(), desc.help(), std::move(keys));
+}
+
+inline DenseCounter with_keys(DenseCounter const& desc, std::vector<std::string> keys)
+{
+    return DenseCounter(desc.name(), desc.dimensions(), desc.help(), std::move(keys));
+}
+
+// Same help and type specific parts, label names aside
+inline bool same_parts(MetricMeta const& a, MetricMeta const& b)
+{
+    return a.help() == b.help();
+}
+
+inline bool same_parts(Histogram const& a, Histogram const& b)
+{
+    return a.help() == b.help() && a.bounds() == b.bounds();
+}
+
+inline bool same_parts(Summary const& a, Summary const& b)
+{
+    return a.help() == b.help() && a.quantiles() == b.quantiles() && a.max_age() == b.max_age()
+        && a.age_buckets() == b.age_buckets() && a.accuracy() == b.accuracy();
+}
+
+inline bool same_parts(NativeHistogram const& a, NativeHistogram const& b)
+{
+    return a.help() == b.help() && a.schema() == b.schema();
+}
+
+inline bool same_parts(DenseCounter const& a, DenseCounter const& b)
+{
+    auto const& da = a.dimensions();
+    auto const& db = b.dimensions();
+    if (a.help() != b.help() || da.size() != db.size())
+        return false;
+    for (std::size_t i = 0; i < da.size(); ++i)
+        if (da[i].key != db[i].key || da[i].values != db[i].values)
+            return false;
+    return true;
+}
+
+// Without a schema the descriptor as it is, with one a copy named by it
+template<class T, class... Keys>
+T schema_descriptor(T const& desc, std::false_type)
+{
+    return desc;
+}
+
+template<class T, class... Keys>
+T schema_descriptor(T const& desc, std::true_type)
+{
+    if (!desc.keys().empty())
+        throw Error{"Metric '" + desc.name() + "' label names are set by its schema"};
+    return with_keys(desc, std::vector<std::string>{Keys::name()...});
+}
+
+template<class T, class... Keys>
+T schema_descriptor(T const& desc)
+{
+    return schema_descriptor<T, Keys...>(desc, std::integral_constant<bool, sizeof...(Keys) != 0>());
+}
+
+} // namespace detail
+
+//
+// Declares a label name for compile-time family schemas:
+//
+//     PROMXX_LABEL(Method, "method");
+//     PROMXX_LABEL(Code, "code");
+//     auto& f = family<Method, Code>(Counter("requests", "Requests"));
+//     f.labels("GET", "200").inc();
+//
+// Passing a wrong number of label values to such a family doesn't compile.
+//
+#define PROMXX_LABEL(TAG, NAME) \
+    struct TAG { static char const* name() noexcept { return NAME; } }
+
+//
+// Handle to all series of a metric, created by Registry::family.
+// labels() finds the series by label values or registers a new one.
+// Keys optionally fix the label names at compile time, see PROMXX_LABEL.
+// The index is split into shards with their own mutex, so lookups of
+// different series rarely contend, and finding an existing series
+// doesn't allocate. Series of a family should only be created through it.
+// remove() and expiry by the registry drop them from the index as well.
+//
+template<class T, class... Keys>
+class Family final: public detail::FamilyBase
+{
+public:
+    using base = typename detail::MetricImpl<T>::base;
+
+    Family(Registry& r, T const& desc)
+        : registry_(r), desc_(detail::schema_descriptor<T, Keys...>(desc)) {}
+
+    T const& descriptor() const noexcept { return desc_; }
+
+    // Whether desc is the one the family was made of, as passed to
+    // Registry::family
+    bool describes(T const& desc) const
+    {
+        return (sizeof...(Keys) == 0 ? desc.keys() == desc_.keys() : desc.keys().empty())
+            && detail::same_parts(desc, desc_);
+    }
+
+    template<class... Args>
+    base& labels(Args const&... args)
+    {
+        static_assert(sizeof...(Keys) == 0 || sizeof...(Args) == sizeof...(Keys),
+                      "Number of label values doesn't match the family schema");
+        std::array<detail::StringRef, sizeof...(Args)> values{{detail::StringRef(args)...}};
+        return get(values.data(), values.size());
+    }
+
+    base& labels(std::vector<std::string> const& values)
+    {
+        static_assert(sizeof...(Keys) == 0, "Use labels(values...) with a family schema");
+        std::vector<detail::StringRef> refs(values.begin(), values.end());
+        return get(refs.data(), refs.size());
+    }
+
+    // Removes the series, see Registry::remove
+    template<class... Args>
+    bool remove(Args const&... args)
+    {
+        static_assert(sizeof...(Keys) == 0 || sizeof...(Args) == sizeof...(Keys),
+                      "Number of label values doesn't match the family schema");
+        return registry_.remove(desc_, std::vector<std::string>{std::string(args)...});
+    }
+
+    bool remove(std::vector<std::string> const& values)
+    {
+        static_assert(sizeof...(Keys) == 0, "Use remove(values...) with a family schema");
+        return registry_.remove(desc_, values);
+    }
+
+    void forget(detail::Metric const* m) override
+    {
+        std::vector<std::size_t> hashes;
+        {
+            std::lock_guard<std::mutex> lock{index_mtx_};
+            auto range = index_.equal_range(m);
+            for (auto it = range.first; it != range.second; ++it)
+                hashes.push_back(it->second);
+            index_.erase(range.first, range.second);
+        }
+        for (auto h: hashes) {
+            auto& shard = shards_[h % SHARDS];
+            std::lock_guard<std::mutex> lock{shard.mtx};
+            auto range = shard.map.equal_range(h);
+            for (auto it = range.first; it != range.second;)
+                if (it->second.metric == m)
+                    it = shard.map.erase(it);
+                else
+                    ++it;
+        }
+    }
+
+private:
+    static std::size_t const SHARDS = 16;
+
+    struct Entry
+    {
+        std::vector<std::string> values;
+        base *series;
+        detail::Metric const* metric;
+    };
+
+    struct Shard
+    {
+        std::mutex mtx;
+        std::unordered_multimap<std::size_t, Entry> map;
+    };
+
+    Registry& registry_;
+    T const desc_;
+    Shard shards_[SHARDS];
+    // series to hashes of their entries, for forget()
+    std::unordered_multimap<detail::Metric const*, std::size_t> index_;
+    std::mutex index_mtx_;
+
+    static bool equal(Entry const& e, detail::StringRef const* values, std::size_t n) noexcept
+    {
+        if (e.values.size() != n)
+            return false;
+        for (std::size_t i = 0; i < n; ++i)
+            if (!(values[i] == e.values[i]))
+                return false;
+        return true;
+    }
+
+    base& get(detail::StringRef const* values, std::size_t n)
+    {
+        auto const h = detail::hash_values(values, n);
+        auto& shard = shards_[h % SHARDS];
+        std::lock_guard<std::mutex> lock{shard.mtx};
+
+        auto range = shard.map.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it)
+            if (equal(it->second, values, n))
+                return *it->second.series;
+
+        Entry e;
+        e.values.reserve(n);
+        for (std::size_t i = 0; i < n; ++i)
+            e.values.emplace_back(values[i].data, values[i].size);
+        e.series = &registry_.add(desc_, e.values);
+        e.metric = static_cast<detail::MetricImpl<T>*>(e.series);
+        auto& series = *e.series;
+        {
+            std::lock_guard<std::mutex> lock{index_mtx_};
+            index_.emplace(e.metric, h);
+        }
+        shard.map.emplace(h, std::move(e));
+        return series;
+    }
+};
+
+template<class... Keys, class T>
+Family<T, Keys...>& Registry::family(T const& desc)
+{
+    auto f = find_family(desc.name());
+    if (!f) {
+        std::unique_ptr<detail::FamilyBase> made{new Family<T, Keys...>(*this, desc)};
+        f = &push_family(desc.name(), std::move(made));
+    }
+    auto p = dynamic_cast<Family<T, Keys...>*>(f);
+    if (!p)
+        throw Error{"Metric '" + desc.name() + "' type is ambiguous"};
+    if (!p->describes(desc))
+        throw Error{"Metric '" + desc.name() + "' differs from the registered family"};
+    return *p;
+}
+
+template<class... Keys, class T>
+Family<T, Keys...>& family(T const& desc)
+{
+    return Registry::global().family<Keys...>(desc);
+}
+
+} // namespace promxx
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef PROMXX_FORMAT_HPP
+#define PROMXX_FORMAT_HPP
+
+#include <string>
+
+namespace promxx
+{
+
+//
+// Exposition formats
+// https://prometheus.io/docs/instrumenting/exposition_formats/
+//
+enum class Format
+{
+    Text,        // Prometheus text 0.0.4
+    OpenMetrics, // OpenMetrics text 1.0.0
+    Protobuf     // delimited io.prometheus.client.MetricFamily messages
+};
+
+// Value of the Content-Type response header
+char const* content_type(Format f) noexcept;
+
+// Format preferred by an Accept request header, Text if none is accepted
+Format negotiate(std::string const& accept);
+
+} // namespace promxx
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef PROMXX_GZIP_HPP
+#define PROMXX_GZIP_HPP
+
+#include <promxx/registry.hpp>
+
+namespace promxx
+{
+
+//
+// Compresses everything written into another sink, with zlib.
+// Compression runs as the output is written, so with a Writer over it
+// a flush never holds the whole uncompressed text, only zlib's window.
+// finish() writes the end of the gzip stream, then the sink can be
+// reused for the next one. Available when zlib is found at build time,
+// then PROMXX_HAVE_ZLIB is defined.
+//
+class GzipSink final: public Sink, detail::NoCopyMove
+{
+    struct Stream;
+    std::unique_ptr<Stream> z_;
+
+    void deflate(int flush);
+
+public:
+    // level is from 1 (fastest) to 9 (smallest)
+    explicit GzipSink(Sink& out, int level = 1);
+    ~GzipSink();
+
+    void write(char const* data, std::size_t size) override;
+
+    void finish();
+};
+
+} // namespace promxx
+
+#endif
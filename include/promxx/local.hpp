@@ -0,0 +1,182 @@
+#ifndef PROMXX_LOCAL_HPP
+#define PROMXX_LOCAL_HPP
+
+#include <promxx/registry.hpp>
+
+#include <mutex>
+
+namespace promxx
+{
+namespace detail
+{
+
+//
+// Base of thread-local batching handles.
+//
+// A handle is owned by a single thread which accumulates updates into
+// monotonic totals with plain loads and stores (no read-modify-write).
+// The difference between the totals and what was already published is
+// added into the shared metric under mtx_, either by the owner on commit
+// or by Registry::flush just before the scrape. So nothing is lost and
+// nothing is counted twice.
+//
+class LocalBase: NoCopyMove
+{
+    friend class promxx::Registry;
+
+    Registry *registry_;
+
+protected:
+    std::mutex mtx_;
+    std::size_t const threshold_;
+    std::size_t pending_ = 0;
+
+    LocalBase(Registry& r, std::size_t threshold);
+    virtual ~LocalBase();
+
+    // Must be called first in destructors of derived classes
+    void detach() noexcept;
+
+    // Called with mtx_ held
+    virtual void publish() noexcept = 0;
+
+    // The interface published into, its series isn't reclaimed while
+    // the handle is attached, see Registry::Pin
+    virtual void const* target() const noexcept = 0;
+
+    void tick()
+    {
+        if (++pending_ >= threshold_)
+            commit();
+    }
+
+public:
+    static std::size_t const THRESHOLD = 1024;
+
+    void commit();
+};
+
+} // namespace detail
+
+//
+// Handles must be used by one thread only and must not outlive
+// the registry and the metric they are bound to. A series removed from
+// the registry is kept while handles bound to it are.
+//
+
+class LocalCounter final: public detail::LocalBase
+{
+    ICounter& target_;
+    std::atomic<Unsigned> total_{0};
+    Unsigned published_ = 0;
+
+    void publish() noexcept override;
+    void const* target() const noexcept override { return &target_; }
+
+public:
+    explicit LocalCounter(ICounter& c,
+                          std::size_t threshold = THRESHOLD,
+                          Registry& r = Registry::global())
+        : detail::LocalBase(r, threshold), target_(c) {}
+
+    ~LocalCounter();
+
+    void inc(Unsigned d = 1)
+    {
+        total_.store(total_.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+        tick();
+    }
+};
+
+template<class T>
+class LocalGauge final: public detail::LocalBase
+{
+    IGauge<T>& target_;
+    std::atomic<T> total_{0};
+    T published_ = 0;
+
+    void publish() noexcept override
+    {
+        auto t = total_.load(std::memory_order_relaxed);
+        target_.inc(t - published_);
+        published_ = t;
+    }
+
+    void const* target() const noexcept override { return &target_; }
+
+public:
+    explicit LocalGauge(IGauge<T>& g,
+                        std::size_t threshold = THRESHOLD,
+                        Registry& r = Registry::global())
+        : detail::LocalBase(r, threshold), target_(g) {}
+
+    ~LocalGauge()
+    {
+        detach();
+        publish();
+    }
+
+    void inc(T d = 1)
+    {
+        total_.store(total_.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+        tick();
+    }
+
+    void dec(T d = 1)
+    {
+        total_.store(total_.load(std::memory_order_relaxed) - d, std::memory_order_relaxed);
+        tick();
+    }
+
+    // Not batched: drops the pending delta and sets the shared value
+    void set(T v)
+    {
+        std::lock_guard<std::mutex> lock{mtx_};
+        published_ = total_.load(std::memory_order_relaxed);
+        target_.set(v);
+        pending_ = 0;
+    }
+};
+
+class LocalHistogram final: public detail::LocalBase
+{
+    IHistogram& target_;
+    std::unique_ptr<std::atomic<Unsigned>[]> counts_;
+    std::unique_ptr<Unsigned[]> published_;
+    std::atomic<Unsigned> sum_{0};
+    Unsigned published_sum_ = 0;
+    std::atomic<double> real_sum_{0};
+    double published_real_sum_ = 0;
+
+    void publish() noexcept override;
+    void const* target() const noexcept override { return &target_; }
+
+public:
+    explicit LocalHistogram(IHistogram& h,
+                            std::size_t threshold = THRESHOLD,
+                            Registry& r = Registry::global());
+
+    ~LocalHistogram();
+
+    void observe(Unsigned v)
+    {
+        auto& c = counts_[target_.bucket(v)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum_.store(sum_.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        tick();
+    }
+
+    template<class F>
+    typename std::enable_if<std::is_floating_point<F>::value>::type
+    observe(F v)
+    {
+        auto& c = counts_[target_.bucket(double(v))];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        real_sum_.store(real_sum_.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        tick();
+    }
+};
+
+} // namespace promxx
+
+#endif
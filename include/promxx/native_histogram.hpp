@@ -0,0 +1,82 @@
+#ifndef PROMXX_NATIVE_HISTOGRAM_HPP
+#define PROMXX_NATIVE_HISTOGRAM_HPP
+
+#include <promxx/registry.hpp>
+#include <promxx/sparse_counts.hpp>
+
+namespace promxx
+{
+
+//
+// Native (sparse exponential) histogram
+// https://prometheus.io/docs/specs/native_histograms/
+//
+// Bucket boundaries are powers of 2^(2^-schema), schema is from -4 to 8.
+// Values with magnitude up to the zero threshold go to the zero bucket.
+//
+class NativeHistogram: public detail::MetricMeta
+{
+    int schema_;
+
+public:
+    static double const ZERO_THRESHOLD;
+
+    NativeHistogram(std::string name, int schema = 3,
+                    std::string help = {},
+                    std::vector<std::string> keys = {});
+
+    int schema() const noexcept { return schema_; }
+};
+
+class INativeHistogram: detail::NoCopyMove
+{
+public:
+    void observe(double v) noexcept;
+
+protected:
+    INativeHistogram(int schema);
+
+    // Key of the bucket holding positive v
+    long key(double v) const noexcept;
+
+    // Upper bound of the positive bucket
+    double bound(long key) const noexcept;
+
+    int const schema_;
+    detail::SparseCounts positive_;
+    detail::SparseCounts negative_;
+    std::atomic<Unsigned> zero_{0};
+    std::atomic<Unsigned> count_{0};
+    std::atomic<double> sum_{0};
+};
+
+namespace detail
+{
+
+//
+// In the text format a native histogram is written as a classic one
+// with a bucket for every populated native bucket.
+//
+template<>
+struct MetricImpl<NativeHistogram> final: Metric, INativeHistogram
+{
+    using base = INativeHistogram;
+
+    MetricImpl(NativeHistogram const& h, std::vector<std::string> const& values);
+
+    void snapshot(std::vector<Unsigned>& cells) const override;
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override;
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells,
+                           Unsigned const* exemplars) const override;
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override;
+
+private:
+    std::string bucket_;
+    Prefixes lines_; // +Inf, _sum and _count
+};
+
+} // namespace detail
+} // namespace promxx
+
+#endif
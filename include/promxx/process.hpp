@@ -0,0 +1,41 @@
+#ifndef PROMXX_PROCESS_HPP
+#define PROMXX_PROCESS_HPP
+
+#include <promxx/registry.hpp>
+
+namespace promxx
+{
+
+//
+// Standard process metrics, read from /proc on scrapes:
+// process_cpu_seconds_total, process_start_time_seconds,
+// process_virtual_memory_bytes, process_resident_memory_bytes,
+// process_open_fds, process_max_fds and process_threads.
+// https://prometheus.io/docs/instrumenting/writing_clientlibs/#process-metrics
+//
+// A sample is one read each of /proc/self/stat and statm, kept open,
+// into a buffer kept as well, and a walk of /proc/self/fd. It's reused
+// by scrapes within max_age, so several scrapers don't repeat it.
+// Metrics that can't be read are left out. Available on Linux, then
+// PROMXX_HAVE_PROCESS is defined.
+//
+class ProcessCollector final: public Collector, detail::NoCopyMove
+{
+    struct Data;
+    std::unique_ptr<Data> data_;
+
+    void sample();
+
+public:
+    explicit ProcessCollector(std::chrono::milliseconds max_age = std::chrono::milliseconds(1000));
+    ~ProcessCollector();
+
+    void collect(Collection& c) override;
+};
+
+// Adds a ProcessCollector to the registry
+Collector& add_process_collector(Registry& r = Registry::global());
+
+} // namespace promxx
+
+#endif
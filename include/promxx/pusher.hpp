@@ -0,0 +1,85 @@
+#ifndef PROMXX_PUSHER_HPP
+#define PROMXX_PUSHER_HPP
+
+#include <promxx/registry.hpp>
+
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace promxx
+{
+
+//
+// Pushes registry snapshots over HTTP from a thread of its own, for jobs
+// that live too short to be scraped, see the promxx_pusher target.
+//
+// Every interval, or on push(), the thread takes a snapshot, encodes it
+// and queues it, then sends the queue. Failed sends are retried with
+// exponential backoff up to max_retries. The queue holds at most
+// max_queue bytes, the oldest payloads are dropped past that. Application
+// threads only meet it on the registry lock, for as long as a snapshot.
+//
+// Pushgateway mode PUTs the text format to path, which names the group,
+// e.g. /metrics/job/<job>. Only the latest snapshot is worth sending, so
+// the queue holds one.
+//
+// RemoteWrite mode POSTs snappy compressed WriteRequest protobufs of the
+// Prometheus remote write protocol 1.0, each sample timestamped when its
+// snapshot was taken. Queued snapshots are batched into requests of up
+// to max_batch bytes before compression.
+// https://prometheus.io/docs/specs/remote_write_spec/
+//
+class Pusher: detail::NoCopyMove
+{
+    struct Data;
+    Data *data_;
+
+public:
+    enum class Mode { Pushgateway, RemoteWrite };
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        unsigned short port = 9091;
+        std::string path = "/metrics/job/promxx";
+        Mode mode = Mode::Pushgateway;
+        // extra request headers, e.g. for authorization
+        std::vector<std::pair<std::string, std::string>> headers;
+        std::chrono::milliseconds interval{10000};
+        // of a connection and of each request
+        std::chrono::milliseconds timeout{5000};
+        std::chrono::milliseconds min_backoff{100};
+        std::chrono::milliseconds max_backoff{10000};
+        unsigned max_retries = 5;
+        std::size_t max_queue = 16 << 20;
+        std::size_t max_batch = 1 << 20;
+    };
+
+    struct Stats
+    {
+        Unsigned sent = 0;     // requests answered with success
+        Unsigned retries = 0;  // failed attempts retried later
+        Unsigned dropped = 0;  // snapshots given up or dropped from the queue
+    };
+
+    explicit Pusher(Options options, Registry& r = Registry::global());
+
+    // Pushes a last snapshot, trying for up to about timeout, so a job can
+    // end right after
+    ~Pusher();
+
+    // Asks for a snapshot to be pushed now, without waiting for it
+    void push();
+
+    Stats stats() const;
+};
+
+// Remote write request of the snapshot with samples at timestamp,
+// in milliseconds since the epoch, for Pusher and tests
+std::string remote_write_request(Snapshot const& s, long long timestamp);
+
+} // namespace promxx
+
+#endif
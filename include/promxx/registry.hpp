@@ -1,12 +1,32 @@
 #ifndef PROMXX_HPP
 #define PROMXX_HPP
 
+#include <promxx/format.hpp>
+#include <promxx/writer.hpp>
+
 #include <atomic>
-#include <mutex>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
 #include <ostream>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+//
+// Memory order of metric updates and of reads on flush. Metrics are not
+// used to synchronize other memory, so relaxed is enough. Must be the same
+// in every translation unit, see PROMXX_SEQ_CST in CMakeLists.txt.
+//
+#ifndef PROMXX_MEMORY_ORDER
+#define PROMXX_MEMORY_ORDER std::memory_order_relaxed
+#endif
+
 namespace promxx
 {
 
@@ -26,6 +46,43 @@ public:
 namespace detail
 {
 
+constexpr std::memory_order MEMORY_ORDER = PROMXX_MEMORY_ORDER;
+
+// Lock-free add, floating point atomics have no fetch_add before C++20
+template<class T>
+typename std::enable_if<std::is_integral<T>::value>::type
+atomic_add(std::atomic<T>& a, T d) noexcept
+{
+    a.fetch_add(d, MEMORY_ORDER);
+}
+
+template<class T>
+typename std::enable_if<std::is_floating_point<T>::value>::type
+atomic_add(std::atomic<T>& a, T d) noexcept
+{
+    auto old = a.load(std::memory_order_relaxed);
+    while (!a.compare_exchange_weak(old, old + d, MEMORY_ORDER, std::memory_order_relaxed))
+        ;
+}
+
+// Snapshot cell, values of other types are stored bitwise
+template<class T>
+Unsigned to_cell(T v) noexcept
+{
+    static_assert(sizeof(T) <= sizeof(Unsigned), "Value doesn't fit into a cell");
+    Unsigned c = 0;
+    std::memcpy(&c, &v, sizeof(T));
+    return c;
+}
+
+template<class T>
+T from_cell(Unsigned c) noexcept
+{
+    T v;
+    std::memcpy(&v, &c, sizeof(T));
+    return v;
+}
+
 struct NoCopyMove
 {
     NoCopyMove() = default;
@@ -43,16 +100,60 @@ struct AtomicValue: NoCopyMove
 
 using KeyValueI = std::pair<std::string, std::size_t>;
 
+// Non-owning string argument, so lookups don't build std::string
+struct StringRef
+{
+    char const* data;
+    std::size_t size;
+
+    StringRef(std::string const& s) noexcept: data(s.data()), size(s.size()) {}
+    StringRef(char const* s) noexcept: data(s), size(std::strlen(s)) {}
+    StringRef(char const* s, std::size_t n) noexcept: data(s), size(n) {}
+
+    bool operator == (std::string const& s) const noexcept
+    {
+        return size == s.size() && std::memcmp(data, s.data(), size) == 0;
+    }
+
+    bool operator == (StringRef const& s) const noexcept
+    {
+        return size == s.size && std::memcmp(data, s.data, size) == 0;
+    }
+
+    bool empty() const noexcept { return size == 0; }
+
+    std::string str() const { return std::string(data, size); }
+};
+
+// Strings of a family, shared by its descriptors and series
+struct Names
+{
+    std::string name;
+    std::string help;
+
+    bool operator == (Names const& other) const noexcept
+    {
+        return name == other.name && help == other.help;
+    }
+};
+
 class MetricMeta
 {
     friend class Metric;
 
-    std::string name_;
+    std::shared_ptr<Names const> names_;
     std::vector<KeyValueI> keys_;
-    std::string help_;
 
 protected:
     MetricMeta(std::string name, std::vector<std::string> keys, std::string help);
+
+public:
+    std::string const& name() const noexcept { return names_->name; }
+    std::string const& help() const noexcept { return names_->help; }
+    std::vector<KeyValueI> const& keys() const noexcept { return keys_; }
+
+    // Labels of the series with the values, as Metric::labels() renders them
+    std::string labels(std::vector<std::string> const& values) const;
 };
 
 template<class T>
@@ -63,7 +164,139 @@ struct AutoBuckets
     std::size_t count;
 };
 
-}; // namespace detail
+std::size_t const CACHE_LINE = 64;
+
+// One value per cache line, so neighbouring cells never share a line
+struct PaddedAtomic
+{
+    std::atomic<Unsigned> v_{0};
+    char pad_[CACHE_LINE - sizeof(std::atomic<Unsigned>)];
+};
+
+// Small per-thread number, assigned round-robin on first use
+inline std::size_t thread_shard() noexcept
+{
+    static std::atomic<std::size_t> next{0};
+    thread_local std::size_t shard = next.fetch_add(1, std::memory_order_relaxed);
+    return shard;
+}
+
+} // namespace detail
+
+// Labels of an exemplar, as in observe(v, {{"trace_id", id}})
+using Exemplar = std::initializer_list<std::pair<detail::StringRef, detail::StringRef>>;
+
+// An exemplar of a bucket or a counter is replaced at most once per
+// interval, 0 by default. Exemplars in between are dropped.
+void exemplar_interval(std::chrono::milliseconds interval) noexcept;
+
+namespace detail
+{
+
+//
+// Latest exemplar of a bucket or a counter. A seqlock: the sequence
+// number is odd while a write is in progress and readers retry if it
+// changed under them. A writer finding another one at it drops its
+// exemplar rather than waiting. The first exemplar of a series allocates
+// its slots, later ones are stored in place without allocating. Series
+// without any have no slots, and add nothing to snapshots.
+//
+class ExemplarSlot: NoCopyMove
+{
+public:
+    // characters of label names and values, as OpenMetrics allows
+    static std::size_t const MAX_LABELS = 128;
+
+    // Array of n slots, made if there's none yet
+    static ExemplarSlot* slots(std::atomic<ExemplarSlot*>& a, std::size_t n);
+
+    // Drops the exemplar if its labels are too long or within the interval
+    void store(Exemplar e, double value) noexcept;
+
+    // Appends the exemplar as cells, one 0 cell if there's none
+    void snapshot(std::vector<Unsigned>& cells) const;
+
+    // The cells of a slot or of none, from snapshot
+    static Unsigned const* skip(Unsigned const* cells) noexcept;
+
+    // Writes " # {labels} value timestamp" of the exemplar, if any
+    static Unsigned const* format(Writer& w, Unsigned const* cells);
+
+    // Writes an Exemplar message as field, if any
+    static Unsigned const* encode(ProtoWriter& p, unsigned field, Unsigned const* cells);
+
+private:
+    // labels as a length byte and the name, then the same of the value
+    static std::size_t const WORDS = (MAX_LABELS + 32) / sizeof(Unsigned);
+
+    std::atomic<Unsigned> seq_{0};
+    std::atomic<Unsigned> time_{0}; // milliseconds since the epoch, 0 if none
+    std::atomic<Unsigned> value_{0};
+    std::atomic<Unsigned> size_{0}; // bytes of labels
+    std::atomic<Unsigned> labels_[WORDS] = {};
+};
+
+//
+// Exemplars of a snapshot apart from its values, listed only for series
+// with slots: their ExemplarSlot cells back to back, and where those of
+// each series start.
+//
+struct ExemplarTable
+{
+    struct Entry
+    {
+        std::size_t series; // index in the snapshot
+        std::size_t cell;
+
+        bool operator == (Entry const& other) const noexcept
+        {
+            return series == other.series && cell == other.cell;
+        }
+    };
+
+    std::vector<Entry> entries; // by series
+    std::vector<Unsigned> cells;
+
+    // Cells to append those of the series to
+    std::vector<Unsigned>& add(std::size_t series)
+    {
+        entries.push_back({series, cells.size()});
+        return cells;
+    }
+
+    void clear() noexcept
+    {
+        entries.clear();
+        cells.clear();
+    }
+
+    bool operator == (ExemplarTable const& other) const noexcept
+    {
+        return entries == other.entries && cells == other.cells;
+    }
+};
+
+// Finds exemplars of series in increasing order of index
+class ExemplarCursor
+{
+    ExemplarTable::Entry const* next_;
+    ExemplarTable::Entry const* end_;
+    Unsigned const* cells_;
+
+public:
+    // From the series on
+    ExemplarCursor(ExemplarTable const& t, std::size_t series) noexcept;
+
+    // Cells of the exemplars of the series, null if it has none
+    Unsigned const* at(std::size_t series) noexcept
+    {
+        while (next_ != end_ && next_->series < series)
+            ++next_;
+        return next_ != end_ && next_->series == series ? cells_ + (next_++)->cell : nullptr;
+    }
+};
+
+} // namespace detail
 
 class Counter: public detail::MetricMeta
 {
@@ -74,6 +307,25 @@ public:
         : detail::MetricMeta(std::move(name), std::move(keys), std::move(help)) {}
 };
 
+// Counter of a real number, like seconds of CPU time
+class RealCounter: public detail::MetricMeta
+{
+public:
+    RealCounter(std::string name,
+                std::string help = {},
+                std::vector<std::string> keys = {})
+        : detail::MetricMeta(std::move(name), std::move(keys), std::move(help)) {}
+};
+
+class ShardedCounter: public detail::MetricMeta
+{
+public:
+    ShardedCounter(std::string name,
+                   std::string help = {},
+                   std::vector<std::string> keys = {})
+        : detail::MetricMeta(std::move(name), std::move(keys), std::move(help)) {}
+};
+
 template<class T>
 class Gauge: public detail::MetricMeta
 {
@@ -90,7 +342,14 @@ using ExponentialBuckets = detail::AutoBuckets<double>;
 
 class Histogram: public detail::MetricMeta
 {
+public:
+    // How bounds were built, lets observe find the bucket by arithmetic
+    enum class Layout { Explicit, Linear, Exponential };
+
+private:
     Buckets bounds_;
+    Layout layout_ = Layout::Explicit;
+    double delta_ = 0;
 
 public:
     Histogram(std::string name, Buckets bounds,
@@ -105,7 +364,36 @@ public:
               std::string help = {},
               std::vector<std::string> keys = {});
 
+    // Same histogram with other label names
+    Histogram(Histogram const& h, std::vector<std::string> keys);
+
     Buckets const& bounds() const noexcept { return bounds_; }
+    Layout layout() const noexcept { return layout_; }
+    double delta() const noexcept { return delta_; }
+};
+
+// Label with a closed set of values
+struct Dimension
+{
+    std::string key;
+    std::vector<std::string> values;
+};
+
+//
+// Counter with dimensions known upfront, all combinations of their
+// values are stored as one flat array. Extra keys get their values
+// on registration as usual.
+//
+class DenseCounter: public detail::MetricMeta
+{
+    std::vector<Dimension> dims_;
+
+public:
+    DenseCounter(std::string name, std::vector<Dimension> dims,
+                 std::string help = {},
+                 std::vector<std::string> keys = {});
+
+    std::vector<Dimension> const& dimensions() const noexcept { return dims_; }
 };
 
 //
@@ -113,9 +401,92 @@ public:
 // https://prometheus.io/docs/concepts/metric_types/#counter
 //
 class ICounter: protected detail::AtomicValue<Unsigned>
+{
+    friend class IDenseCounter;
+    friend class SharedSegment;
+
+public:
+    void inc(Unsigned d = 1) noexcept { this->v_.fetch_add(d, detail::MEMORY_ORDER); }
+};
+
+//
+// Counter of a registry, with the latest exemplar of increments. It's
+// in OpenMetrics and protobuf output, not in the text format.
+//
+class IExemplarCounter: public ICounter
+{
+public:
+    using ICounter::inc;
+
+    void inc(Unsigned d, Exemplar e) noexcept;
+
+protected:
+    IExemplarCounter() = default;
+    ~IExemplarCounter();
+
+    std::atomic<detail::ExemplarSlot*> exemplar_{nullptr};
+};
+
+class IRealCounter: protected detail::AtomicValue<double>
+{
+    friend class SharedSegment;
+
+public:
+    void inc(double d = 1) noexcept { detail::atomic_add(this->v_, d); }
+};
+
+//
+// Counter split into cache-line padded cells, one per thread shard.
+// Cells are summed up only on flush.
+//
+class IShardedCounter: detail::NoCopyMove
 {
 public:
-    void inc(Unsigned d = 1) noexcept { this->v_ += d; }
+    void inc(Unsigned d = 1) noexcept
+    {
+        cells_[detail::thread_shard() & mask_].v_.fetch_add(d, detail::MEMORY_ORDER);
+    }
+
+protected:
+    IShardedCounter();
+
+    Unsigned value() const noexcept;
+
+    std::size_t mask_;
+    std::unique_ptr<detail::PaddedAtomic[]> cells_;
+};
+
+//
+// Dense counter, at(i, j, ...) takes value indices of the dimensions
+// in the declared order, one per dimension. The number of indices and
+// their ranges are checked by assert only, so in debug builds.
+//
+class IDenseCounter: detail::NoCopyMove
+{
+public:
+    template<class... I>
+    ICounter& at(I... idx) noexcept
+    {
+        static_assert(sizeof...(I) > 0, "At least one index is required");
+        assert(sizeof...(I) == strides_.size() && "One index per dimension is required");
+        std::size_t const i[] = {static_cast<std::size_t>(idx)...};
+        std::size_t offset = 0;
+        for (std::size_t d = 0; d < sizeof...(I); ++d) {
+            assert(i[d] < extents_[d] && "Index out of the dimension values");
+            offset += i[d] * strides_[d];
+        }
+        return cells_[offset];
+    }
+
+protected:
+    IDenseCounter(std::vector<Dimension> const& dims);
+
+    Unsigned value(std::size_t i) const noexcept { return cells_[i].v_.load(detail::MEMORY_ORDER); }
+
+    std::vector<std::size_t> strides_;
+    std::vector<std::size_t> extents_; // number of values of each dimension
+    std::size_t size_;
+    std::unique_ptr<ICounter[]> cells_;
 };
 
 //
@@ -125,74 +496,446 @@ public:
 template<class T>
 class IGauge: protected detail::AtomicValue<T>
 {
+    friend class SharedSegment;
+
 public:
-    void inc(T d = 1) noexcept { this->v_ += d; }
-    void dec(T d = 1) noexcept { this->v_ -= d; }
-    void set(T v) noexcept { this->v_ = v; }
+    void inc(T d = 1) noexcept { detail::atomic_add(this->v_, d); }
+    void dec(T d = 1) noexcept { detail::atomic_add(this->v_, static_cast<T>(-d)); }
+    void set(T v) noexcept { this->v_.store(v, detail::MEMORY_ORDER); }
 };
 
 //
 // Histogram
 // https://prometheus.io/docs/concepts/metric_types/#histogram
 //
+// Buckets are stored non-cumulative, one atomic per bucket plus the
+// implicit +Inf one, so observe is a search and a couple of relaxed
+// increments. Cumulative values and the total count are computed on flush.
+// Floating point observations are summed up separately, so integer ones
+// keep an exact sum. The integer sum is 128 bits: carries out of the low
+// word go to sum_hi_, so it never wraps and rate() sees no false reset.
+// Observations with an exemplar keep it as the latest of their bucket,
+// see ExemplarSlot.
+//
 class IHistogram: detail::NoCopyMove
 {
+    friend class LocalHistogram;
+    friend class SharedSegment;
+
 public:
     void observe(Unsigned v) noexcept;
 
+    template<class F>
+    typename std::enable_if<std::is_floating_point<F>::value>::type
+    observe(F v) noexcept { observe_real(v); }
+
+    void observe(Unsigned v, Exemplar e) noexcept;
+
+    template<class F>
+    typename std::enable_if<std::is_floating_point<F>::value>::type
+    observe(F v, Exemplar e) noexcept
+    {
+        observe_real(v);
+        exemplar(bucket(double(v)), e, double(v));
+    }
+
 protected:
-    IHistogram(Buckets const& bounds);
+    IHistogram(Histogram const& h);
+    ~IHistogram();
 
-    std::vector<std::pair<Unsigned, Unsigned>> buckets_;
-    Unsigned sum_ = 0;
-    Unsigned count_ = 0;
-    mutable std::mutex mtx_;
+    void exemplar(std::size_t i, Exemplar e, double v) noexcept;
+
+    std::size_t bucket(Unsigned v) const noexcept;
+
+    // Bucket of a floating point value, NaN goes to +Inf
+    std::size_t bucket(double v) const noexcept;
+
+    void observe_real(double v) noexcept;
+
+    void add_sum(Unsigned d) noexcept
+    {
+        // the low word wrapped around
+        if (sum_.fetch_add(d, detail::MEMORY_ORDER) > ~d)
+            sum_hi_.fetch_add(1, detail::MEMORY_ORDER);
+    }
+
+    Buckets bounds_;
+    Histogram::Layout layout_;
+    Unsigned step_ = 0;        // linear
+    double log_start_ = 0;     // exponential
+    double inv_log_delta_ = 0; // exponential
+    std::unique_ptr<std::atomic<Unsigned>[]> counts_;
+    std::atomic<Unsigned> sum_{0};
+    std::atomic<Unsigned> sum_hi_{0};
+    std::atomic<double> real_sum_{0};
+    // one per bucket
+    std::atomic<detail::ExemplarSlot*> exemplars_{nullptr};
 };
 
+class Registry;
+
+template<class T, class... Keys>
+class Family;
+
 namespace detail
 {
 
+class LocalBase;
+class FamilyBase;
+struct Epochs;
+
+// Byte prefixes of output lines stored back to back
+class Prefixes
+{
+    std::string data_;
+    std::vector<std::size_t> ends_;
+
+public:
+    void add(std::string const& s)
+    {
+        data_ += s;
+        ends_.push_back(data_.size());
+    }
+
+    bool empty() const noexcept { return ends_.empty(); }
+
+    Writer& write(Writer& w, std::size_t i) const
+    {
+        auto begin = i > 0 ? ends_[i - 1] : 0;
+        w.write(data_.data() + begin, ends_[i] - begin);
+        return w;
+    }
+
+    ProtoWriter& write(ProtoWriter& p, std::size_t i) const
+    {
+        auto begin = i > 0 ? ends_[i - 1] : 0;
+        p.raw(data_.data() + begin, ends_[i] - begin);
+        return p;
+    }
+};
+
+// Field numbers of metrics.proto messages, package io.prometheus.client
+namespace pb
+{
+enum: unsigned
+{
+    FAMILY_NAME = 1, FAMILY_HELP = 2, FAMILY_TYPE = 3, FAMILY_METRIC = 4,
+    TYPE_COUNTER = 0, TYPE_GAUGE = 1, TYPE_SUMMARY = 2, TYPE_HISTOGRAM = 4,
+    METRIC_LABEL = 1, METRIC_GAUGE = 2, METRIC_COUNTER = 3,
+    METRIC_SUMMARY = 4, METRIC_HISTOGRAM = 7,
+    LABEL_NAME = 1, LABEL_VALUE = 2,
+    VALUE = 1, // of Gauge and Counter
+    SAMPLE_COUNT = 1, SAMPLE_SUM = 2, // of Summary and Histogram
+    SUMMARY_QUANTILE = 3, QUANTILE_QUANTILE = 1, QUANTILE_VALUE = 2,
+    HISTOGRAM_BUCKET = 3, BUCKET_CUMULATIVE_COUNT = 1, BUCKET_UPPER_BOUND = 2,
+    HISTOGRAM_SCHEMA = 5, HISTOGRAM_ZERO_THRESHOLD = 6, HISTOGRAM_ZERO_COUNT = 7,
+    HISTOGRAM_NEGATIVE_SPAN = 9, HISTOGRAM_NEGATIVE_DELTA = 10,
+    HISTOGRAM_POSITIVE_SPAN = 12, HISTOGRAM_POSITIVE_DELTA = 13,
+    SPAN_OFFSET = 1, SPAN_LENGTH = 2,
+    COUNTER_EXEMPLAR = 2, BUCKET_EXEMPLAR = 3,
+    EXEMPLAR_LABEL = 1, EXEMPLAR_VALUE = 2, EXEMPLAR_TIMESTAMP = 3,
+    TIMESTAMP_SECONDS = 1, TIMESTAMP_NANOS = 2
+};
+
+// Encodes a LabelPair as a field of Metric
+void label_pair(ProtoWriter& p, std::string const& name, std::string const& value);
+
+} // namespace pb
+
+// Field numbers of remote write types.proto, package prometheus. A Label
+// is encoded as a LabelPair, and TimeSeries labels as Metric ones.
+namespace rw
+{
+enum: unsigned
+{
+    REQUEST_TIMESERIES = 1,
+    SERIES_LABELS = 1, SERIES_SAMPLES = 2,
+    LABEL_NAME = 1, LABEL_VALUE = 2,
+    SAMPLE_VALUE = 1, SAMPLE_TIMESTAMP = 2
+};
+} // namespace rw
+
+//
+// Base of series. Family strings are shared, and the labels are kept
+// only inside the line prefix, to keep series small: they are allocated
+// next to each other from an arena of their family, see Registry::add.
+//
 class Metric
 {
-    std::string name_;
-    std::string type_;
-    std::string help_;
-    std::string labels_;
+    friend class promxx::Registry;
+
+    std::shared_ptr<Names const> names_;
+    char const* type_;
+    std::size_t labels_size_ = 0;
+    std::string prefix_; // name{labels} or name and a space
+    std::string pairs_;  // labels as encoded LabelPair fields
+    // where __name__ and the extra label go in pairs_, sorted by name
+    std::size_t name_at_ = 0;
+    std::size_t extra_at_ = 0;
 
 protected:
-    std::ostream& header(std::ostream& os,
-                         std::string const& suffix = {},
-                         std::string const& extkey = {}) const;
+    // Remote write TimeSeries of a sample: the name with the suffix, the
+    // labels and the extra label, given at construction, if extvalue is
+    void remote_sample(ProtoWriter& p, long long timestamp, double v,
+                       std::string const& suffix = {}, StringRef extkey = "",
+                       StringRef extvalue = "") const;
+
+    // Line prefix up to the value, rendered once at construction
+    std::string header(std::string const& suffix = {},
+                       std::string const& extkey = {},
+                       std::string const& extvalue = {}) const;
+
+    // OpenMetrics counter lines end with _total, empty if the name does
+    std::string total_header() const;
+
+    Writer& prefix(Writer& w) const
+    {
+        w.write(prefix_.data(), prefix_.size());
+        return w;
+    }
+
+    ProtoWriter& label_pairs(ProtoWriter& p) const
+    {
+        p.raw(pairs_);
+        return p;
+    }
+
+    // Metric message with a Counter or a Gauge
+    void encode_value(ProtoWriter& p, unsigned field, double v) const;
 
 public:
-    Metric(std::string type, MetricMeta const& mm,
-           std::vector<std::string> const& values);
+    // type is a string literal, extkey the label a type adds to some
+    // lines, as le of histograms
+    Metric(char const* type, MetricMeta const& mm,
+           std::vector<std::string> const& values, std::string const& extkey = {});
 
     virtual ~Metric();
 
-    std::string const& name() const noexcept { return name_; }
-    std::string const& type() const noexcept { return type_; }
-    std::string const& help() const noexcept { return help_; }
-    std::string const& labels() const noexcept { return labels_; }
+    std::string const& name() const noexcept { return names_->name; }
+    std::string type() const { return type_; }
+    std::string const& help() const noexcept { return names_->help; }
+
+    // Same name, type, help and labels
+    bool same_series(Metric const& other) const noexcept
+    {
+        return prefix_ == other.prefix_ && std::strcmp(type_, other.type_) == 0
+            && help() == other.help();
+    }
+
+    // Rendered labels, as in k1="v1",k2="v2"
+    StringRef labels() const noexcept
+    {
+        return StringRef(prefix_.data() + (labels_size_ ? names_->name.size() + 1 : 0), labels_size_);
+    }
+
+    // Appends current values, called under the registry lock
+    virtual void snapshot(std::vector<Unsigned>& cells) const = 0;
+
+    // Adds the exemplars of the series, which is the one at the index of
+    // the snapshot, if it has any
+    virtual void snapshot_exemplars(ExemplarTable& t, std::size_t series) const
+    {
+        (void)t;
+        (void)series;
+    }
+
+    // Formats values taken by snapshot, returns the next unused cell
+    virtual Unsigned const* format(Writer& w, Unsigned const* cells) const = 0;
 
-    virtual void flush(std::ostream& os) const = 0;
+    // The same in OpenMetrics text, which differs for counters, and shows
+    // exemplars: their cells from snapshot_exemplars, null if none
+    virtual Unsigned const* format_openmetrics(Writer& w, Unsigned const* cells,
+                                               Unsigned const* exemplars) const
+    {
+        (void)exemplars;
+        return format(w, cells);
+    }
+
+    // Appends Metric messages of the series to a MetricFamily
+    virtual Unsigned const* encode(ProtoWriter& p, Unsigned const* cells,
+                                   Unsigned const* exemplars) const = 0;
+
+    // Appends remote write TimeSeries of the lines of the text format,
+    // samples at timestamp in milliseconds since the epoch
+    virtual Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                         long long timestamp) const = 0;
+
+    // Whether p points into memory of the series kept outside of the
+    // object, as the cells of a DenseCounter
+    virtual bool owns(void const* p) const noexcept
+    {
+        (void)p;
+        return false;
+    }
 };
 
 template<class T>
 struct MetricImpl;
 
 template<>
-struct MetricImpl<Counter> final: Metric, ICounter
+struct MetricImpl<Counter> final: Metric, IExemplarCounter
 {
-    using base = ICounter;
+    using base = IExemplarCounter;
 
     MetricImpl(Counter const& c, std::vector<std::string> const& values)
-        : Metric("counter", c, values) {}
+        : Metric("counter", c, values), total_(total_header()) {}
+
+    void snapshot(std::vector<Unsigned>& cells) const override
+    {
+        cells.push_back(this->v_.load(MEMORY_ORDER));
+    }
+
+    void snapshot_exemplars(ExemplarTable& t, std::size_t series) const override
+    {
+        if (auto x = exemplar_.load(std::memory_order_acquire))
+            x->snapshot(t.add(series));
+    }
+
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override
+    {
+        prefix(w) << *cells << '\n';
+        return cells + 1;
+    }
+
+    Unsigned const* format_openmetrics(Writer& w, Unsigned const* cells,
+                                       Unsigned const* exemplars) const override
+    {
+        (total_.empty() ? prefix(w) : w << total_) << *cells;
+        if (exemplars)
+            ExemplarSlot::format(w, exemplars);
+        w << '\n';
+        return cells + 1;
+    }
 
-    void flush(std::ostream& os) const override
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells,
+                           Unsigned const* exemplars) const override;
+
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override
     {
-        header(os) << ' ' << this->v_ << '\n';
+        remote_sample(p, timestamp, double(*cells));
+        return cells + 1;
     }
+
+private:
+    std::string const total_;
+};
+
+template<>
+struct MetricImpl<RealCounter> final: Metric, IRealCounter
+{
+    using base = IRealCounter;
+
+    MetricImpl(RealCounter const& c, std::vector<std::string> const& values)
+        : Metric("counter", c, values), total_(total_header()) {}
+
+    void snapshot(std::vector<Unsigned>& cells) const override
+    {
+        cells.push_back(to_cell(this->v_.load(MEMORY_ORDER)));
+    }
+
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override
+    {
+        prefix(w) << from_cell<double>(*cells) << '\n';
+        return cells + 1;
+    }
+
+    Unsigned const* format_openmetrics(Writer& w, Unsigned const* cells,
+                                       Unsigned const*) const override
+    {
+        (total_.empty() ? prefix(w) : w << total_) << from_cell<double>(*cells) << '\n';
+        return cells + 1;
+    }
+
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells, Unsigned const*) const override
+    {
+        encode_value(p, pb::METRIC_COUNTER, from_cell<double>(*cells));
+        return cells + 1;
+    }
+
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override
+    {
+        remote_sample(p, timestamp, from_cell<double>(*cells));
+        return cells + 1;
+    }
+
+private:
+    std::string const total_;
+};
+
+template<>
+struct MetricImpl<ShardedCounter> final: Metric, IShardedCounter
+{
+    using base = IShardedCounter;
+
+    MetricImpl(ShardedCounter const& c, std::vector<std::string> const& values)
+        : Metric("counter", c, values), total_(total_header()) {}
+
+    void snapshot(std::vector<Unsigned>& cells) const override
+    {
+        cells.push_back(value());
+    }
+
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override
+    {
+        prefix(w) << *cells << '\n';
+        return cells + 1;
+    }
+
+    Unsigned const* format_openmetrics(Writer& w, Unsigned const* cells,
+                                       Unsigned const*) const override
+    {
+        (total_.empty() ? prefix(w) : w << total_) << *cells << '\n';
+        return cells + 1;
+    }
+
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells, Unsigned const*) const override
+    {
+        encode_value(p, pb::METRIC_COUNTER, double(*cells));
+        return cells + 1;
+    }
+
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override
+    {
+        remote_sample(p, timestamp, double(*cells));
+        return cells + 1;
+    }
+
+private:
+    std::string const total_;
+};
+
+template<>
+struct MetricImpl<DenseCounter> final: Metric, IDenseCounter
+{
+    using base = IDenseCounter;
+
+    MetricImpl(DenseCounter const& c, std::vector<std::string> const& values);
+
+    void snapshot(std::vector<Unsigned>& cells) const override;
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override;
+    Unsigned const* format_openmetrics(Writer& w, Unsigned const* cells,
+                                       Unsigned const* exemplars) const override;
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells,
+                           Unsigned const* exemplars) const override;
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override;
+
+    bool owns(void const* p) const noexcept override
+    {
+        std::less<void const*> const lt;
+        return !lt(p, cells_.get()) && lt(p, cells_.get() + size_);
+    }
+
+private:
+    // one line per cell, OpenMetrics ones if they differ, LabelPair fields
+    // without and with __name__
+    Prefixes lines_;
+    Prefixes totals_;
+    Prefixes pairs_;
+    Prefixes remote_pairs_;
 };
 
 template<class T>
@@ -203,9 +946,28 @@ struct MetricImpl<Gauge<T>> final: Metric, IGauge<T>
     MetricImpl(Gauge<T> const& g, std::vector<std::string> const& values)
         : Metric("gauge", g, values) {}
 
-    void flush(std::ostream& os) const override
+    void snapshot(std::vector<Unsigned>& cells) const override
+    {
+        cells.push_back(to_cell(this->v_.load(MEMORY_ORDER)));
+    }
+
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override
+    {
+        prefix(w) << from_cell<T>(*cells) << '\n';
+        return cells + 1;
+    }
+
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells, Unsigned const*) const override
+    {
+        encode_value(p, pb::METRIC_GAUGE, double(from_cell<T>(*cells)));
+        return cells + 1;
+    }
+
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override
     {
-        header(os) << ' ' << this->v_ << '\n';
+        remote_sample(p, timestamp, double(from_cell<T>(*cells)));
+        return cells + 1;
     }
 };
 
@@ -214,22 +976,308 @@ struct MetricImpl<Histogram> final: Metric, IHistogram
 {
     using base = IHistogram;
 
-    MetricImpl(Histogram const& h, std::vector<std::string> const& values)
-        : Metric("histogram", h, values)
-        , IHistogram(h.bounds())
-    {}
+    MetricImpl(Histogram const& h, std::vector<std::string> const& values);
+
+    void snapshot(std::vector<Unsigned>& cells) const override;
+    void snapshot_exemplars(ExemplarTable& t, std::size_t series) const override;
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override;
+    Unsigned const* format_openmetrics(Writer& w, Unsigned const* cells,
+                                       Unsigned const* exemplars) const override;
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells,
+                           Unsigned const* exemplars) const override;
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override;
 
-    void flush(std::ostream& os) const override;
+private:
+    // one line per bucket, then +Inf, _sum and _count
+    Prefixes lines_;
+};
+
+//
+// Loops over a run of series, one indirect call per family rather than
+// per series. Instantiated for each MetricImpl, which are final, so the
+// calls in the loops are direct and inline. SeriesTable<Metric> calls
+// through the vtable, for families mixing types (e.g. Gauge<double> and
+// Gauge<Unsigned>).
+//
+struct SeriesOps
+{
+    // The first series is the one at the index of the snapshot
+    void (*snapshot)(Metric const* const* first, Metric const* const* last,
+                     std::vector<Unsigned>& cells, ExemplarTable& exemplars, std::size_t index);
+
+    // Formats series from i on while less than stop bytes are written,
+    // leaves i past the last one formatted
+    Unsigned const* (*format)(Writer& w, bool openmetrics, Metric const* const* series,
+                              std::size_t& i, std::size_t end, Unsigned const* cells,
+                              ExemplarCursor& exemplars, std::size_t stop);
+
+    Unsigned const* (*encode)(ProtoWriter& p, Metric const* const* series,
+                              std::size_t i, std::size_t end, Unsigned const* cells,
+                              ExemplarCursor& exemplars);
+
+    Unsigned const* (*remote_write)(ProtoWriter& p, Metric const* const* first,
+                                    Metric const* const* last, Unsigned const* cells,
+                                    long long timestamp);
+};
+
+template<class M>
+struct SeriesTable
+{
+    static void snapshot(Metric const* const* first, Metric const* const* last,
+                         std::vector<Unsigned>& cells, ExemplarTable& exemplars, std::size_t index)
+    {
+        for (; first != last; ++first, ++index) {
+            auto const m = static_cast<M const*>(*first);
+            m->snapshot(cells);
+            m->snapshot_exemplars(exemplars, index);
+        }
+    }
+
+    static Unsigned const* format(Writer& w, bool openmetrics, Metric const* const* series,
+                                  std::size_t& i, std::size_t end, Unsigned const* cells,
+                                  ExemplarCursor& exemplars, std::size_t stop)
+    {
+        if (openmetrics)
+            for (; i < end && w.written() < stop; ++i)
+                cells = static_cast<M const*>(series[i])->format_openmetrics(w, cells, exemplars.at(i));
+        else
+            for (; i < end && w.written() < stop; ++i)
+                cells = static_cast<M const*>(series[i])->format(w, cells);
+        return cells;
+    }
+
+    static Unsigned const* encode(ProtoWriter& p, Metric const* const* series,
+                                  std::size_t i, std::size_t end, Unsigned const* cells,
+                                  ExemplarCursor& exemplars)
+    {
+        for (; i < end; ++i)
+            cells = static_cast<M const*>(series[i])->encode(p, cells, exemplars.at(i));
+        return cells;
+    }
+
+    static Unsigned const* remote_write(ProtoWriter& p, Metric const* const* first,
+                                        Metric const* const* last, Unsigned const* cells,
+                                        long long timestamp)
+    {
+        for (; first != last; ++first)
+            cells = static_cast<M const*>(*first)->remote_write(p, cells, timestamp);
+        return cells;
+    }
+
+    static SeriesOps const ops;
+};
+
+template<class M>
+SeriesOps const SeriesTable<M>::ops = {
+    &SeriesTable<M>::snapshot, &SeriesTable<M>::format, &SeriesTable<M>::encode,
+    &SeriesTable<M>::remote_write
 };
 
 } // namespace detail
 
+//
+// Series made by a Collector for one snapshot, with the usual
+// descriptors and interfaces: values are set once, just before they are
+// read. Owned by the snapshots taken with it.
+//
+class Collection: detail::NoCopyMove
+{
+    friend class Registry;
+
+    struct Data;
+    Data *data_;
+
+    void push(std::unique_ptr<detail::Metric> m, detail::SeriesOps const* ops);
+
+public:
+    Collection();
+    ~Collection();
+
+    template<class T>
+    typename detail::MetricImpl<T>::base &
+    add(T const& t, std::vector<std::string> const& values = {})
+    {
+        using M = detail::MetricImpl<T>;
+        std::unique_ptr<M> m{new M(t, values)};
+        auto& series = *m;
+        push(std::move(m), &detail::SeriesTable<M>::ops);
+        return series;
+    }
+};
+
+//
+// Source of values read on demand, for those costly to keep current
+// on every change, like queue depths or pool statistics. collect() is
+// called by every snapshot without the registry lock, one collector at
+// a time, and adds whole families to the collection. A family with the
+// name of a registered one is left out.
+//
+class Collector
+{
+public:
+    virtual ~Collector();
+
+    virtual void collect(Collection& c) = 0;
+};
+
+//
+// Numeric copy of all registry values. Taken by Registry::snapshot under
+// the registry lock, then formatted by write() without any lock, so slow
+// output doesn't block registration. Reuse an instance to keep its memory.
+// Valid as long as the registry is alive: it pins the series it lists, so
+// those removed meanwhile are kept until it's cleared or taken again, see
+// Registry::Pin.
+//
+class Snapshot
+{
+    friend class Registry;
+    friend class RenderCache;
+
+    struct Family
+    {
+        detail::Metric const* first;
+        detail::SeriesOps const* ops;
+        std::size_t end;           // past the last series
+        std::size_t cells_end;     // past the last cell
+        std::size_t exemplars_end; // past the last entry of exemplars_
+        bool collected;            // made for this snapshot, see Collector
+    };
+
+    std::vector<Family> families_;
+    std::vector<detail::Metric const*> series_;
+    std::vector<Unsigned> cells_;
+    detail::ExemplarTable exemplars_;
+    // removals from the registry so far, see Registry::remove
+    std::size_t epoch_ = 0;
+    // series from collectors, shared by copies
+    std::shared_ptr<Collection const> collected_;
+    // a Registry::Pin at epoch_, shared by copies
+    std::shared_ptr<void const> pin_;
+
+    // scratch of write(), a snapshot is written by one thread at a time
+    mutable ProtoWriter proto_;
+
+public:
+    // Position of a write in pieces, reset before the first one
+    struct Cursor
+    {
+        std::size_t family = 0;
+        std::size_t series = 0;
+        std::size_t cell = 0;
+        bool header = false; // of the current family
+        bool done = false;
+    };
+
+    void clear() noexcept;
+
+    // Same series with the same values, so the same output
+    bool operator == (Snapshot const& other) const noexcept;
+    bool operator != (Snapshot const& other) const noexcept { return !(*this == other); }
+
+    void write(Writer& w, Format f = Format::Text) const;
+
+    // Writes whole series from the cursor on, until at least limit bytes
+    // are written. Returns true when the end is reached. Protobuf is
+    // written by whole families, as each one is a delimited message.
+    bool write(Writer& w, Format f, Cursor& c, std::size_t limit) const;
+
+    // Runs the tasks, in parallel or not, and returns when all are done
+    using Executor = std::function<void(std::vector<std::function<void()>> const& tasks)>;
+
+    // Splits the families into up to parts runs of about the same number
+    // of values, formats each into a buffer of its own through run, then
+    // writes them in order. The output is the same as of write(). A family
+    // is never split, so parts beyond the number of families don't help.
+    // By default parts run on the calling thread and a pool of one fewer
+    // threads than the hardware has, shared by all writes and started on
+    // first use; pass run to use threads of your own instead.
+    void write(Sink& sink, Format f, std::size_t parts, Executor const& run = {}) const;
+
+    // Appends the TimeSeries of a remote write WriteRequest, one per line
+    // of the text format, with samples at timestamp in milliseconds since
+    // the epoch
+    void remote_write(ProtoWriter& p, long long timestamp) const;
+
+private:
+    // The family at the cursor, false if stopped at the limit
+    bool write_family(Writer& w, Format f, Cursor& c,
+                      std::size_t start, std::size_t limit, ProtoWriter& proto) const;
+};
+
+//
+// Writes snapshots formatting again only the families whose values
+// changed since the previous write, the others are copied from the
+// output kept from it. Scrape CPU then follows the activity rather than
+// the number of series, for the memory of a copy of the output. Changes
+// are found by comparing values, so updates pay nothing for it.
+// Registry::flush writes through one.
+//
+class RenderCache
+{
+    struct Entry
+    {
+        std::vector<detail::Metric const*> series;
+        std::vector<Unsigned> cells;
+        std::vector<Unsigned> exemplars; // see exemplars()
+        std::string out;
+        std::size_t generation = 0;
+    };
+
+    Format format_ = Format::Text;
+    std::size_t generation_ = 0;
+    std::size_t epoch_ = 0;
+    std::unordered_map<detail::Metric const*, Entry> entries_;
+    std::vector<Unsigned> scratch_;
+
+    // Exemplars of the family at the index of the snapshot, by series
+    // index within it, number of cells and the cells
+    static void exemplars(Snapshot const& s, std::size_t family, std::vector<Unsigned>& out);
+
+public:
+    void write(Snapshot const& s, Writer& w, Format f = Format::Text);
+
+    void clear() noexcept { entries_.clear(); }
+};
+
 class Registry: detail::NoCopyMove
 {
+    friend class detail::LocalBase;
+
     struct Data;
     Data *data_;
 
-    void push(detail::Metric *m);
+    // Series memory from the arena of the family
+    void* allocate(std::string const& name, std::size_t size, std::size_t align);
+    void deallocate(std::string const& name, void* p, std::size_t size, std::size_t align) noexcept;
+
+    template<class M, class T>
+    M* make(T const& t, std::vector<std::string> const& values)
+    {
+        auto p = allocate(t.name(), sizeof(M), alignof(M));
+        try {
+            return new (p) M(t, values);
+        }
+        catch (...) {
+            deallocate(t.name(), p, sizeof(M), alignof(M));
+            throw;
+        }
+    }
+
+    // Returns the series now registered under its labels: m, or the
+    // overflow series of a family at its limit, or null if that is still
+    // to be made. Destroys m unless it's returned.
+    detail::Metric* push(detail::Metric *m, detail::SeriesOps const* ops,
+                         std::size_t size, std::size_t align, bool overflow);
+
+    void attach(detail::LocalBase *l);
+    void detach(detail::LocalBase *l) noexcept;
+
+    // Returns the family already registered under the name, if any
+    detail::FamilyBase& push_family(std::string const& name,
+                                    std::unique_ptr<detail::FamilyBase> f);
+
+    detail::FamilyBase* find_family(std::string const& name) const;
 
 public:
     static Registry& global();
@@ -237,16 +1285,97 @@ public:
     Registry();
     ~Registry();
 
+    //
+    // Keeps series removed from the registry, by remove() or by expiry,
+    // from being destroyed while the pin is alive. Removals count epochs:
+    // a pin holds back the series removed after the epoch it was taken at,
+    // and those are reclaimed by a later remove() or snapshot once every
+    // pin older than their removal is gone. So a reference got while
+    // holding a pin stays safe to update until the pin goes, though the
+    // series no longer shows once removed. Snapshots hold one, and local
+    // handles hold back the series they publish into.
+    //
+    // Taking a pin locks a mutex, so hold one per thread for a batch of
+    // updates rather than one per update, and refresh() it now and then,
+    // getting references to series that may be removed again after that.
+    //
+    class Pin: detail::NoCopyMove
+    {
+        friend class Registry;
+
+        std::shared_ptr<detail::Epochs> epochs_;
+        std::size_t epoch_;
+
+    public:
+        explicit Pin(Registry const& r = Registry::global());
+        ~Pin();
+
+        // Moves to the current epoch, letting go of series removed so far
+        void refresh();
+    };
+
+    // Label values of the series past the limit of its family
+    static std::string const OVERFLOW_VALUE;
+
     template<class T>
     typename detail::MetricImpl<T>::base &
     add(T const& t, std::vector<std::string> const& values = {})
     {
-        auto m = new detail::MetricImpl<T>(t, values);
-        push(m);
-        return *m;
+        using M = detail::MetricImpl<T>;
+        auto const ops = &detail::SeriesTable<M>::ops;
+        auto m = push(make<M>(t, values), ops, sizeof(M), alignof(M), false);
+        if (!m) {
+            std::vector<std::string> overflow(values.size(), OVERFLOW_VALUE);
+            m = push(make<M>(t, overflow), ops, sizeof(M), alignof(M), true);
+        }
+        return static_cast<M&>(*m);
     }
 
-    void flush(std::ostream& os) const;
+    //
+    // Unregisters the series with the label values, also from the Family
+    // handle, false if there is none. Its memory is reused once no Pin
+    // holds it back: references to it are safe to use only under a pin
+    // taken before they were got, and their updates no longer show. Local
+    // handles of the series keep it until they are gone.
+    //
+    bool remove(detail::MetricMeta const& desc, std::vector<std::string> const& values = {});
+
+    //
+    // Removes series of the family whose values stayed the same for ttl,
+    // checked on snapshots. 0, the default, keeps them. The registry
+    // removes them on its own, so references into such a family are valid
+    // only under a Pin: get them through the Family handle after taking or
+    // refreshing it, rather than keeping them around.
+    //
+    void expire(std::string const& name, std::chrono::seconds ttl);
+
+    // New label values beyond max series of the family get one shared
+    // series with all values OVERFLOW_VALUE. 0, the default, is no limit.
+    void limit(std::string const& name, std::size_t max);
+
+    // Handle for get-or-create series lookup, see family.hpp. The same
+    // one for the same descriptor, another one under its name throws.
+    template<class... Keys, class T>
+    Family<T, Keys...>& family(T const& desc);
+
+    void snapshot(Snapshot& s) const;
+
+    // Takes a snapshot and writes it, through a RenderCache kept by the
+    // registry unless another flush is using it
+    void flush(Sink& sink, Format f = Format::Text) const;
+
+    // Collectors are kept until removed, not from inside collect()
+    Collector& add_collector(std::unique_ptr<Collector> c);
+    Collector& add_collector(std::function<void(Collection&)> collect);
+    void remove_collector(Collector& c);
+
+    // Formats in parallel, see Snapshot::write(Sink&, Format, parts),
+    // without the RenderCache
+    void flush(Sink& sink, Format f, std::size_t parts,
+               Snapshot::Executor const& run = {}) const;
+
+    // Adapter over flush(Sink&)
+    void flush(std::ostream& os, Format f = Format::Text) const;
 };
 
 template<class T>
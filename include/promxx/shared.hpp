@@ -0,0 +1,147 @@
+#ifndef PROMXX_SHARED_HPP
+#define PROMXX_SHARED_HPP
+
+#include <promxx/registry.hpp>
+
+namespace promxx
+{
+
+class SharedSegment;
+
+//
+// Histogram with its counts in a SharedSegment, observe is the same
+// search and relaxed increments as of IHistogram
+//
+class SharedHistogram: detail::NoCopyMove
+{
+    friend class SharedSegment;
+
+    // bucket search of the bounds, its own counts unused
+    struct Search final: IHistogram
+    {
+        explicit Search(Histogram const& h): IHistogram(h) {}
+        using IHistogram::bucket;
+    };
+
+    Search const search_;
+    std::atomic<Unsigned> *counts_;
+    std::atomic<Unsigned> *sum_;
+    std::atomic<Unsigned> *sum_hi_;
+    std::atomic<double> *real_sum_;
+
+    SharedHistogram(Histogram const& h, std::atomic<Unsigned> *cells);
+
+public:
+    void observe(Unsigned v) noexcept
+    {
+        counts_[search_.bucket(v)].fetch_add(1, detail::MEMORY_ORDER);
+        if (sum_->fetch_add(v, detail::MEMORY_ORDER) > ~v)
+            sum_hi_->fetch_add(1, detail::MEMORY_ORDER);
+    }
+
+    template<class F>
+    typename std::enable_if<std::is_floating_point<F>::value>::type
+    observe(F v) noexcept
+    {
+        detail::atomic_add(*real_sum_, double(v));
+        counts_[search_.bucket(double(v))].fetch_add(1, detail::MEMORY_ORDER);
+    }
+};
+
+//
+// Series in a file mapped by several processes, for pre-fork servers
+// where each worker has a registry of its own and a scrape would see
+// one worker only. Workers add series to the segment rather than to a
+// registry and update them through the usual interfaces, a relaxed
+// atomic add on the mapping. One process, often the parent, exports
+// them: collect() sums up the series of all processes with the same
+// name and labels on every snapshot, see add_shared_collector. Counters
+// and histograms of exited processes keep counting, gauges only of
+// processes alive.
+//
+// The layout is fixed: a header, then entries appended under a lock in
+// the header, each with its process id, kind, cells and strings. Entries
+// are never removed, so size must fit every series of every process
+// through the segment lifetime. Series added before a fork are shared
+// with the child, those added after are the process' own. Name a file
+// under /dev/shm to keep it in memory, and unlink() it when done.
+//
+class SharedSegment: detail::NoCopyMove
+{
+    struct Data;
+    Data *data_;
+
+    enum class Kind: std::uint32_t { Counter, RealCounter, Gauge, RealGauge, Histogram };
+
+    // Interface of the series of this process, added if new, or the
+    // cells of a histogram
+    void* cells(Kind kind, detail::MetricMeta const& desc,
+                std::vector<std::string> const& values, Buckets const* bounds);
+
+    SharedHistogram& histogram(Histogram const& h, std::atomic<Unsigned> *cells);
+
+    template<class T>
+    struct GaugeKind;
+
+public:
+    static std::uint32_t const VERSION = 1;
+
+    // Maps the file at path, made of size bytes if it doesn't exist,
+    // otherwise of its own size
+    explicit SharedSegment(std::string const& path, std::size_t size = 1 << 20);
+
+    // Unmaps the file, references to its series must be gone
+    ~SharedSegment();
+
+    static void unlink(std::string const& path);
+
+    // Bytes taken so far by the header and the entries, and in all
+    std::size_t used() const noexcept;
+    std::size_t size() const noexcept;
+
+    ICounter& add(Counter const& c, std::vector<std::string> const& values = {})
+    {
+        return *static_cast<ICounter*>(cells(Kind::Counter, c, values, nullptr));
+    }
+
+    IRealCounter& add(RealCounter const& c, std::vector<std::string> const& values = {})
+    {
+        return *static_cast<IRealCounter*>(cells(Kind::RealCounter, c, values, nullptr));
+    }
+
+    // Of Unsigned or double
+    template<class T>
+    IGauge<T>& add(Gauge<T> const& g, std::vector<std::string> const& values = {})
+    {
+        return *static_cast<IGauge<T>*>(cells(GaugeKind<T>::value, g, values, nullptr));
+    }
+
+    SharedHistogram& add(Histogram const& h, std::vector<std::string> const& values = {})
+    {
+        auto p = cells(Kind::Histogram, h, values, &h.bounds());
+        return histogram(h, static_cast<std::atomic<Unsigned>*>(p));
+    }
+
+    // Adds the sums of the series of all processes
+    void collect(Collection& c) const;
+};
+
+template<>
+struct SharedSegment::GaugeKind<Unsigned>
+{
+    static Kind const value = Kind::Gauge;
+};
+
+template<>
+struct SharedSegment::GaugeKind<double>
+{
+    static Kind const value = Kind::RealGauge;
+};
+
+// Adds a collector of the segment to the registry, the segment must
+// outlive it
+Collector& add_shared_collector(SharedSegment const& s, Registry& r = Registry::global());
+
+} // namespace promxx
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef PROMXX_SNAPPY_HPP
+#define PROMXX_SNAPPY_HPP
+
+#include <cstddef>
+#include <string>
+
+namespace promxx
+{
+
+//
+// Snappy block format, as remote write requests are compressed.
+// https://github.com/google/snappy/blob/main/format_description.txt
+// A greedy single-pass encoder over 64 KiB blocks with a hash table of
+// 4-byte sequences: less compression than the reference one, but it
+// decodes with any snappy implementation.
+//
+void snappy_compress(char const* data, std::size_t size, std::string& out);
+
+// Appends the decoded data to out, false if the input is malformed
+bool snappy_uncompress(char const* data, std::size_t size, std::string& out);
+
+} // namespace promxx
+
+#endif
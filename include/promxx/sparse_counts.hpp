@@ -0,0 +1,78 @@
+#ifndef PROMXX_SPARSE_COUNTS_HPP
+#define PROMXX_SPARSE_COUNTS_HPP
+
+#include <promxx/registry.hpp>
+
+namespace promxx
+{
+namespace detail
+{
+
+//
+// Counts indexed by a signed key from a fixed range, in three levels:
+// a directory with a pointer per SEGMENT * CHUNK keys, segments with a
+// pointer per chunk, and chunks of CHUNK counts. Each level is made on
+// the first touch of its range, so memory follows the keys in use and
+// untouched ranges cost nothing. Lock-free, a failed allocation drops
+// the update and add() says so.
+//
+class SparseCounts: NoCopyMove
+{
+public:
+    static std::size_t const CHUNK = 256;
+    static std::size_t const SEGMENT = 32;
+
+    SparseCounts(long min_key, long max_key) noexcept;
+    ~SparseCounts();
+
+    // False if it couldn't allocate, then nothing is counted
+    bool add(long key, Unsigned n) noexcept;
+
+    // Zeroes all counts, keeps the memory
+    void clear() noexcept;
+
+    // Calls f(key, count) for non-zero counts in increasing key order
+    template<class F>
+    void for_each(F f) const
+    {
+        auto dir = dir_.load(std::memory_order_acquire);
+        if (!dir)
+            return;
+        for (std::size_t d = 0; d < segments_; ++d) {
+            auto segment = dir[d].load(std::memory_order_acquire);
+            if (!segment)
+                continue;
+            for (std::size_t s = 0; s < SEGMENT; ++s) {
+                auto chunk = segment->chunks[s].load(std::memory_order_acquire);
+                if (!chunk)
+                    continue;
+                auto const first = min_key_ + long((d * SEGMENT + s) * CHUNK);
+                for (std::size_t i = 0; i < CHUNK; ++i) {
+                    auto c = chunk->v[i].load(MEMORY_ORDER);
+                    if (c)
+                        f(first + long(i), c);
+                }
+            }
+        }
+    }
+
+private:
+    struct Chunk
+    {
+        std::atomic<Unsigned> v[CHUNK];
+    };
+
+    struct Segment
+    {
+        std::atomic<Chunk*> chunks[SEGMENT];
+    };
+
+    long const min_key_;
+    std::size_t const segments_;
+    std::atomic<std::atomic<Segment*>*> dir_{nullptr};
+};
+
+} // namespace detail
+} // namespace promxx
+
+#endif
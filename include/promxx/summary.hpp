@@ -0,0 +1,122 @@
+#ifndef PROMXX_SUMMARY_HPP
+#define PROMXX_SUMMARY_HPP
+
+#include <promxx/registry.hpp>
+#include <promxx/sparse_counts.hpp>
+
+#include <chrono>
+#include <memory>
+
+namespace promxx
+{
+
+using Quantiles = std::vector<double>;
+
+class Summary: public detail::MetricMeta
+{
+    Quantiles quantiles_;
+    std::chrono::seconds max_age_;
+    std::size_t age_buckets_;
+    double accuracy_;
+
+public:
+    // Quantiles are estimated over the last max_age, which slides in
+    // steps of max_age / age_buckets, with the given relative accuracy
+    Summary(std::string name, Quantiles quantiles,
+            std::string help = {},
+            std::vector<std::string> keys = {},
+            std::chrono::seconds max_age = std::chrono::seconds(600),
+            std::size_t age_buckets = 5,
+            double accuracy = 0.01);
+
+    Quantiles const& quantiles() const noexcept { return quantiles_; }
+    std::chrono::seconds max_age() const noexcept { return max_age_; }
+    std::size_t age_buckets() const noexcept { return age_buckets_; }
+    double accuracy() const noexcept { return accuracy_; }
+};
+
+//
+// Summary
+// https://prometheus.io/docs/concepts/metric_types/#summary
+//
+// Every age bucket is a DDSketch: counts of logarithmically sized
+// buckets, so any quantile is within the relative accuracy. Observe is
+// a log and a relaxed increment into the current age bucket. Stale age
+// buckets are reset by the first observe that reaches them. A snapshot
+// copies the counts of the current age buckets, the sketches are merged
+// into quantiles only when it's written. Sum and count cover the whole
+// lifetime.
+//
+class ISummary: detail::NoCopyMove
+{
+public:
+    void observe(double v) noexcept;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    struct Window: detail::NoCopyMove
+    {
+        std::atomic<long long> epoch{-1};
+        std::atomic<Unsigned> zero{0};
+        detail::SparseCounts positive;
+        detail::SparseCounts negative;
+
+        Window(long min_key, long max_key) noexcept
+            : positive(min_key, max_key), negative(min_key, max_key) {}
+    };
+
+    ISummary(Summary const& s);
+
+    long long epoch(Clock::time_point t) const noexcept;
+
+    // Counts v in the current window, false if it couldn't allocate
+    bool add_window(double v) noexcept;
+
+    // Appends the counts of the windows still inside max age: the zero
+    // count, then positive and negative buckets as a number of (key,
+    // count) pairs and the pairs. Only copies, so it's cheap under the
+    // registry lock.
+    void snapshot_windows(std::vector<Unsigned>& cells) const;
+
+    // Estimated quantiles of counts appended by snapshot_windows, returns
+    // the next unused cell
+    Unsigned const* quantiles(Quantiles const& q, Unsigned const* cells,
+                              std::vector<double>& out) const;
+
+    double const gamma_;
+    double const inv_log_gamma_;
+    Clock::duration const width_;
+    std::size_t const size_;
+    std::vector<std::unique_ptr<Window>> windows_;
+    std::atomic<Unsigned> count_{0};
+    std::atomic<double> sum_{0};
+};
+
+namespace detail
+{
+
+template<>
+struct MetricImpl<Summary> final: Metric, ISummary
+{
+    using base = ISummary;
+
+    MetricImpl(Summary const& s, std::vector<std::string> const& values);
+
+    void snapshot(std::vector<Unsigned>& cells) const override;
+    Unsigned const* format(Writer& w, Unsigned const* cells) const override;
+    Unsigned const* encode(ProtoWriter& p, Unsigned const* cells,
+                           Unsigned const* exemplars) const override;
+    Unsigned const* remote_write(ProtoWriter& p, Unsigned const* cells,
+                                 long long timestamp) const override;
+
+private:
+    Quantiles quantiles_;
+    // one line per quantile, then _sum and _count
+    Prefixes lines_;
+};
+
+} // namespace detail
+} // namespace promxx
+
+#endif
@@ -0,0 +1,242 @@
+#ifndef PROMXX_WRITER_HPP
+#define PROMXX_WRITER_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace promxx
+{
+
+//
+// Destination of the exposition output
+//
+class Sink
+{
+public:
+    virtual ~Sink();
+
+    virtual void write(char const* data, std::size_t size) = 0;
+};
+
+class StringSink final: public Sink
+{
+    std::string& s_;
+
+public:
+    explicit StringSink(std::string& s) noexcept: s_(s) {}
+
+    void write(char const* data, std::size_t size) override { s_.append(data, size); }
+};
+
+class OstreamSink final: public Sink
+{
+    std::ostream& os_;
+
+public:
+    explicit OstreamSink(std::ostream& os) noexcept: os_(os) {}
+
+    void write(char const* data, std::size_t size) override;
+};
+
+//
+// Buffered writer with locale-independent number formatting.
+// Collects output in a fixed buffer (inline or supplied by the caller)
+// and passes it to the sink in chunks. Doesn't allocate.
+// flush() must be called to write the tail.
+//
+class Writer
+{
+public:
+    static std::size_t const SIZE = 4096;
+
+    // longest formatted number, see number()
+    static std::size_t const NUMBER_SIZE = 32;
+
+    explicit Writer(Sink& sink) noexcept
+        : sink_(sink), buf_(inline_), size_(SIZE) {}
+
+    // size must be at least NUMBER_SIZE
+    Writer(Sink& sink, char* buf, std::size_t size) noexcept
+        : sink_(sink), buf_(buf), size_(size) {}
+
+    Writer(Writer const&) = delete;
+    Writer& operator = (Writer const&) = delete;
+
+    void write(char const* data, std::size_t size)
+    {
+        if (size <= size_ - pos_) {
+            std::memcpy(buf_ + pos_, data, size);
+            pos_ += size;
+        }
+        else
+            write_long(data, size);
+    }
+
+    void flush();
+
+    // Total size of the output so far, flushed or not
+    std::size_t written() const noexcept { return flushed_ + pos_; }
+
+    Writer& operator << (char c)
+    {
+        if (pos_ == size_)
+            flush();
+        buf_[pos_++] = c;
+        return *this;
+    }
+
+    Writer& operator << (std::string const& s)
+    {
+        write(s.data(), s.size());
+        return *this;
+    }
+
+    Writer& operator << (char const* s)
+    {
+        write(s, std::strlen(s));
+        return *this;
+    }
+
+    template<class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value, Writer&>::type
+    operator << (T v)
+    {
+        reserve();
+        pos_ += number(buf_ + pos_, static_cast<unsigned long long>(v));
+        return *this;
+    }
+
+    template<class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, Writer&>::type
+    operator << (T v)
+    {
+        reserve();
+        pos_ += number(buf_ + pos_, static_cast<long long>(v));
+        return *this;
+    }
+
+    template<class T>
+    typename std::enable_if<std::is_floating_point<T>::value, Writer&>::type
+    operator << (T v)
+    {
+        reserve();
+        pos_ += number(buf_ + pos_, static_cast<double>(v));
+        return *this;
+    }
+
+    // Formatters write at most NUMBER_SIZE chars and return the length
+    static std::size_t number(char* out, unsigned long long v) noexcept;
+    static std::size_t number(char* out, long long v) noexcept;
+    static std::size_t number(char* out, double v) noexcept;
+
+private:
+    Sink& sink_;
+    char* buf_;
+    std::size_t size_;
+    std::size_t pos_ = 0;
+    std::size_t flushed_ = 0;
+    char inline_[SIZE];
+
+    void reserve()
+    {
+        if (size_ - pos_ < NUMBER_SIZE)
+            flush();
+    }
+
+    void write_long(char const* data, std::size_t size);
+};
+
+//
+// Protocol buffers encoder into a growing buffer, which is kept by
+// clear() for the next message. Nested messages are written in place:
+// begin() reserves one byte for the length and end() widens it if the
+// message turned out longer, so there is no intermediate object model.
+//
+class ProtoWriter
+{
+public:
+    // longest varint
+    static std::size_t const VARINT_SIZE = 10;
+
+    enum Wire: unsigned { VARINT = 0, FIXED64 = 1, BYTES = 2 };
+
+    void clear() noexcept
+    {
+        buf_.clear();
+        open_.clear();
+    }
+
+    std::string const& data() const noexcept { return buf_; }
+
+    void varint(unsigned long long v)
+    {
+        char tmp[VARINT_SIZE];
+        buf_.append(tmp, varint(tmp, v));
+    }
+
+    void tag(unsigned field, Wire wire) { varint(field << 3 | wire); }
+
+    void uint(unsigned field, unsigned long long v)
+    {
+        tag(field, VARINT);
+        varint(v);
+    }
+
+    void sint(unsigned field, long long v)
+    {
+        tag(field, VARINT);
+        varint(zigzag(v));
+    }
+
+    void real(unsigned field, double v);
+
+    void bytes(unsigned field, char const* data, std::size_t size)
+    {
+        tag(field, BYTES);
+        varint(size);
+        buf_.append(data, size);
+    }
+
+    void bytes(unsigned field, std::string const& s) { bytes(field, s.data(), s.size()); }
+
+    // Appends fields encoded beforehand
+    void raw(char const* data, std::size_t size) { buf_.append(data, size); }
+    void raw(std::string const& s) { buf_ += s; }
+
+    // Starts a nested message or a packed field, closed by end()
+    void begin(unsigned field)
+    {
+        tag(field, BYTES);
+        open_.push_back(buf_.size());
+        buf_ += '\0';
+    }
+
+    void end();
+
+    // Writes at most VARINT_SIZE chars and returns the length
+    static std::size_t varint(char* out, unsigned long long v) noexcept
+    {
+        std::size_t n = 0;
+        for (; v >= 0x80; v >>= 7)
+            out[n++] = char(v | 0x80);
+        out[n++] = char(v);
+        return n;
+    }
+
+    static unsigned long long zigzag(long long v) noexcept
+    {
+        return (static_cast<unsigned long long>(v) << 1) ^ static_cast<unsigned long long>(v >> 63);
+    }
+
+private:
+    std::string buf_;
+    std::vector<std::size_t> open_;
+};
+
+} // namespace promxx
+
+#endif
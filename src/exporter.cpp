@@ -0,0 +1,547 @@
+#include <promxx/exporter.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <unordered_map>
+
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef PROMXX_HAVE_ZLIB
+#include <promxx/gzip.hpp>
+#endif
+
+namespace promxx
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+std::string const METRICS = "/metrics";
+
+
+struct Request
+{
+    std::string method;
+    std::string path;
+    bool http11 = false;
+    std::string accept;
+    std::string accept_encoding;
+    std::string connection;
+    bool body = false;
+};
+
+std::string lower(std::string s)
+{
+    for (auto& c: s)
+        c = char(std::tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+
+std::string trim(std::string const& s)
+{
+    auto begin = s.find_first_not_of(" \t");
+    if (begin == std::string::npos)
+        return {};
+    return s.substr(begin, s.find_last_not_of(" \t") + 1 - begin);
+}
+
+// Parses the head up to the empty line, false if it's malformed
+bool parse(std::string const& head, Request& r)
+{
+    auto eol = head.find("\r\n");
+    auto const line = head.substr(0, eol);
+    auto sp1 = line.find(' ');
+    auto sp2 = line.rfind(' ');
+    if (sp1 == std::string::npos || sp1 == sp2)
+        return false;
+    r.method = line.substr(0, sp1);
+    r.path = line.substr(sp1 + 1, sp2 - sp1 - 1);
+    r.path = r.path.substr(0, r.path.find('?'));
+    auto const version = line.substr(sp2 + 1);
+    if (version.compare(0, 7, "HTTP/1.") != 0)
+        return false;
+    r.http11 = version != "HTTP/1.0";
+
+    while (eol != std::string::npos && eol + 2 < head.size()) {
+        auto const begin = eol + 2;
+        eol = head.find("\r\n", begin);
+        auto const header = head.substr(begin, eol - begin);
+        auto colon = header.find(':');
+        if (colon == std::string::npos)
+            return false;
+        auto const name = lower(header.substr(0, colon));
+        auto const value = trim(header.substr(colon + 1));
+        if (name == "accept")
+            r.accept = value;
+        else if (name == "accept-encoding")
+            r.accept_encoding = lower(value);
+        else if (name == "connection")
+            r.connection = lower(value);
+        else if ((name == "content-length" && value != "0") || name == "transfer-encoding")
+            r.body = true;
+    }
+    return true;
+}
+
+bool accepts_gzip(std::string const& accept_encoding)
+{
+    std::size_t begin = 0;
+    while (begin < accept_encoding.size()) {
+        auto end = std::min(accept_encoding.find(',', begin), accept_encoding.size());
+        auto const coding = trim(accept_encoding.substr(begin, end - begin));
+        auto const semi = coding.find(';');
+        if (trim(coding.substr(0, semi)) == "gzip") {
+            auto const q = coding.find("q=", semi);
+            return semi == std::string::npos || q == std::string::npos
+                || std::strtod(coding.c_str() + q + 2, nullptr) > 0;
+        }
+        begin = end + 1;
+    }
+    return false;
+}
+
+struct Connection: detail::NoCopyMove
+{
+    int const fd;
+    Clock::time_point active;
+    bool writing = false; // polled for output
+    bool close = false;   // once the output is sent
+    bool eof = false;     // the peer is done sending
+
+    std::string in;       // received, not handled yet
+    std::string out;      // to send
+    std::size_t sent = 0;
+
+    // response being streamed
+    bool streaming = false;
+    Format format = Format::Text;
+    bool chunked = false;
+    Snapshot snapshot;
+    Snapshot::Cursor cursor;
+    std::string piece;
+    StringSink piece_sink{piece};
+#ifdef PROMXX_HAVE_ZLIB
+    std::unique_ptr<GzipSink> gzip;
+#endif
+    bool compress = false;
+    // compressed body sent from the cache, or recorded for it
+    std::shared_ptr<std::string> replay;
+    std::size_t replayed = 0;
+    std::shared_ptr<std::string> record;
+
+    Connection(int fd): fd(fd), active(Clock::now()) {}
+
+    ~Connection() { ::close(fd); }
+};
+
+} // namespace
+
+std::size_t const Exporter::MAX_CONNECTIONS;
+std::size_t const Exporter::MAX_REQUEST;
+std::size_t const Exporter::CHUNK_SIZE;
+std::size_t const Exporter::MAX_CACHE;
+int const Exporter::IDLE_TIMEOUT;
+
+struct Exporter::Data
+{
+    Registry& registry_;
+    int listen_ = -1;
+    int epoll_ = -1;
+    int wake_ = -1;
+    unsigned short port_ = 0;
+    std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+    std::thread thread_;
+
+    // The last compressed body with the snapshot it was written from.
+    // Compression dominates the cost of a scrape, and idle services
+    // often have the same values on the next one.
+    Format cache_format_ = Format::Text;
+    Snapshot cache_snapshot_;
+    std::shared_ptr<std::string> cache_;
+
+    Data(Registry& r): registry_(r) {}
+
+    ~Data()
+    {
+        for (auto fd: {listen_, epoll_, wake_})
+            if (fd >= 0)
+                ::close(fd);
+    }
+
+    void run();
+    void accept();
+    void poll(Connection& c, bool writing);
+    void drop(Connection& c);
+    void receive(Connection& c);
+    void serve(Connection& c);
+    bool next(Connection& c);
+    void respond(Connection& c, Request const& r);
+    void produce(Connection& c);
+    void chunk(Connection& c, bool done);
+};
+
+void Exporter::Data::run()
+{
+    epoll_event events[MAX_CONNECTIONS + 2];
+    auto sweep = Clock::now();
+    for (;;) {
+        auto const n = epoll_wait(epoll_, events, MAX_CONNECTIONS + 2, 1000);
+        for (int i = 0; i < n; ++i) {
+            auto const fd = events[i].data.fd;
+            if (fd == wake_)
+                return;
+            if (fd == listen_) {
+                accept();
+                continue;
+            }
+            auto it = connections_.find(fd);
+            if (it == connections_.end())
+                continue;
+            auto& c = *it->second;
+            try {
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    drop(c);
+                else if (c.writing)
+                    serve(c);
+                else
+                    receive(c);
+            }
+            catch (std::exception const&) {
+                // the connection may be gone already
+                auto it = connections_.find(fd);
+                if (it != connections_.end())
+                    drop(*it->second);
+            }
+        }
+
+        auto const now = Clock::now();
+        if (now - sweep >= std::chrono::seconds(1)) {
+            sweep = now;
+            std::vector<Connection*> idle;
+            for (auto& kv: connections_)
+                if (now - kv.second->active >= std::chrono::seconds(IDLE_TIMEOUT))
+                    idle.push_back(kv.second.get());
+            for (auto c: idle)
+                drop(*c);
+        }
+    }
+}
+
+void Exporter::Data::accept()
+{
+    for (;;) {
+        int fd = ::accept4(listen_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        if (connections_.size() >= MAX_CONNECTIONS) {
+            ::close(fd);
+            continue;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            ::close(fd);
+            continue;
+        }
+        connections_[fd].reset(new Connection(fd));
+    }
+}
+
+void Exporter::Data::poll(Connection& c, bool writing)
+{
+    if (c.writing == writing)
+        return;
+    epoll_event ev{};
+    ev.events = writing ? EPOLLOUT : EPOLLIN;
+    ev.data.fd = c.fd;
+    epoll_ctl(epoll_, EPOLL_CTL_MOD, c.fd, &ev);
+    c.writing = writing;
+}
+
+void Exporter::Data::drop(Connection& c)
+{
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, c.fd, nullptr);
+    connections_.erase(c.fd);
+}
+
+void Exporter::Data::receive(Connection& c)
+{
+    char buf[4096];
+    while (c.in.size() <= MAX_REQUEST) {
+        auto n = ::recv(c.fd, buf, sizeof buf, 0);
+        if (n > 0) {
+            c.active = Clock::now();
+            c.in.append(buf, n);
+            continue;
+        }
+        if (n == 0)
+            c.eof = true;
+        else if (errno == EINTR)
+            continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return drop(c);
+        break;
+    }
+    serve(c);
+}
+
+// Sends what can be sent, then goes on with the next request
+void Exporter::Data::serve(Connection& c)
+{
+    for (;;) {
+        while (c.sent < c.out.size()) {
+            auto n = ::send(c.fd, c.out.data() + c.sent, c.out.size() - c.sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return poll(c, true);
+                return drop(c);
+            }
+            c.sent += n;
+            c.active = Clock::now();
+        }
+        c.out.clear();
+        c.sent = 0;
+
+        if (c.streaming) {
+            produce(c);
+            continue;
+        }
+        if (c.close)
+            return drop(c);
+        // requests may be pipelined
+        if (!next(c)) {
+            if (c.eof)
+                return drop(c);
+            return poll(c, false);
+        }
+    }
+}
+
+// Starts the response to the next complete request, false if there is none
+bool Exporter::Data::next(Connection& c)
+{
+    auto const end = c.in.find("\r\n\r\n");
+    if (end == std::string::npos) {
+        if (c.in.size() <= MAX_REQUEST)
+            return false;
+        c.out = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        c.close = true;
+        return true;
+    }
+    Request r;
+    auto const ok = parse(c.in.substr(0, end), r);
+    c.in.erase(0, end + 4);
+    if (ok)
+        respond(c, r);
+    else {
+        c.out = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        c.close = true;
+    }
+    return true;
+}
+
+void Exporter::Data::respond(Connection& c, Request const& r)
+{
+    // The body of a request isn't read, so the stream can't go on after it
+    auto const keep_alive = !r.body &&
+        (r.http11 ? r.connection != "close" : r.connection == "keep-alive");
+    if (!keep_alive)
+        c.close = true;
+    std::string const connection = keep_alive ? "" : "Connection: close\r\n";
+
+    if (r.method != "GET" && r.method != "HEAD") {
+        c.out = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\n"
+                "Content-Length: 0\r\n" + connection + "\r\n";
+        return;
+    }
+    if (r.path != METRICS) {
+        c.out = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n" + connection + "\r\n";
+        return;
+    }
+
+    c.format = negotiate(r.accept);
+    // without chunks the end of the body is the end of the connection
+    c.chunked = r.http11;
+    if (!c.chunked)
+        c.close = true;
+    c.compress = false;
+#ifdef PROMXX_HAVE_ZLIB
+    c.compress = accepts_gzip(r.accept_encoding);
+#endif
+    c.out = "HTTP/1.1 200 OK\r\nContent-Type: ";
+    c.out += content_type(c.format);
+    c.out += "\r\n";
+    if (c.compress)
+        c.out += "Content-Encoding: gzip\r\n";
+    if (c.chunked)
+        c.out += "Transfer-Encoding: chunked\r\n";
+    if (c.close)
+        c.out += "Connection: close\r\n";
+    c.out += "\r\n";
+    if (r.method == "HEAD")
+        return;
+
+    registry_.snapshot(c.snapshot);
+    c.cursor = Snapshot::Cursor();
+    c.streaming = true;
+    c.replay.reset();
+    c.record.reset();
+    if (c.compress) {
+        if (cache_ && cache_format_ == c.format && c.snapshot == cache_snapshot_) {
+            c.replay = cache_;
+            c.replayed = 0;
+        }
+        else
+            c.record = std::make_shared<std::string>();
+    }
+}
+
+// Writes the next piece of the streamed response into the output
+void Exporter::Data::produce(Connection& c)
+{
+    c.piece.clear();
+    if (c.replay) {
+        auto const& body = *c.replay;
+        auto const n = std::min(CHUNK_SIZE, body.size() - c.replayed);
+        c.piece.assign(body, c.replayed, n);
+        c.replayed += n;
+        chunk(c, c.replayed == body.size());
+        return;
+    }
+
+    Sink* sink = &c.piece_sink;
+#ifdef PROMXX_HAVE_ZLIB
+    if (c.compress) {
+        if (!c.gzip)
+            c.gzip.reset(new GzipSink(c.piece_sink));
+        sink = c.gzip.get();
+    }
+#endif
+    bool done;
+    {
+        Writer w{*sink};
+        done = c.snapshot.write(w, c.format, c.cursor, CHUNK_SIZE);
+        w.flush();
+    }
+#ifdef PROMXX_HAVE_ZLIB
+    if (done && c.compress)
+        c.gzip->finish();
+#endif
+    if (c.record) {
+        if (c.record->size() + c.piece.size() > MAX_CACHE)
+            c.record.reset();
+        else
+            c.record->append(c.piece);
+    }
+    if (done && c.record) {
+        cache_format_ = c.format;
+        cache_snapshot_ = c.snapshot;
+        cache_ = std::move(c.record);
+    }
+    chunk(c, done);
+}
+
+// Adds the piece to the output
+void Exporter::Data::chunk(Connection& c, bool done)
+{
+    if (!c.chunked)
+        c.out += c.piece;
+    else if (!c.piece.empty()) {
+        // an empty chunk would end the body
+        char size[20];
+        c.out.append(size, std::snprintf(size, sizeof size, "%zx\r\n", c.piece.size()));
+        c.out += c.piece;
+        c.out += "\r\n";
+    }
+    if (done) {
+        if (c.chunked)
+            c.out += "0\r\n\r\n";
+        c.streaming = false;
+    }
+}
+
+Exporter::Exporter(std::string const& host, unsigned short port, Registry& r)
+{
+    std::unique_ptr<Data> d{new Data(r)};
+    auto const where = host + ':' + std::to_string(port);
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* addrs;
+    auto const service = std::to_string(port);
+    if (auto rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), service.c_str(), &hints, &addrs))
+        throw Error{"Exporter can't resolve " + where + ": " + gai_strerror(rc)};
+
+    int error = 0;
+    for (auto a = addrs; a && d->listen_ < 0; a = a->ai_next) {
+        int fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0) {
+            error = errno;
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if (bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+            error = errno;
+            ::close(fd);
+            continue;
+        }
+        d->listen_ = fd;
+    }
+    freeaddrinfo(addrs);
+    if (d->listen_ < 0)
+        throw Error{"Exporter can't listen on " + where + ": " + std::strerror(error)};
+
+    sockaddr_storage addr;
+    socklen_t len = sizeof addr;
+    getsockname(d->listen_, reinterpret_cast<sockaddr*>(&addr), &len);
+    d->port_ = ntohs(addr.ss_family == AF_INET6
+        ? reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port
+        : reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+
+    d->epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    d->wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d->epoll_ < 0 || d->wake_ < 0)
+        throw Error{"Exporter can't create epoll: " + std::string(std::strerror(errno))};
+    for (auto fd: {d->listen_, d->wake_}) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(d->epoll_, EPOLL_CTL_ADD, fd, &ev) != 0)
+            throw Error{"Exporter can't create epoll: " + std::string(std::strerror(errno))};
+    }
+
+    auto p = d.get();
+    d->thread_ = std::thread([p]{ p->run(); });
+    data_ = d.release();
+}
+
+Exporter::~Exporter()
+{
+    std::uint64_t one = 1;
+    if (::write(data_->wake_, &one, sizeof one) < 0) {}
+    data_->thread_.join();
+    delete data_;
+}
+
+unsigned short Exporter::port() const noexcept
+{
+    return data_->port_;
+}
+
+} // namespace promxx
@@ -0,0 +1,283 @@
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <cassert>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef PROMXX_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <promxx/exporter.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+struct Response
+{
+    int status = 0;
+    std::string headers; // lower case
+    std::string body;
+};
+
+int connect_to(unsigned short port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    timeval tv{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    auto rc = connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr);
+    assert(rc == 0);
+    (void)rc;
+    return fd;
+}
+
+void send_all(int fd, std::string const& s)
+{
+    auto n = send(fd, s.data(), s.size(), 0);
+    assert(n == ssize_t(s.size()));
+    (void)n;
+}
+
+// Buffered reads of one connection
+class Client
+{
+    int fd_;
+    std::string buf_;
+
+    bool fill()
+    {
+        char tmp[4096];
+        auto n = recv(fd_, tmp, sizeof tmp, 0);
+        if (n <= 0)
+            return false;
+        buf_.append(tmp, n);
+        return true;
+    }
+
+    std::string line()
+    {
+        std::size_t eol;
+        while ((eol = buf_.find("\r\n")) == std::string::npos) {
+            auto ok = fill();
+            assert(ok);
+            (void)ok;
+        }
+        auto l = buf_.substr(0, eol);
+        buf_.erase(0, eol + 2);
+        return l;
+    }
+
+    std::string take(std::size_t n)
+    {
+        while (buf_.size() < n) {
+            auto ok = fill();
+            assert(ok);
+            (void)ok;
+        }
+        auto s = buf_.substr(0, n);
+        buf_.erase(0, n);
+        return s;
+    }
+
+public:
+    explicit Client(unsigned short port): fd_(connect_to(port)) {}
+    ~Client() { close(fd_); }
+
+    void send(std::string const& s) { send_all(fd_, s); }
+
+    // true if the server closed the connection
+    bool closed()
+    {
+        return buf_.empty() && !fill();
+    }
+
+    Response read(bool head = false)
+    {
+        Response r;
+        auto status = line();
+        r.status = std::atoi(status.c_str() + 9);
+        for (auto l = line(); !l.empty(); l = line()) {
+            for (auto& c: l)
+                c = char(std::tolower(static_cast<unsigned char>(c)));
+            r.headers += l + '\n';
+        }
+        if (head)
+            return r;
+        if (r.headers.find("transfer-encoding: chunked") != std::string::npos) {
+            for (;;) {
+                auto size = std::strtoul(line().c_str(), nullptr, 16);
+                if (size == 0) {
+                    line();
+                    break;
+                }
+                r.body += take(size);
+                line();
+            }
+        }
+        else if (r.headers.find("content-length: ") != std::string::npos) {
+            auto pos = r.headers.find("content-length: ");
+            r.body = take(std::strtoul(r.headers.c_str() + pos + 16, nullptr, 10));
+        }
+        else {
+            while (fill())
+                ;
+            r.body.swap(buf_);
+        }
+        return r;
+    }
+};
+
+#ifdef PROMXX_HAVE_ZLIB
+std::string gunzip(std::string const& in)
+{
+    z_stream z{};
+    auto rc = inflateInit2(&z, 16 + 15);
+    assert(rc == Z_OK);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    z.avail_in = uInt(in.size());
+    std::string out;
+    char buf[4096];
+    do {
+        z.next_out = reinterpret_cast<Bytef*>(buf);
+        z.avail_out = sizeof buf;
+        rc = inflate(&z, Z_NO_FLUSH);
+        assert(rc == Z_OK || rc == Z_STREAM_END);
+        out.append(buf, sizeof buf - z.avail_out);
+    } while (rc != Z_STREAM_END);
+    inflateEnd(&z);
+    return out;
+}
+#endif
+
+} // namespace
+
+int main()
+{
+    Registry r;
+    // enough output for several chunks
+    for (int i = 0; i < 3000; ++i)
+        r.add(Counter("requests", "Requests", {"path"}), {"/p" + std::to_string(i)}).inc(i);
+    auto& temperature = r.add(Gauge<double>("temperature", "Temperature"));
+    temperature.set(21.5);
+
+    std::string text, openmetrics;
+    {
+        std::stringstream ss;
+        r.flush(ss);
+        text = ss.str();
+        ss.str({});
+        r.flush(ss, Format::OpenMetrics);
+        openmetrics = ss.str();
+    }
+
+    Exporter e("127.0.0.1", 0, r);
+    assert(e.port() != 0);
+
+    // keep-alive, pipelining and negotiation on one connection
+    {
+        Client c(e.port());
+        c.send("GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n");
+        auto res = c.read();
+        assert(res.status == 200);
+        assert(res.headers.find("content-type: text/plain; version=0.0.4") != std::string::npos);
+        assert(res.body == text);
+
+        c.send("GET /metrics?x=1 HTTP/1.1\r\nAccept: application/openmetrics-text; version=1.0.0\r\n\r\n"
+               "HEAD /metrics HTTP/1.1\r\n\r\n"
+               "GET /other HTTP/1.1\r\n\r\n"
+               "POST /metrics HTTP/1.1\r\nContent-Length: 0\r\n\r\n");
+        res = c.read();
+        assert(res.status == 200);
+        assert(res.headers.find("content-type: application/openmetrics-text") != std::string::npos);
+        assert(res.body == openmetrics);
+        res = c.read(true);
+        assert(res.status == 200);
+        res = c.read();
+        assert(res.status == 404);
+        res = c.read();
+        assert(res.status == 405);
+
+        c.send("GET /metrics HTTP/1.1\r\nConnection: close\r\n\r\n");
+        res = c.read();
+        assert(res.body == text);
+        assert(c.closed());
+    }
+
+    // HTTP/1.0 bodies end with the connection
+    {
+        Client c(e.port());
+        c.send("GET /metrics HTTP/1.0\r\n\r\n");
+        auto res = c.read();
+        assert(res.status == 200);
+        assert(res.headers.find("transfer-encoding") == std::string::npos);
+        assert(res.body == text);
+    }
+
+    {
+        Client c(e.port());
+        c.send("nonsense\r\n\r\n");
+        assert(c.read().status == 400);
+        assert(c.closed());
+    }
+
+    {
+        Client c(e.port());
+        c.send("GET /metrics HTTP/1.1\r\nX: " + std::string(Exporter::MAX_REQUEST, 'x'));
+        assert(c.read().status == 431);
+    }
+
+#ifdef PROMXX_HAVE_ZLIB
+    {
+        Client c(e.port());
+        for (int i = 0; i < 2; ++i) {
+            c.send("GET /metrics HTTP/1.1\r\nAccept-Encoding: deflate, gzip\r\n\r\n");
+            auto res = c.read();
+            assert(res.headers.find("content-encoding: gzip") != std::string::npos);
+            assert(res.body.size() < text.size() / 4);
+            assert(gunzip(res.body) == text);
+        }
+        c.send("GET /metrics HTTP/1.1\r\nAccept-Encoding: gzip;q=0\r\n\r\n");
+        assert(c.read().body == text);
+
+        // the cached body is sent only while the values are the same
+        c.send("GET /metrics HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n");
+        auto const first = c.read().body;
+        c.send("GET /metrics HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n");
+        assert(c.read().body == first);
+        temperature.set(22);
+        std::stringstream ss;
+        r.flush(ss);
+        c.send("GET /metrics HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n");
+        auto const second = c.read().body;
+        assert(second != first);
+        assert(gunzip(second) == ss.str());
+        c.send("GET /metrics HTTP/1.1\r\nAccept-Encoding: gzip\r\n"
+               "Accept: application/openmetrics-text\r\n\r\n");
+        auto const om = c.read().body;
+        assert(gunzip(om).find("# EOF") != std::string::npos);
+        temperature.set(21.5);
+    }
+#endif
+
+    // more clients than allowed connections are turned away, not queued up
+    {
+        std::vector<std::unique_ptr<Client>> clients;
+        for (std::size_t i = 0; i < Exporter::MAX_CONNECTIONS; ++i) {
+            clients.emplace_back(new Client(e.port()));
+            clients.back()->send("HEAD /metrics HTTP/1.1\r\n\r\n");
+            assert(clients.back()->read(true).status == 200);
+        }
+        Client extra(e.port());
+        assert(extra.closed());
+    }
+}
@@ -0,0 +1,28 @@
+#include <promxx/family.hpp>
+
+#include <cstdint>
+
+namespace promxx
+{
+namespace detail
+{
+
+std::size_t hash_values(StringRef const* values, std::size_t n) noexcept
+{
+    std::uint64_t h = 14695981039346656037ull;
+    for (std::size_t i = 0; i < n; ++i) {
+        auto p = reinterpret_cast<unsigned char const*>(values[i].data);
+        for (std::size_t j = 0; j < values[i].size; ++j) {
+            h ^= p[j];
+            h *= 1099511628211ull;
+        }
+        h ^= values[i].size;
+        h *= 1099511628211ull;
+    }
+    return static_cast<std::size_t>(h);
+}
+
+FamilyBase::~FamilyBase() = default;
+
+} // namespace detail
+} // namespace promxx
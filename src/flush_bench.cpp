@@ -0,0 +1,155 @@
+//
+// Compares snapshot and text formatting of counter series called per
+// series through the vtable, as flush did, and per family through
+// SeriesTable. Then the scaling of parallel flush with the number of
+// parts against serial flush, as medians of repeated warm runs. Build
+// with optimization, e.g. CMAKE_BUILD_TYPE=Release.
+//
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <promxx/registry.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+using Impl = detail::MetricImpl<Counter>;
+
+class NullSink final: public Sink
+{
+public:
+    std::size_t size = 0;
+
+    void write(char const*, std::size_t n) override { size += n; }
+};
+
+template<class F>
+double measure(std::size_t series, F f)
+{
+    // repeated for about as many series in total at every size
+    std::size_t const rounds = std::max<std::size_t>(1, 10000000 / series);
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < rounds; ++i)
+        f();
+    std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - start;
+    return d.count() / (rounds * series);
+}
+
+void run(std::size_t n)
+{
+    Counter desc("requests", "Requests", {"path"});
+    std::vector<std::unique_ptr<detail::Metric>> owned;
+    std::vector<detail::Metric const*> series;
+    for (std::size_t i = 0; i < n; ++i) {
+        owned.emplace_back(new Impl(desc, {"/p" + std::to_string(i)}));
+        static_cast<Impl&>(*owned.back()).inc(i * 7919);
+        series.push_back(owned.back().get());
+    }
+    auto const first = series.data();
+    auto const last = first + n;
+    auto const& ops = detail::SeriesTable<Impl>::ops;
+
+    std::vector<Unsigned> cells;
+    cells.reserve(n);
+    detail::ExemplarTable exemplars;
+    NullSink sink;
+
+    auto vsnap = measure(n, [&]{
+        cells.clear();
+        exemplars.clear();
+        for (std::size_t i = 0; i < n; ++i) {
+            series[i]->snapshot(cells);
+            series[i]->snapshot_exemplars(exemplars, i);
+        }
+    });
+    auto tsnap = measure(n, [&]{
+        cells.clear();
+        exemplars.clear();
+        ops.snapshot(first, last, cells, exemplars, 0);
+    });
+    auto vformat = measure(n, [&]{
+        Writer w{sink};
+        Unsigned const* cell = cells.data();
+        for (auto m: series)
+            cell = m->format(w, cell);
+        w.flush();
+    });
+    auto tformat = measure(n, [&]{
+        Writer w{sink};
+        std::size_t i = 0;
+        detail::ExemplarCursor x{exemplars, 0};
+        ops.format(w, false, first, i, n, cells.data(), x, std::size_t(-1));
+        w.flush();
+    });
+    std::printf("series=%-8zu snapshot virtual %6.2f table %6.2f ns  "
+                "format virtual %6.2f table %6.2f ns\n",
+                n, vsnap, tsnap, vformat, tformat);
+}
+
+// Median milliseconds of f over warm runs, before each one prepare()
+template<class P, class F>
+double median_ms(P prepare, F f)
+{
+    std::size_t const WARMUP = 2, RUNS = 9;
+    std::vector<double> ms;
+    for (std::size_t i = 0; i < WARMUP + RUNS; ++i) {
+        prepare();
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+        if (i >= WARMUP)
+            ms.push_back(d.count());
+    }
+    std::sort(ms.begin(), ms.end());
+    return ms[RUNS / 2];
+}
+
+void scale(std::size_t families, std::size_t per_family)
+{
+    Registry r;
+    std::vector<ICounter*> first; // of each family
+    for (std::size_t i = 0; i < families; ++i) {
+        Counter c("requests_" + std::to_string(i), "Requests", {"path"});
+        for (std::size_t j = 0; j < per_family; ++j) {
+            auto& s = r.add(c, {"/p" + std::to_string(j)});
+            s.inc(j);
+            if (j == 0)
+                first.push_back(&s);
+        }
+    }
+    // every family changed, so the render cache of serial flush formats all
+    auto const change = [&first]{
+        for (auto c: first)
+            c->inc();
+    };
+    auto const series = families * per_family;
+    NullSink sink;
+
+    Snapshot s;
+    auto const snapshot = median_ms(change, [&]{ r.snapshot(s); });
+    auto const serial = median_ms(change, [&]{ r.flush(sink, Format::Text); });
+    std::printf("series=%-8zu snapshot %8.1f ms  serial flush %8.1f ms\n", series, snapshot, serial);
+
+    unsigned const hc = std::max(1u, std::thread::hardware_concurrency());
+    for (std::size_t parts = 1; parts <= std::max(8u, hc); parts *= 2) {
+        auto const d = median_ms(change, [&]{ r.flush(sink, Format::Text, parts); });
+        std::printf("series=%-8zu parts=%-3zu flush %8.1f ms  speedup %.2f\n",
+                    series, parts, d, serial / d);
+    }
+}
+
+} // namespace
+
+int main()
+{
+    for (std::size_t n: {10000, 100000, 1000000})
+        run(n);
+    scale(1000, 1000);
+}
@@ -0,0 +1,119 @@
+#include <promxx/format.hpp>
+
+#include <cctype>
+#include <cstdlib>
+
+namespace promxx
+{
+namespace
+{
+
+std::string trim(std::string const& s, std::size_t begin, std::size_t end)
+{
+    while (begin < end && std::isspace(static_cast<unsigned char>(s[begin])))
+        ++begin;
+    while (end > begin && std::isspace(static_cast<unsigned char>(s[end - 1])))
+        --end;
+    return s.substr(begin, end - begin);
+}
+
+std::string lower(std::string s)
+{
+    for (auto& c: s)
+        c = char(std::tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+
+// Parameters of a media range, "key=value" without quotes
+struct MediaRange
+{
+    std::string type;
+    std::string proto;
+    std::string encoding;
+    double q = 1;
+};
+
+MediaRange parse_range(std::string const& accept, std::size_t begin, std::size_t end)
+{
+    MediaRange r;
+    auto semi = accept.find(';', begin);
+    if (semi > end)
+        semi = end;
+    r.type = lower(trim(accept, begin, semi));
+    while (semi < end) {
+        auto next = accept.find(';', semi + 1);
+        if (next > end)
+            next = end;
+        auto param = trim(accept, semi + 1, next);
+        auto eq = param.find('=');
+        if (eq != std::string::npos) {
+            auto key = lower(trim(param, 0, eq));
+            auto value = trim(param, eq + 1, param.size());
+            if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                value = value.substr(1, value.size() - 2);
+            if (key == "q")
+                r.q = std::strtod(value.c_str(), nullptr);
+            else if (key == "proto")
+                r.proto = value;
+            else if (key == "encoding")
+                r.encoding = lower(value);
+        }
+        semi = next;
+    }
+    return r;
+}
+
+bool supported(MediaRange const& r, Format& f)
+{
+    if (r.type == "application/vnd.google.protobuf") {
+        if (r.proto != "io.prometheus.client.MetricFamily" || r.encoding != "delimited")
+            return false;
+        f = Format::Protobuf;
+    }
+    else if (r.type == "application/openmetrics-text")
+        f = Format::OpenMetrics;
+    else if (r.type == "text/plain" || r.type == "text/*" || r.type == "*/*")
+        f = Format::Text;
+    else
+        return false;
+    return true;
+}
+
+} // namespace
+
+char const* content_type(Format f) noexcept
+{
+    switch (f) {
+    case Format::OpenMetrics:
+        return "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    case Format::Protobuf:
+        return "application/vnd.google.protobuf; "
+               "proto=io.prometheus.client.MetricFamily; encoding=delimited";
+    case Format::Text:
+        break;
+    }
+    return "text/plain; version=0.0.4; charset=utf-8";
+}
+
+Format negotiate(std::string const& accept)
+{
+    // the highest q wins, the first one of equals
+    auto best = Format::Text;
+    double best_q = 0;
+    std::size_t begin = 0;
+    while (begin < accept.size()) {
+        auto end = accept.find(',', begin);
+        if (end == std::string::npos)
+            end = accept.size();
+        auto r = parse_range(accept, begin, end);
+        Format f;
+        if (r.q > best_q && supported(r, f)) {
+            best = f;
+            best_q = r.q;
+        }
+        begin = end + 1;
+    }
+    return best;
+}
+
+} // namespace promxx
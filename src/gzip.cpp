@@ -0,0 +1,56 @@
+#include <promxx/gzip.hpp>
+
+#include <zlib.h>
+
+namespace promxx
+{
+
+struct GzipSink::Stream
+{
+    z_stream z;
+    Sink& out;
+
+    explicit Stream(Sink& out): out(out) {}
+};
+
+GzipSink::GzipSink(Sink& out, int level)
+    : z_(new Stream(out))
+{
+    std::memset(&z_->z, 0, sizeof z_->z);
+    // 16 + 15 bits window for the gzip wrapper
+    if (deflateInit2(&z_->z, level, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw Error{"Can't initialize gzip with level " + std::to_string(level)};
+}
+
+GzipSink::~GzipSink()
+{
+    deflateEnd(&z_->z);
+}
+
+void GzipSink::deflate(int flush)
+{
+    auto& z = z_->z;
+    char buf[4096];
+    do {
+        z.next_out = reinterpret_cast<Bytef*>(buf);
+        z.avail_out = sizeof buf;
+        ::deflate(&z, flush);
+        if (z.avail_out < sizeof buf)
+            z_->out.write(buf, sizeof buf - z.avail_out);
+    } while (z.avail_out == 0);
+}
+
+void GzipSink::write(char const* data, std::size_t size)
+{
+    z_->z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    z_->z.avail_in = static_cast<uInt>(size);
+    deflate(Z_NO_FLUSH);
+}
+
+void GzipSink::finish()
+{
+    deflate(Z_FINISH);
+    deflateReset(&z_->z);
+}
+
+} // namespace promxx
@@ -0,0 +1,88 @@
+#include <promxx/local.hpp>
+
+namespace promxx
+{
+namespace detail
+{
+
+LocalBase::LocalBase(Registry& r, std::size_t threshold)
+    : registry_(&r)
+    , threshold_(threshold)
+{
+    registry_->attach(this);
+}
+
+LocalBase::~LocalBase()
+{
+    detach();
+}
+
+void LocalBase::detach() noexcept
+{
+    if (registry_) {
+        registry_->detach(this);
+        registry_ = nullptr;
+    }
+}
+
+void LocalBase::commit()
+{
+    std::lock_guard<std::mutex> lock{mtx_};
+    publish();
+    pending_ = 0;
+}
+
+} // namespace detail
+
+LocalCounter::~LocalCounter()
+{
+    detach();
+    publish();
+}
+
+void LocalCounter::publish() noexcept
+{
+    auto t = total_.load(std::memory_order_relaxed);
+    target_.inc(t - published_);
+    published_ = t;
+}
+
+LocalHistogram::LocalHistogram(IHistogram& h, std::size_t threshold, Registry& r)
+    : detail::LocalBase(r, threshold)
+    , target_(h)
+    , counts_(new std::atomic<Unsigned>[h.bounds_.size() + 1])
+    , published_(new Unsigned[h.bounds_.size() + 1]())
+{
+    for (std::size_t i = 0; i <= target_.bounds_.size(); ++i)
+        counts_[i].store(0, std::memory_order_relaxed);
+}
+
+LocalHistogram::~LocalHistogram()
+{
+    detach();
+    publish();
+}
+
+void LocalHistogram::publish() noexcept
+{
+    for (std::size_t i = 0; i <= target_.bounds_.size(); ++i) {
+        auto c = counts_[i].load(std::memory_order_relaxed);
+        if (c != published_[i]) {
+            target_.counts_[i].fetch_add(c - published_[i], detail::MEMORY_ORDER);
+            published_[i] = c;
+        }
+    }
+    auto s = sum_.load(std::memory_order_relaxed);
+    if (s != published_sum_) {
+        // modular delta, exact unless 2^64 was observed between publishes
+        target_.add_sum(s - published_sum_);
+        published_sum_ = s;
+    }
+    auto rs = real_sum_.load(std::memory_order_relaxed);
+    if (rs != published_real_sum_) {
+        detail::atomic_add(target_.real_sum_, rs - published_real_sum_);
+        published_real_sum_ = rs;
+    }
+}
+
+} // namespace promxx
@@ -0,0 +1,276 @@
+#include <promxx/native_histogram.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+namespace promxx
+{
+namespace
+{
+
+int const MIN_SCHEMA = -4;
+int const MAX_SCHEMA = 8;
+
+// frexp exponents of values above the zero threshold and up to DBL_MAX
+long const MIN_EXP = -127;
+long const MAX_EXP = 1024;
+
+std::string const _BUCKET = "_bucket";
+std::string const _SUM = "_sum";
+std::string const _COUNT = "_count";
+std::string const LE = "le";
+std::string const INF = "+Inf";
+
+// For schema s > 0 the fractions 2^(j/2^s - 1), j < 2^s, splitting an octave
+struct FractionBounds
+{
+    std::vector<double> tables[MAX_SCHEMA + 1];
+
+    FractionBounds()
+    {
+        for (int s = 1; s <= MAX_SCHEMA; ++s) {
+            std::size_t const n = std::size_t(1) << s;
+            for (std::size_t j = 0; j < n; ++j)
+                tables[s].push_back(std::exp2(double(j) / n - 1));
+        }
+    }
+};
+
+std::vector<double> const& fraction_bounds(int schema)
+{
+    static FractionBounds const fb;
+    return fb.tables[schema];
+}
+
+// Keys are scaled by multiplying and dividing, shifts of negative values
+// are undefined or implementation-defined
+long min_key(int schema)
+{
+    return schema > 0 ? (MIN_EXP - 1) * (1L << schema) : -(-MIN_EXP / (1L << -schema)) - 1;
+}
+
+long max_key(int schema)
+{
+    return schema > 0 ? MAX_EXP * (1L << schema) : MAX_EXP / (1L << -schema) + 1;
+}
+
+// Spans and deltas of (key, count) cells in increasing key order
+void encode_buckets(ProtoWriter& p, unsigned span_field, unsigned delta_field,
+                    Unsigned const* cells, Unsigned n)
+{
+    if (n == 0)
+        return;
+    Unsigned i = 0;
+    long next = 0; // key after the previous span
+    while (i < n) {
+        auto const first = detail::from_cell<long>(cells[2 * i]);
+        auto j = i + 1;
+        while (j < n && detail::from_cell<long>(cells[2 * j]) == first + long(j - i))
+            ++j;
+        p.begin(span_field);
+        p.sint(detail::pb::SPAN_OFFSET, first - next);
+        p.uint(detail::pb::SPAN_LENGTH, j - i);
+        p.end();
+        next = first + long(j - i);
+        i = j;
+    }
+    p.begin(delta_field);
+    long long prev = 0;
+    for (i = 0; i < n; ++i) {
+        auto const c = static_cast<long long>(cells[2 * i + 1]);
+        p.varint(ProtoWriter::zigzag(c - prev));
+        prev = c;
+    }
+    p.end();
+}
+
+} // namespace
+
+double const NativeHistogram::ZERO_THRESHOLD = 2.938735877055719e-39; // 2^-128
+
+NativeHistogram::NativeHistogram(std::string name, int schema,
+                                 std::string help, std::vector<std::string> keys)
+    : detail::MetricMeta(name, std::move(keys), std::move(help))
+    , schema_(schema)
+{
+    if (std::find_if(this->keys().begin(), this->keys().end(),
+            [](detail::KeyValueI const& kv){ return kv.first == LE; }) != this->keys().end())
+        throw Error{"\"le\" is not allowed as label name in histogram"};
+    if (schema < MIN_SCHEMA || schema > MAX_SCHEMA)
+        throw Error{"Histogram '" + name + "' schema must be from -4 to 8"};
+}
+
+INativeHistogram::INativeHistogram(int schema)
+    : schema_(schema)
+    , positive_(min_key(schema), max_key(schema))
+    , negative_(min_key(schema), max_key(schema))
+{
+}
+
+long INativeHistogram::key(double v) const noexcept
+{
+    int exp;
+    auto frac = std::frexp(v, &exp);
+    if (schema_ > 0) {
+        auto& bounds = fraction_bounds(schema_);
+        auto i = std::lower_bound(bounds.begin(), bounds.end(), frac) - bounds.begin();
+        return long(i) + (long(exp) - 1) * long(bounds.size());
+    }
+    long k = exp;
+    if (frac == 0.5)
+        --k;
+    // rounding up division by 2^-schema
+    long const d = 1L << -schema_;
+    return k >= 0 ? (k + d - 1) / d : -((-k) / d);
+}
+
+double INativeHistogram::bound(long key) const noexcept
+{
+    if (schema_ > 0)
+        return std::exp2(double(key) / double(1L << schema_));
+    return std::exp2(double(key) * double(1L << -schema_));
+}
+
+void INativeHistogram::observe(double v) noexcept
+{
+    // dropped as a whole if its bucket can't be had, so the count stays
+    // the total of the buckets
+    if (std::isfinite(v)) {
+        if (std::fabs(v) <= NativeHistogram::ZERO_THRESHOLD)
+            zero_.fetch_add(1, detail::MEMORY_ORDER);
+        else if (!(v > 0 ? positive_.add(key(v), 1) : negative_.add(key(-v), 1)))
+            return;
+    }
+    count_.fetch_add(1, detail::MEMORY_ORDER);
+    detail::atomic_add(sum_, v);
+}
+
+namespace detail
+{
+
+MetricImpl<NativeHistogram>::MetricImpl(NativeHistogram const& h,
+                                        std::vector<std::string> const& values)
+    : Metric("histogram", h, values, LE)
+    , INativeHistogram(h.schema())
+{
+    bucket_ = name() + _BUCKET + '{' + labels().str();
+    if (!labels().empty())
+        bucket_ += ',';
+    bucket_ += LE + "=\"";
+    lines_.add(header(_BUCKET, LE, INF));
+    lines_.add(header(_SUM));
+    lines_.add(header(_COUNT));
+}
+
+void MetricImpl<NativeHistogram>::snapshot(std::vector<Unsigned>& cells) const
+{
+    cells.push_back(count_.load(MEMORY_ORDER));
+    cells.push_back(to_cell(sum_.load(MEMORY_ORDER)));
+    cells.push_back(zero_.load(MEMORY_ORDER));
+    for (auto t: {&negative_, &positive_}) {
+        auto const n = cells.size();
+        cells.push_back(0);
+        t->for_each([&cells](long key, Unsigned c){
+            cells.push_back(to_cell(key));
+            cells.push_back(c);
+        });
+        cells[n] = (cells.size() - n - 1) / 2;
+    }
+}
+
+Unsigned const* MetricImpl<NativeHistogram>::format(Writer& w, Unsigned const* cells) const
+{
+    auto const count = cells[0];
+    auto const sum = from_cell<double>(cells[1]);
+    auto const zero = cells[2];
+    cells += 3;
+
+    Unsigned total = 0;
+    auto line = [&](double le, Unsigned c){
+        total += c;
+        w << bucket_ << le << "\"} " << total << '\n';
+    };
+
+    // negative buckets from the lowest values, so in decreasing key order
+    auto const nneg = *cells++;
+    for (auto i = nneg; i-- > 0;)
+        line(-bound(from_cell<long>(cells[2 * i]) - 1), cells[2 * i + 1]);
+    cells += 2 * nneg;
+
+    line(NativeHistogram::ZERO_THRESHOLD, zero);
+
+    auto const npos = *cells++;
+    for (Unsigned i = 0; i < npos; ++i)
+        line(bound(from_cell<long>(cells[2 * i])), cells[2 * i + 1]);
+    cells += 2 * npos;
+
+    total = std::max(total, count);
+    lines_.write(w, 0) << total << '\n';
+    lines_.write(w, 1) << sum << '\n';
+    lines_.write(w, 2) << total << '\n';
+    return cells;
+}
+
+Unsigned const* MetricImpl<NativeHistogram>::remote_write(ProtoWriter& p, Unsigned const* cells,
+                                                           long long timestamp) const
+{
+    auto const count = cells[0];
+    auto const sum = from_cell<double>(cells[1]);
+    auto const zero = cells[2];
+    cells += 3;
+
+    // the lines of format()
+    Unsigned total = 0;
+    char buf[Writer::NUMBER_SIZE];
+    auto line = [&](double le, Unsigned c){
+        total += c;
+        remote_sample(p, timestamp, double(total), _BUCKET, LE, StringRef(buf, Writer::number(buf, le)));
+    };
+
+    auto const nneg = *cells++;
+    for (auto i = nneg; i-- > 0;)
+        line(-bound(from_cell<long>(cells[2 * i]) - 1), cells[2 * i + 1]);
+    cells += 2 * nneg;
+
+    line(NativeHistogram::ZERO_THRESHOLD, zero);
+
+    auto const npos = *cells++;
+    for (Unsigned i = 0; i < npos; ++i)
+        line(bound(from_cell<long>(cells[2 * i])), cells[2 * i + 1]);
+    cells += 2 * npos;
+
+    total = std::max(total, count);
+    remote_sample(p, timestamp, double(total), _BUCKET, LE, INF);
+    remote_sample(p, timestamp, sum, _SUM);
+    remote_sample(p, timestamp, double(total), _COUNT);
+    return cells;
+}
+
+Unsigned const* MetricImpl<NativeHistogram>::encode(ProtoWriter& p, Unsigned const* cells,
+                                                     Unsigned const*) const
+{
+    auto const count = cells[0];
+    auto const sum = from_cell<double>(cells[1]);
+    auto const zero = cells[2];
+    auto const neg = cells + 3;
+    auto const nneg = *neg;
+    auto const pos = neg + 1 + 2 * nneg;
+    auto const npos = *pos;
+
+    p.begin(pb::FAMILY_METRIC);
+    label_pairs(p);
+    p.begin(pb::METRIC_HISTOGRAM);
+    p.uint(pb::SAMPLE_COUNT, count);
+    p.real(pb::SAMPLE_SUM, sum);
+    p.sint(pb::HISTOGRAM_SCHEMA, schema_);
+    p.real(pb::HISTOGRAM_ZERO_THRESHOLD, NativeHistogram::ZERO_THRESHOLD);
+    p.uint(pb::HISTOGRAM_ZERO_COUNT, zero);
+    encode_buckets(p, pb::HISTOGRAM_NEGATIVE_SPAN, pb::HISTOGRAM_NEGATIVE_DELTA, neg + 1, nneg);
+    encode_buckets(p, pb::HISTOGRAM_POSITIVE_SPAN, pb::HISTOGRAM_POSITIVE_DELTA, pos + 1, npos);
+    p.end();
+    p.end();
+    return pos + 1 + 2 * npos;
+}
+
+} // namespace detail
+} // namespace promxx
@@ -0,0 +1,64 @@
+//
+// Compares metric updates done with seq_cst and relaxed memory order.
+// On x86 read-modify-write is a locked instruction either way, so the
+// difference is mostly in stores (Gauge::set). On ARM both differ.
+//
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <promxx/registry.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+std::size_t const ITERATIONS = 10000000;
+
+template<class F>
+double measure(unsigned threads, F f)
+{
+    std::vector<std::thread> pool;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t)
+        pool.emplace_back([&f]{
+            for (std::size_t i = 0; i < ITERATIONS; ++i)
+                f(i);
+        });
+    for (auto& t: pool)
+        t.join();
+    std::chrono::duration<double, std::nano> d = std::chrono::steady_clock::now() - start;
+    return d.count() / ITERATIONS;
+}
+
+template<std::memory_order O>
+void run(char const* name, unsigned threads)
+{
+    std::atomic<Unsigned> v{0};
+    auto add = measure(threads, [&v](std::size_t i){ v.fetch_add(i, O); });
+    auto store = measure(threads, [&v](std::size_t i){ v.store(i, O); });
+    std::printf("%-8s threads=%-2u fetch_add %6.2f ns/op  store %6.2f ns/op\n",
+                name, threads, add, store);
+}
+
+} // namespace
+
+int main()
+{
+    unsigned const hc = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned threads = 1; threads <= hc; threads *= 2) {
+        run<std::memory_order_seq_cst>("seq_cst", threads);
+        run<std::memory_order_relaxed>("relaxed", threads);
+    }
+
+    Registry r;
+    auto& c = r.add(Counter("c"));
+    auto& g = r.add(Gauge<Unsigned>("g"));
+    auto inc = measure(1, [&c](std::size_t){ c.inc(); });
+    auto set = measure(1, [&g](std::size_t i){ g.set(i); });
+    std::printf("policy   ICounter::inc %6.2f ns/op  IGauge::set %6.2f ns/op\n", inc, set);
+}
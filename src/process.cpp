@@ -0,0 +1,236 @@
+#include <promxx/process.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace promxx
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// File of /proc kept open and read again from the start on each sample
+class ProcFile: detail::NoCopyMove
+{
+    int fd_;
+
+public:
+    explicit ProcFile(char const* path) noexcept
+        : fd_(::open(path, O_RDONLY | O_CLOEXEC)) {}
+
+    ~ProcFile()
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    // The whole content into buf, null terminated, false if unreadable
+    bool read(std::vector<char>& buf)
+    {
+        if (fd_ < 0)
+            return false;
+        for (;;) {
+            auto n = ::pread(fd_, buf.data(), buf.size(), 0);
+            if (n < 0)
+                return false;
+            if (std::size_t(n) < buf.size()) {
+                buf[n] = '\0';
+                return true;
+            }
+            buf.resize(buf.size() * 2);
+        }
+    }
+};
+
+// Value of the line starting with key, as in /proc/stat
+bool find_value(char const* text, char const* key, Unsigned& v)
+{
+    auto const n = std::strlen(key);
+    for (auto p = text; p; p = std::strchr(p, '\n')) {
+        if (*p == '\n')
+            ++p;
+        if (std::strncmp(p, key, n) == 0) {
+            v = std::strtoull(p + n, nullptr, 10);
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+struct ProcessCollector::Data
+{
+    Clock::duration max_age;
+    Clock::time_point sampled;
+    bool valid = false; // sampled at all
+    pid_t pid = -1;
+    std::unique_ptr<ProcFile> stat;
+    std::unique_ptr<ProcFile> statm;
+    DIR* fds = nullptr;
+    std::vector<char> buf = std::vector<char>(1024);
+    double const ticks = double(::sysconf(_SC_CLK_TCK));
+    Unsigned const page = Unsigned(::sysconf(_SC_PAGESIZE));
+    double boot_time = -1; // seconds since the epoch
+    std::mutex mtx;
+
+    RealCounter const cpu{"process_cpu_seconds_total", "Total user and system CPU time spent in seconds."};
+    Gauge<double> const start{"process_start_time_seconds", "Start time of the process since unix epoch in seconds."};
+    Gauge<Unsigned> const virt{"process_virtual_memory_bytes", "Virtual memory size in bytes."};
+    Gauge<Unsigned> const rss{"process_resident_memory_bytes", "Resident memory size in bytes."};
+    Gauge<Unsigned> const open_fds{"process_open_fds", "Number of open file descriptors."};
+    Gauge<Unsigned> const max_fds{"process_max_fds", "Maximum number of open file descriptors."};
+    Gauge<Unsigned> const threads{"process_threads", "Number of OS threads in the process."};
+
+    // the last sample
+    bool has_stat = false;
+    bool has_statm = false;
+    bool has_fds = false;
+    bool has_max = false;
+    double cpu_v = 0;
+    double start_v = 0;
+    Unsigned virt_v = 0;
+    Unsigned rss_v = 0;
+    Unsigned fds_v = 0;
+    Unsigned max_v = 0;
+    Unsigned threads_v = 0;
+
+    ~Data()
+    {
+        if (fds)
+            ::closedir(fds);
+    }
+
+    // Again in a forked child, /proc/self was the parent when opened
+    void open()
+    {
+        pid = ::getpid();
+        stat.reset(new ProcFile("/proc/self/stat"));
+        statm.reset(new ProcFile("/proc/self/statm"));
+        if (fds)
+            ::closedir(fds);
+        fds = ::opendir("/proc/self/fd");
+        if (boot_time < 0) {
+            ProcFile f{"/proc/stat"};
+            Unsigned btime;
+            if (f.read(buf) && find_value(buf.data(), "btime ", btime))
+                boot_time = double(btime);
+        }
+    }
+
+    // Fields from /proc/[pid]/stat, see proc(5)
+    bool parse_stat()
+    {
+        // the command is in parentheses and may contain any of them
+        auto p = std::strrchr(buf.data(), ')');
+        if (!p)
+            return false;
+        ++p;
+        Unsigned utime = 0, stime = 0, starttime = 0;
+        // from the state, field 3, on
+        for (int field = 3; field <= 24; ++field) {
+            while (*p == ' ')
+                ++p;
+            if (!*p)
+                return false;
+            char* end;
+            auto v = std::strtoull(p, &end, 10);
+            switch (field) {
+            case 14: utime = v; break;
+            case 15: stime = v; break;
+            case 20: threads_v = v; break;
+            case 22: starttime = v; break;
+            case 23: virt_v = v; break;
+            }
+            p = std::strchr(end, ' ');
+            if (!p) {
+                if (field < 24)
+                    return false;
+                break;
+            }
+        }
+        cpu_v = double(utime + stime) / ticks;
+        start_v = boot_time < 0 ? -1 : boot_time + double(starttime) / ticks;
+        return true;
+    }
+};
+
+ProcessCollector::ProcessCollector(std::chrono::milliseconds max_age)
+    : data_(new Data())
+{
+    data_->max_age = max_age;
+}
+
+ProcessCollector::~ProcessCollector() = default;
+
+void ProcessCollector::sample()
+{
+    auto& d = *data_;
+    if (d.pid != ::getpid())
+        d.open();
+
+    d.has_stat = d.stat->read(d.buf) && d.parse_stat();
+
+    d.has_statm = false;
+    if (d.statm->read(d.buf)) {
+        // size, then resident, in pages
+        char* p;
+        std::strtoull(d.buf.data(), &p, 10);
+        d.rss_v = std::strtoull(p, nullptr, 10) * d.page;
+        d.has_statm = true;
+    }
+
+    d.has_fds = d.fds != nullptr;
+    if (d.fds) {
+        ::rewinddir(d.fds);
+        Unsigned n = 0;
+        while (auto e = ::readdir(d.fds))
+            if (e->d_name[0] != '.')
+                ++n;
+        // less the one of the listing
+        d.fds_v = n ? n - 1 : 0;
+    }
+
+    rlimit rl;
+    d.has_max = ::getrlimit(RLIMIT_NOFILE, &rl) == 0;
+    d.max_v = d.has_max ? Unsigned(rl.rlim_cur) : 0;
+
+    d.sampled = Clock::now();
+    d.valid = true;
+}
+
+void ProcessCollector::collect(Collection& c)
+{
+    auto& d = *data_;
+    std::lock_guard<std::mutex> lock{d.mtx};
+    if (!d.valid || Clock::now() - d.sampled >= d.max_age)
+        sample();
+
+    if (d.has_stat) {
+        c.add(d.cpu).inc(d.cpu_v);
+        if (d.start_v >= 0)
+            c.add(d.start).set(d.start_v);
+        c.add(d.virt).set(d.virt_v);
+        c.add(d.threads).set(d.threads_v);
+    }
+    if (d.has_statm)
+        c.add(d.rss).set(d.rss_v);
+    if (d.has_fds)
+        c.add(d.open_fds).set(d.fds_v);
+    if (d.has_max)
+        c.add(d.max_fds).set(d.max_v);
+}
+
+Collector& add_process_collector(Registry& r)
+{
+    return r.add_collector(std::unique_ptr<Collector>(new ProcessCollector()));
+}
+
+} // namespace promxx
@@ -0,0 +1,70 @@
+#include <sstream>
+#include <string>
+#include <cassert>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <promxx/process.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+std::string text(Registry& r)
+{
+    std::stringstream ss;
+    r.flush(ss);
+    return ss.str();
+}
+
+// Value of the sample line starting with name
+double value(std::string const& out, std::string const& name)
+{
+    auto pos = out.find('\n' + name + ' ');
+    assert(pos != std::string::npos);
+    return std::strtod(out.c_str() + pos + name.size() + 2, nullptr);
+}
+
+} // namespace
+
+int main()
+{
+    {
+        Registry r;
+        r.add_collector(std::unique_ptr<Collector>(new ProcessCollector(std::chrono::milliseconds(0))));
+
+        // some CPU time to show
+        volatile Unsigned x = 0;
+        for (Unsigned i = 0; i < 200000000 && value(text(r), "process_cpu_seconds_total") == 0; i += 1000000)
+            for (Unsigned j = 0; j < 1000000; ++j)
+                x = x + j;
+
+        auto out = text(r);
+        assert(out.find("# TYPE process_cpu_seconds_total counter\n") != std::string::npos);
+        assert(value(out, "process_cpu_seconds_total") > 0);
+        assert(value(out, "process_start_time_seconds") > 1e9);
+        assert(value(out, "process_virtual_memory_bytes") > 0);
+        assert(value(out, "process_resident_memory_bytes") > 0);
+        assert(value(out, "process_max_fds") > 0);
+        assert(value(out, "process_threads") == 1);
+
+        auto const fds = value(out, "process_open_fds");
+        assert(fds >= 3);
+        int fd = ::open("/dev/null", O_RDONLY);
+        assert(value(text(r), "process_open_fds") == fds + 1);
+        ::close(fd);
+    }
+
+    // samples within max age are reused
+    {
+        Registry r;
+        add_process_collector(r);
+        auto const fds = value(text(r), "process_open_fds");
+        int fd = ::open("/dev/null", O_RDONLY);
+        assert(value(text(r), "process_open_fds") == fds);
+        ::close(fd);
+    }
+}
@@ -0,0 +1,303 @@
+//
+// Throughput of updates, registration and flush, with Google Benchmark.
+// Updates run at 1 to 64 threads on one series, so contended ones show
+// the cost of sharing a cache line. Build with optimization, e.g.
+// CMAKE_BUILD_TYPE=Release, and filter with --benchmark_filter.
+//
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <promxx/family.hpp>
+#include <promxx/local.hpp>
+#include <promxx/native_histogram.hpp>
+#include <promxx/registry.hpp>
+#include <promxx/summary.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+class NullSink final: public Sink
+{
+public:
+    std::size_t size = 0;
+
+    void write(char const*, std::size_t n) override { size += n; }
+};
+
+// Registry of the update benchmarks, series made on first use
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+// Observed values, spread over the buckets of the histograms below
+Unsigned value(std::size_t i) noexcept
+{
+    return (i * 2654435761u) % 2000;
+}
+
+void counter_inc(benchmark::State& state)
+{
+    static auto& c = registry().add(Counter("bench_counter"));
+    for (auto _: state)
+        c.inc();
+    state.SetItemsProcessed(state.iterations());
+}
+
+void sharded_counter_inc(benchmark::State& state)
+{
+    static auto& c = registry().add(ShardedCounter("bench_sharded_counter"));
+    for (auto _: state)
+        c.inc();
+    state.SetItemsProcessed(state.iterations());
+}
+
+void local_counter_inc(benchmark::State& state)
+{
+    static auto& c = registry().add(Counter("bench_local_counter"));
+    LocalCounter local{c, LocalCounter::THRESHOLD, registry()};
+    for (auto _: state)
+        local.inc();
+    state.SetItemsProcessed(state.iterations());
+}
+
+void gauge_set(benchmark::State& state)
+{
+    static auto& g = registry().add(Gauge<Unsigned>("bench_gauge"));
+    Unsigned i = 0;
+    for (auto _: state)
+        g.set(++i);
+    state.SetItemsProcessed(state.iterations());
+}
+
+void real_gauge_inc(benchmark::State& state)
+{
+    static auto& g = registry().add(Gauge<double>("bench_real_gauge"));
+    for (auto _: state)
+        g.inc(0.5);
+    state.SetItemsProcessed(state.iterations());
+}
+
+void counter_inc_exemplar(benchmark::State& state)
+{
+    static auto& c = registry().add(Counter("bench_exemplar_counter"));
+    for (auto _: state)
+        c.inc(1, {{"trace_id", "4bf92f3577b34da6a3ce929d0e0e4736"}});
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Histograms of the bucket layouts with about the same buckets, 0 to 2000
+IHistogram& histogram(Histogram::Layout layout)
+{
+    static auto& h = registry().add(Histogram("bench_explicit", Buckets{
+        1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000}));
+    static auto& lh = registry().add(Histogram("bench_linear", LinearBuckets{100, 100, 20}));
+    static auto& eh = registry().add(Histogram("bench_exponential", ExponentialBuckets{1, 2, 11}));
+    switch (layout) {
+    case Histogram::Layout::Linear: return lh;
+    case Histogram::Layout::Exponential: return eh;
+    default: return h;
+    }
+}
+
+void histogram_observe(benchmark::State& state)
+{
+    auto& h = histogram(Histogram::Layout(state.range(0)));
+    std::size_t i = state.thread_index();
+    for (auto _: state)
+        h.observe(value(i++));
+    state.SetItemsProcessed(state.iterations());
+}
+
+void histogram_observe_real(benchmark::State& state)
+{
+    auto& h = histogram(Histogram::Layout(state.range(0)));
+    std::size_t i = state.thread_index();
+    for (auto _: state)
+        h.observe(double(value(i++)) + 0.5);
+    state.SetItemsProcessed(state.iterations());
+}
+
+void local_histogram_observe(benchmark::State& state)
+{
+    LocalHistogram local{histogram(Histogram::Layout::Explicit), LocalHistogram::THRESHOLD, registry()};
+    std::size_t i = state.thread_index();
+    for (auto _: state)
+        local.observe(value(i++));
+    state.SetItemsProcessed(state.iterations());
+}
+
+void native_histogram_observe(benchmark::State& state)
+{
+    static auto& h = registry().add(NativeHistogram("bench_native"));
+    std::size_t i = state.thread_index();
+    for (auto _: state)
+        h.observe(double(value(i++)) + 0.5);
+    state.SetItemsProcessed(state.iterations());
+}
+
+void summary_observe(benchmark::State& state)
+{
+    static auto& s = registry().add(Summary("bench_summary", Quantiles{0.5, 0.9, 0.99}));
+    std::size_t i = state.thread_index();
+    for (auto _: state)
+        s.observe(double(value(i++)) + 0.5);
+    state.SetItemsProcessed(state.iterations());
+}
+
+void histogram_observe_exemplar(benchmark::State& state)
+{
+    auto& h = histogram(Histogram::Layout::Explicit);
+    std::size_t i = state.thread_index();
+    for (auto _: state)
+        h.observe(value(i++), {{"trace_id", "4bf92f3577b34da6a3ce929d0e0e4736"}});
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Label values of series i
+std::vector<std::string> labels(std::size_t i)
+{
+    return {"/path/" + std::to_string(i % 1000), std::to_string(200 + i / 1000 % 5),
+            "host" + std::to_string(i / 5000)};
+}
+
+// Registers range(0) series in a fresh registry
+void registry_add(benchmark::State& state)
+{
+    auto const n = std::size_t(state.range(0));
+    std::vector<std::vector<std::string>> values;
+    values.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+        values.push_back(labels(i));
+    Counter const desc{"requests", "Requests", {"path", "code", "host"}};
+    for (auto _: state) {
+        std::unique_ptr<Registry> r{new Registry()};
+        for (auto& v: values)
+            r->add(desc, v);
+        state.PauseTiming();
+        r.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Finds series already registered through a Family, as get-or-create
+void family_labels(benchmark::State& state)
+{
+    auto const n = std::size_t(state.range(0));
+    Registry r;
+    auto& f = r.family(Counter("requests", "Requests", {"path", "code", "host"}));
+    std::vector<std::vector<std::string>> values;
+    for (std::size_t i = 0; i < n; ++i) {
+        values.push_back(labels(i));
+        f.labels(values.back());
+    }
+    std::size_t i = 0;
+    for (auto _: state) {
+        auto& v = values[i++ % n];
+        benchmark::DoNotOptimize(&f.labels(v[0], v[1], v[2]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Registry of n counter series and a histogram per hundred of them,
+// c is the first counter
+Registry& flush_registry(std::size_t n, ICounter** c = nullptr)
+{
+    static std::size_t made = 0;
+    static std::unique_ptr<Registry> r;
+    static ICounter* first;
+    if (made != n) {
+        r.reset(new Registry());
+        Counter const desc{"requests", "Requests", {"path", "code", "host"}};
+        Histogram const latency{"latency", Buckets{1, 5, 10, 50, 100, 500}, "Latency", {"path"}};
+        for (std::size_t i = 0; i < n; ++i) {
+            auto& s = r->add(desc, labels(i));
+            s.inc(i);
+            if (!i)
+                first = &s;
+            if (i % 100 == 0)
+                r->add(latency, {std::to_string(i)}).observe(Unsigned(i % 700));
+        }
+        made = n;
+    }
+    if (c)
+        *c = first;
+    return *r;
+}
+
+void flush(benchmark::State& state, Format f, bool changing)
+{
+    auto const n = std::size_t(state.range(0));
+    ICounter* counter;
+    auto& r = flush_registry(n, &counter);
+    auto& c = *counter;
+    NullSink sink;
+    std::size_t bytes = 0;
+    for (auto _: state) {
+        // a changed value makes the render cache format its family again
+        if (changing)
+            c.inc();
+        sink.size = 0;
+        r.flush(sink, f);
+        bytes = sink.size;
+    }
+    state.SetBytesProcessed(state.iterations() * bytes);
+    state.counters["bytes"] = double(bytes);
+    state.counters["series"] = double(n);
+}
+
+void flush_text(benchmark::State& state) { flush(state, Format::Text, true); }
+void flush_text_unchanged(benchmark::State& state) { flush(state, Format::Text, false); }
+void flush_openmetrics(benchmark::State& state) { flush(state, Format::OpenMetrics, true); }
+void flush_protobuf(benchmark::State& state) { flush(state, Format::Protobuf, true); }
+
+void flush_parallel(benchmark::State& state)
+{
+    auto const n = std::size_t(state.range(0));
+    auto& r = flush_registry(n);
+    NullSink sink;
+    for (auto _: state) {
+        sink.size = 0;
+        r.flush(sink, Format::Text, std::size_t(state.range(1)));
+    }
+    state.SetBytesProcessed(state.iterations() * sink.size);
+    state.counters["bytes"] = double(sink.size);
+}
+
+} // namespace
+
+BENCHMARK(counter_inc)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(sharded_counter_inc)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(local_counter_inc)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(gauge_set)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(real_gauge_inc)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(counter_inc_exemplar)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK(histogram_observe)
+    ->ArgName("layout")->DenseRange(0, 2)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(histogram_observe_real)
+    ->ArgName("layout")->DenseRange(0, 2)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(local_histogram_observe)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(native_histogram_observe)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(summary_observe)->ThreadRange(1, 64)->UseRealTime();
+BENCHMARK(histogram_observe_exemplar)->ThreadRange(1, 64)->UseRealTime();
+
+BENCHMARK(registry_add)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(family_labels)->RangeMultiplier(10)->Range(1000, 1000000);
+
+BENCHMARK(flush_text)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(flush_text_unchanged)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(flush_openmetrics)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(flush_protobuf)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK(flush_parallel)
+    ->ArgNames({"series", "parts"})->ArgsProduct({{100000, 1000000}, {1, 2, 4, 8}})
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,326 @@
+#include <promxx/pusher.hpp>
+#include <promxx/snappy.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace promxx
+{
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Writes all of the data before the deadline
+bool send_all(int fd, char const* data, std::size_t size, Clock::time_point deadline)
+{
+    while (size) {
+        auto n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n > 0) {
+            data += n;
+            size -= n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return false;
+        auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+        pollfd p{fd, POLLOUT, 0};
+        if (left.count() <= 0 || ::poll(&p, 1, int(left.count())) <= 0)
+            return false;
+    }
+    return true;
+}
+
+// One request on a new connection, returns the status or 0 if it failed
+int request(Pusher::Options const& o, char const* method, char const* type,
+            char const* encoding, std::string const& body)
+{
+    auto const deadline = Clock::now() + o.timeout;
+
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addrs;
+    auto const service = std::to_string(o.port);
+    if (getaddrinfo(o.host.c_str(), service.c_str(), &hints, &addrs) != 0)
+        return 0;
+    int fd = -1;
+    for (auto a = addrs; a && fd < 0; a = a->ai_next) {
+        fd = ::socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        int error = errno;
+        if (error == EINPROGRESS) {
+            auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+            pollfd p{fd, POLLOUT, 0};
+            socklen_t len = sizeof error;
+            if (left.count() > 0 && ::poll(&p, 1, int(left.count())) == 1
+                && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+                break;
+        }
+        ::close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0)
+        return 0;
+
+    std::string head = std::string(method) + ' ' + o.path + " HTTP/1.1\r\n"
+        "Host: " + o.host + "\r\n"
+        "Content-Type: " + type + "\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "Connection: close\r\n";
+    if (encoding)
+        head += std::string("Content-Encoding: ") + encoding + "\r\n";
+    if (o.mode == Pusher::Mode::RemoteWrite)
+        head += "X-Prometheus-Remote-Write-Version: 0.1.0\r\n";
+    for (auto& h: o.headers)
+        head += h.first + ": " + h.second + "\r\n";
+    head += "\r\n";
+
+    int status = 0;
+    if (send_all(fd, head.data(), head.size(), deadline)
+        && send_all(fd, body.data(), body.size(), deadline)) {
+        // the status line is enough, the rest is dropped with the connection
+        std::string in;
+        char buf[512];
+        while (in.find("\r\n") == std::string::npos) {
+            auto n = ::recv(fd, buf, sizeof buf, 0);
+            if (n > 0) {
+                in.append(buf, n);
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                break;
+            auto const left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+            pollfd p{fd, POLLIN, 0};
+            if (left.count() <= 0 || ::poll(&p, 1, int(left.count())) <= 0)
+                break;
+        }
+        if (in.compare(0, 5, "HTTP/") == 0 && in.find(' ') != std::string::npos)
+            status = std::atoi(in.c_str() + in.find(' ') + 1);
+    }
+    ::close(fd);
+    return status;
+}
+
+} // namespace
+
+std::string remote_write_request(Snapshot const& s, long long timestamp)
+{
+    ProtoWriter p;
+    s.remote_write(p, timestamp);
+    return p.data();
+}
+
+struct Pusher::Data
+{
+    Options const options_;
+    Registry& registry_;
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    bool push_ = false;
+    bool stop_ = false;
+    Stats stats_;
+    // encoded snapshots, oldest first
+    std::deque<std::string> queue_;
+    std::size_t queued_ = 0;
+    // ever, tells what left the queue while sending
+    Unsigned popped_ = 0;
+    std::thread thread_;
+
+    Data(Options o, Registry& r): options_(std::move(o)), registry_(r) {}
+
+    void run();
+
+    void pop()
+    {
+        queued_ -= queue_.front().size();
+        queue_.pop_front();
+        ++popped_;
+    }
+
+    // Takes a snapshot into the queue, under mtx_
+    void take(std::unique_lock<std::mutex>& lock);
+
+    // Sends the batch at the front of the queue, false if it failed
+    // for now, true if it's done with, under mtx_ which it releases
+    bool send(std::unique_lock<std::mutex>& lock);
+};
+
+void Pusher::Data::take(std::unique_lock<std::mutex>& lock)
+{
+    lock.unlock();
+    std::string payload;
+    {
+        Snapshot s;
+        registry_.snapshot(s);
+        if (options_.mode == Mode::RemoteWrite) {
+            auto const now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch());
+            payload = remote_write_request(s, now.count());
+        }
+        else {
+            StringSink sink{payload};
+            Writer w{sink};
+            s.write(w);
+            w.flush();
+        }
+    }
+    lock.lock();
+    // the gateway keeps the latest group only
+    while (!queue_.empty() && options_.mode == Mode::Pushgateway) {
+        pop();
+        ++stats_.dropped;
+    }
+    queued_ += payload.size();
+    queue_.push_back(std::move(payload));
+    while (queued_ > options_.max_queue && queue_.size() > 1) {
+        pop();
+        ++stats_.dropped;
+    }
+}
+
+bool Pusher::Data::send(std::unique_lock<std::mutex>& lock)
+{
+    // a merge of WriteRequest messages is their concatenation
+    std::size_t n = 1;
+    auto size = queue_.front().size();
+    if (options_.mode == Mode::RemoteWrite)
+        for (; n < queue_.size() && size + queue_[n].size() <= options_.max_batch; ++n)
+            size += queue_[n].size();
+    std::string batch;
+    batch.reserve(size);
+    for (std::size_t i = 0; i < n; ++i)
+        batch += queue_[i];
+    auto const popped = popped_;
+    lock.unlock();
+
+    int status;
+    if (options_.mode == Mode::RemoteWrite) {
+        std::string body;
+        snappy_compress(batch.data(), batch.size(), body);
+        status = request(options_, "POST", "application/x-protobuf", "snappy", body);
+    }
+    else
+        status = request(options_, "PUT", "text/plain; version=0.0.4", nullptr, batch);
+
+    lock.lock();
+    bool const ok = status >= 200 && status < 300;
+    // client errors don't get better by retrying, except too many requests
+    bool const done = ok || (status >= 400 && status < 500 && status != 429);
+    if (ok)
+        ++stats_.sent;
+    if (done) {
+        // less those dropped or replaced meanwhile
+        auto const gone = popped_ - popped;
+        for (auto i = gone; i < n; ++i) {
+            pop();
+            if (!ok)
+                ++stats_.dropped;
+        }
+    }
+    return done;
+}
+
+void Pusher::Data::run()
+{
+    std::unique_lock<std::mutex> lock{mtx_};
+    auto retry = Clock::now();
+    auto next = retry + options_.interval;
+    auto backoff = options_.min_backoff;
+    unsigned attempts = 0;
+    Clock::time_point deadline;
+
+    for (;;) {
+        auto const now = Clock::now();
+        if (stop_ && deadline == Clock::time_point()) {
+            deadline = now + options_.timeout;
+            // the last values, sent even if failing before
+            take(lock);
+            retry = now;
+        }
+        else if (push_ || now >= next) {
+            take(lock);
+            next = now + options_.interval;
+        }
+        push_ = false;
+
+        if (!queue_.empty() && Clock::now() >= retry) {
+            if (send(lock)) {
+                attempts = 0;
+                backoff = options_.min_backoff;
+                retry = Clock::now();
+                continue;
+            }
+            if (++attempts > options_.max_retries) {
+                // given up on
+                pop();
+                ++stats_.dropped;
+                attempts = 0;
+                backoff = options_.min_backoff;
+                continue;
+            }
+            ++stats_.retries;
+            retry = Clock::now() + backoff;
+            backoff = std::min(backoff * 2, options_.max_backoff);
+        }
+        if (stop_ && (queue_.empty() || Clock::now() >= deadline))
+            break;
+
+        auto wake = stop_ ? deadline : next;
+        if (!queue_.empty())
+            wake = std::min(wake, retry);
+        cv_.wait_until(lock, wake, [&]{ return push_ || (stop_ && deadline == Clock::time_point()); });
+    }
+}
+
+Pusher::Pusher(Options options, Registry& r)
+{
+    std::unique_ptr<Data> d{new Data(std::move(options), r)};
+    auto p = d.get();
+    d->thread_ = std::thread([p]{ p->run(); });
+    data_ = d.release();
+}
+
+Pusher::~Pusher()
+{
+    {
+        std::lock_guard<std::mutex> lock{data_->mtx_};
+        data_->stop_ = true;
+    }
+    data_->cv_.notify_one();
+    data_->thread_.join();
+    delete data_;
+}
+
+void Pusher::push()
+{
+    {
+        std::lock_guard<std::mutex> lock{data_->mtx_};
+        data_->push_ = true;
+    }
+    data_->cv_.notify_one();
+}
+
+Pusher::Stats Pusher::stats() const
+{
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    return data_->stats_;
+}
+
+} // namespace promxx
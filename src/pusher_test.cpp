@@ -0,0 +1,370 @@
+#include <cassert>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <promxx/pusher.hpp>
+#include <promxx/snappy.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+struct Request
+{
+    std::string head; // request line and headers, lower case
+    std::string body;
+};
+
+// Answers each connection with the next of the statuses, 200 when out
+class Server
+{
+    int fd_;
+    unsigned short port_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<int> statuses_;
+    std::vector<Request> requests_;
+    bool stop_ = false;
+    std::thread thread_;
+
+    void serve(int c)
+    {
+        timeval tv{5, 0};
+        setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+        std::string in;
+        char buf[4096];
+        std::size_t eoh;
+        while ((eoh = in.find("\r\n\r\n")) == std::string::npos) {
+            auto n = recv(c, buf, sizeof buf, 0);
+            if (n <= 0)
+                return;
+            in.append(buf, n);
+        }
+        Request r;
+        r.head = in.substr(0, eoh);
+        for (auto& ch: r.head)
+            ch = char(std::tolower(static_cast<unsigned char>(ch)));
+        auto len = r.head.find("content-length: ");
+        assert(len != std::string::npos);
+        std::size_t const size = std::stoul(r.head.substr(len + 16));
+        r.body = in.substr(eoh + 4);
+        while (r.body.size() < size) {
+            auto n = recv(c, buf, sizeof buf, 0);
+            if (n <= 0)
+                return;
+            r.body.append(buf, n);
+        }
+
+        int status = 200;
+        {
+            std::lock_guard<std::mutex> lock{mtx_};
+            if (!statuses_.empty()) {
+                status = statuses_.front();
+                statuses_.pop_front();
+            }
+            requests_.push_back(std::move(r));
+        }
+        cv_.notify_all();
+        auto res = "HTTP/1.1 " + std::to_string(status) + " X\r\nContent-Length: 0\r\n\r\n";
+        send(c, res.data(), res.size(), MSG_NOSIGNAL);
+    }
+
+public:
+    explicit Server(std::deque<int> statuses = {}): statuses_(std::move(statuses))
+    {
+        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        assert(fd_ >= 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        auto rc = bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof addr);
+        assert(rc == 0);
+        rc = listen(fd_, 16);
+        assert(rc == 0);
+        socklen_t len = sizeof addr;
+        getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+        (void)rc;
+        thread_ = std::thread([this]{
+            for (;;) {
+                int c = accept(fd_, nullptr, nullptr);
+                {
+                    std::lock_guard<std::mutex> lock{mtx_};
+                    if (stop_) {
+                        if (c >= 0)
+                            close(c);
+                        return;
+                    }
+                }
+                if (c < 0)
+                    continue;
+                serve(c);
+                close(c);
+            }
+        });
+    }
+
+    ~Server()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mtx_};
+            stop_ = true;
+        }
+        // wakes up accept()
+        shutdown(fd_, SHUT_RDWR);
+        thread_.join();
+        close(fd_);
+    }
+
+    unsigned short port() const { return port_; }
+
+    // Waits for at least n requests
+    std::vector<Request> wait(std::size_t n)
+    {
+        std::unique_lock<std::mutex> lock{mtx_};
+        auto ok = cv_.wait_for(lock, std::chrono::seconds(10), [&]{ return requests_.size() >= n; });
+        assert(ok);
+        (void)ok;
+        return requests_;
+    }
+
+    std::size_t count()
+    {
+        std::lock_guard<std::mutex> lock{mtx_};
+        return requests_.size();
+    }
+};
+
+Pusher::Options options(unsigned short port, Pusher::Mode mode = Pusher::Mode::Pushgateway)
+{
+    Pusher::Options o;
+    o.port = port;
+    o.mode = mode;
+    o.interval = std::chrono::hours(1);
+    o.timeout = std::chrono::milliseconds(2000);
+    o.min_backoff = std::chrono::milliseconds(10);
+    o.max_backoff = std::chrono::milliseconds(40);
+    return o;
+}
+
+std::string text(Registry& r)
+{
+    std::stringstream ss;
+    r.flush(ss);
+    return ss.str();
+}
+
+// Nested length-delimited field at p, as the tests write them
+std::string field(std::string const& msg, std::size_t& pos, unsigned& number)
+{
+    assert(pos < msg.size());
+    auto const tag = static_cast<unsigned char>(msg[pos++]);
+    number = tag >> 3;
+    assert((tag & 7) == ProtoWriter::BYTES);
+    std::size_t len = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        auto const b = static_cast<unsigned char>(msg[pos++]);
+        len |= std::size_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    auto f = msg.substr(pos, len);
+    pos += len;
+    return f;
+}
+
+} // namespace
+
+int main()
+{
+    Registry r;
+    auto& requests = r.add(Counter("requests", "Requests", {"path"}), {"/a"});
+    requests.inc(3);
+    r.add(Gauge<double>("temperature", "Temperature")).set(21.5);
+
+    // the time series of a remote write request, labels sorted
+    {
+        Snapshot s;
+        r.snapshot(s);
+        auto const msg = remote_write_request(s, 1234);
+        std::size_t pos = 0;
+        unsigned number;
+        auto series = field(msg, pos, number);
+        assert(number == 1);
+        std::size_t spos = 0;
+        auto label = field(series, spos, number);
+        assert(number == 1);
+        assert(label == std::string("\x0a\x08__name__\x12\x08requests", 20));
+        label = field(series, spos, number);
+        assert(label == std::string("\x0a\x04path\x12\x02/a", 10));
+        auto sample = field(series, spos, number);
+        assert(number == 2);
+        // 3.0 as a fixed64 double, then the timestamp
+        assert(sample == std::string("\x09\0\0\0\0\0\0\x08\x40\x10\xd2\x09", 12));
+        assert(spos == series.size());
+        series = field(msg, pos, number);
+        assert(series.find("temperature") != std::string::npos);
+        assert(pos == msg.size());
+    }
+
+    // label values as they are, quotes and all, names sorted with the
+    // ones the types add
+    {
+        Registry q;
+        q.add(Counter("calls", "", {"path", "Zone"}), {"a\",b", "x\"}"}).inc();
+        q.add(Histogram("latency", Buckets{10}, "", {"path"}), {"/\"}"}).observe(Unsigned(20));
+        Snapshot s;
+        q.snapshot(s);
+        auto const msg = remote_write_request(s, 1);
+        // labels of each series as name=value
+        std::vector<std::vector<std::string>> all;
+        unsigned number;
+        for (std::size_t pos = 0; pos < msg.size();) {
+            auto const series = field(msg, pos, number);
+            all.emplace_back();
+            for (std::size_t spos = 0; spos < series.size();) {
+                auto const f = field(series, spos, number);
+                if (number != 1)
+                    continue;
+                std::size_t lpos = 0;
+                auto const name = field(f, lpos, number);
+                all.back().push_back(name + '=' + field(f, lpos, number));
+            }
+        }
+        assert(all.size() == 5);
+        assert((all[0] == std::vector<std::string>{"Zone=x\"}", "__name__=calls", "path=a\",b"}));
+        assert((all[1] == std::vector<std::string>{"__name__=latency_bucket", "le=10", "path=/\"}"}));
+        assert((all[2] == std::vector<std::string>{"__name__=latency_bucket", "le=+Inf", "path=/\"}"}));
+        assert((all[3] == std::vector<std::string>{"__name__=latency_sum", "path=/\"}"}));
+        assert((all[4] == std::vector<std::string>{"__name__=latency_count", "path=/\"}"}));
+    }
+
+    // the text format goes to the gateway on push()
+    {
+        Server server;
+        Pusher p(options(server.port()), r);
+        p.push();
+        auto got = server.wait(1);
+        assert(got[0].head.compare(0, 30, "put /metrics/job/promxx http/1") == 0);
+        assert(got[0].head.find("content-type: text/plain; version=0.0.4") != std::string::npos);
+        assert(got[0].body == text(r));
+    }
+
+    // snappy compressed protobuf with remote write
+    {
+        Server server;
+        auto o = options(server.port(), Pusher::Mode::RemoteWrite);
+        o.path = "/api/v1/write";
+        o.headers.emplace_back("Authorization", "Bearer x");
+        Pusher p(o, r);
+        p.push();
+        auto got = server.wait(1);
+        auto const& head = got[0].head;
+        assert(head.compare(0, 23, "post /api/v1/write http") == 0);
+        assert(head.find("content-encoding: snappy") != std::string::npos);
+        assert(head.find("content-type: application/x-protobuf") != std::string::npos);
+        assert(head.find("x-prometheus-remote-write-version: 0.1.0") != std::string::npos);
+        assert(head.find("authorization: bearer x") != std::string::npos);
+        std::string msg;
+        auto ok = snappy_uncompress(got[0].body.data(), got[0].body.size(), msg);
+        assert(ok);
+        (void)ok;
+        assert(msg.find("__name__") != std::string::npos);
+        assert(msg.find("temperature") != std::string::npos);
+    }
+
+    // retried after server errors, not after client errors
+    {
+        Server server({503, 429, 200});
+        Pusher p(options(server.port()), r);
+        p.push();
+        server.wait(3);
+        for (int i = 0; i < 500 && p.stats().sent == 0; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto s = p.stats();
+        assert(s.sent == 1);
+        assert(s.retries == 2);
+        assert(s.dropped == 0);
+    }
+    {
+        Server server({400});
+        Pusher::Stats s;
+        {
+            Pusher p(options(server.port()), r);
+            p.push();
+            server.wait(1);
+            for (int i = 0; i < 500 && p.stats().dropped == 0; ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            s = p.stats();
+        }
+        assert(s.sent == 0);
+        assert(s.retries == 0);
+        assert(s.dropped == 1);
+    }
+
+    // the last values are pushed on destruction
+    {
+        Server server;
+        {
+            Pusher p(options(server.port()), r);
+            requests.inc();
+        }
+        auto got = server.wait(1);
+        assert(got.size() == 1);
+        assert(got[0].body.find("requests{path=\"/a\"} 4\n") != std::string::npos);
+    }
+
+    // given up on when nobody listens, and destruction doesn't hang
+    {
+        unsigned short port;
+        {
+            Server server;
+            port = server.port();
+        }
+        auto o = options(port, Pusher::Mode::RemoteWrite);
+        o.max_retries = 2;
+        o.timeout = std::chrono::milliseconds(300);
+        auto const start = std::chrono::steady_clock::now();
+        {
+            Pusher p(o, r);
+            p.push();
+            for (int i = 0; i < 500 && p.stats().dropped == 0; ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            auto s = p.stats();
+            assert(s.retries == 2);
+            assert(s.dropped == 1);
+        }
+        assert(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    }
+
+    // the queue keeps its size by dropping the oldest
+    {
+        unsigned short port;
+        {
+            Server server;
+            port = server.port();
+        }
+        auto o = options(port, Pusher::Mode::RemoteWrite);
+        o.max_queue = 1;
+        o.min_backoff = o.max_backoff = std::chrono::hours(1);
+        Pusher p(o, r);
+        for (int i = 0; i < 3; ++i)
+            p.push();
+        for (int i = 0; i < 500 && p.stats().dropped < 2; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            p.push();
+        }
+        assert(p.stats().dropped >= 2);
+    }
+}
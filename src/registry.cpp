@@ -1,10 +1,21 @@
 #include <promxx/registry.hpp>
+#include <promxx/family.hpp>
+#include <promxx/local.hpp>
 
 #include <algorithm>
 #include <cmath>
-#include <list>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace promxx
 {
@@ -12,7 +23,6 @@ namespace
 {
 
 std::string const LE = "le";
-std::string const QUANTILE = "quantile";
 
 std::vector<std::string> histogram_keys(std::vector<std::string> keys)
 {
@@ -40,6 +50,8 @@ Histogram::Histogram(std::string name, Buckets bounds,
 Histogram::Histogram(std::string name, LinearBuckets lb,
                      std::string help, std::vector<std::string> keys)
     : detail::MetricMeta(name, histogram_keys(std::move(keys)), std::move(help))
+    , layout_(Layout::Linear)
+    , delta_(lb.delta)
 {
     if (lb.delta < 1)
         throw Error{"Histogram '" + name + "' delta must be not less than 1"};
@@ -59,6 +71,8 @@ Histogram::Histogram(std::string name, LinearBuckets lb,
 Histogram::Histogram(std::string name, ExponentialBuckets eb,
                      std::string help, std::vector<std::string> keys)
     : detail::MetricMeta(name, histogram_keys(std::move(keys)), std::move(help))
+    , layout_(eb.start > 0 ? Layout::Exponential : Layout::Explicit)
+    , delta_(eb.delta)
 {
     if (eb.delta <= 1)
         throw Error{"Histogram '" + name + "' delta must be greater than 1"};
@@ -77,27 +91,349 @@ Histogram::Histogram(std::string name, ExponentialBuckets eb,
     }
 }
 
+Histogram::Histogram(Histogram const& h, std::vector<std::string> keys)
+    : detail::MetricMeta(h.name(), histogram_keys(std::move(keys)), h.help())
+    , bounds_(h.bounds_)
+    , layout_(h.layout_)
+    , delta_(h.delta_)
+{
+}
+
+DenseCounter::DenseCounter(std::string name, std::vector<Dimension> dims,
+                           std::string help, std::vector<std::string> keys)
+    : detail::MetricMeta(name, std::move(keys), std::move(help))
+    , dims_(std::move(dims))
+{
+    if (dims_.empty())
+        throw Error{"Metric '" + name + "' has no dimensions"};
+    for (std::size_t i = 0; i < dims_.size(); ++i) {
+        auto const& key = dims_[i].key;
+        if (dims_[i].values.empty())
+            throw Error{"Metric '" + name + "' dimension '" + key + "' has no values"};
+        bool dup = std::any_of(this->keys().begin(), this->keys().end(),
+            [&key](detail::KeyValueI const& kv){ return kv.first == key; });
+        for (std::size_t j = 0; j < i && !dup; ++j)
+            dup = dims_[j].key == key;
+        if (dup)
+            throw Error{"Metric '" + name + "' has duplicate label names"};
+    }
+}
+
+IDenseCounter::IDenseCounter(std::vector<Dimension> const& dims)
+    : strides_(dims.size())
+    , extents_(dims.size())
+{
+    size_ = 1;
+    for (std::size_t d = dims.size(); d-- > 0;) {
+        strides_[d] = size_;
+        extents_[d] = dims[d].values.size();
+        size_ *= extents_[d];
+    }
+    cells_.reset(new ICounter[size_]);
+}
+
+IShardedCounter::IShardedCounter()
+{
+    // enough shards to spread the threads of the host, up to a sane limit
+    std::size_t n = 1;
+    std::size_t const hc = std::thread::hardware_concurrency();
+    while (n < hc && n < 64)
+        n <<= 1;
+    mask_ = n - 1;
+    cells_.reset(new detail::PaddedAtomic[n]);
+}
+
+Unsigned IShardedCounter::value() const noexcept
+{
+    Unsigned v = 0;
+    for (std::size_t i = 0; i <= mask_; ++i)
+        v += cells_[i].v_.load(detail::MEMORY_ORDER);
+    return v;
+}
+
 void IHistogram::observe(Unsigned v) noexcept
 {
-    std::lock_guard<std::mutex> lock{mtx_};
-    sum_ += v;
-    count_ += 1;
-    // TODO reset all if sum or count overflows
-    auto it = std::lower_bound(buckets_.begin(), buckets_.end(), v,
-        [](std::pair<Unsigned, Unsigned> b, Unsigned x){
-            return b.first < x;
-        });
-    for (; it != buckets_.end(); ++it)
-        it->second += 1;
+    add_sum(v);
+    counts_[bucket(v)].fetch_add(1, detail::MEMORY_ORDER);
+}
+
+std::size_t IHistogram::bucket(Unsigned v) const noexcept
+{
+    auto const n = bounds_.size();
+    if (n == 0 || v <= bounds_[0])
+        return 0;
+
+    switch (layout_) {
+    case Histogram::Layout::Linear: {
+        // bounds are start + i * step, the first one not less than v
+        auto i = (v - bounds_[0] - 1) / step_ + 1;
+        return i < n ? i : n;
+    }
+    case Histogram::Layout::Exponential: {
+        // bounds are floored powers, the estimate may be off by one
+        auto e = std::ceil((std::log(double(v)) - log_start_) * inv_log_delta_);
+        std::size_t i = e < 1 ? 1 : e > n ? n : std::size_t(e);
+        while (i > 1 && v <= bounds_[i - 1])
+            --i;
+        while (i < n && v > bounds_[i])
+            ++i;
+        return i;
+    }
+    case Histogram::Layout::Explicit:
+        break;
+    }
+
+    // branchless lower_bound
+    auto base = bounds_.data();
+    std::size_t len = n;
+    while (len > 1) {
+        auto half = len / 2;
+        base = base[half - 1] < v ? base + half : base;
+        len -= half;
+    }
+    return (base - bounds_.data()) + (*base < v);
+}
+
+std::size_t IHistogram::bucket(double v) const noexcept
+{
+    if (!(v < 18446744073709551616.0)) // 2^64 or NaN
+        return bounds_.size();
+    // with integer bounds v <= le is the same as ceil(v) <= le
+    return v > 0 ? bucket(Unsigned(std::ceil(v))) : 0;
+}
+
+void IHistogram::observe_real(double v) noexcept
+{
+    detail::atomic_add(real_sum_, v);
+    counts_[bucket(v)].fetch_add(1, detail::MEMORY_ORDER);
+}
+
+IHistogram::IHistogram(Histogram const& h)
+    : bounds_(h.bounds())
+    , layout_(h.layout())
+    , counts_(new std::atomic<Unsigned>[bounds_.size() + 1])
+{
+    for (std::size_t i = 0; i <= bounds_.size(); ++i)
+        counts_[i].store(0, std::memory_order_relaxed);
+    if (bounds_.size() < 2)
+        layout_ = Histogram::Layout::Explicit;
+    else if (layout_ == Histogram::Layout::Linear)
+        step_ = bounds_[1] - bounds_[0];
+    else if (layout_ == Histogram::Layout::Exponential) {
+        log_start_ = std::log(double(bounds_[0]));
+        inv_log_delta_ = 1 / std::log(h.delta());
+    }
+}
+
+IHistogram::~IHistogram()
+{
+    delete[] exemplars_.load(std::memory_order_relaxed);
+}
+
+void IHistogram::observe(Unsigned v, Exemplar e) noexcept
+{
+    auto const i = bucket(v);
+    add_sum(v);
+    counts_[i].fetch_add(1, detail::MEMORY_ORDER);
+    exemplar(i, e, double(v));
+}
+
+void IHistogram::exemplar(std::size_t i, Exemplar e, double v) noexcept
+{
+    if (auto x = detail::ExemplarSlot::slots(exemplars_, bounds_.size() + 1))
+        x[i].store(e, v);
+}
+
+IExemplarCounter::~IExemplarCounter()
+{
+    delete exemplar_.load(std::memory_order_relaxed);
+}
+
+void IExemplarCounter::inc(Unsigned d, Exemplar e) noexcept
+{
+    inc(d);
+    if (auto x = detail::ExemplarSlot::slots(exemplar_, 1))
+        x->store(e, double(d));
+}
+
+namespace
+{
+
+std::atomic<Unsigned> exemplar_interval_ms{0};
+
+} // namespace
+
+void exemplar_interval(std::chrono::milliseconds interval) noexcept
+{
+    exemplar_interval_ms.store(Unsigned(interval.count()), std::memory_order_relaxed);
+}
+
+namespace detail
+{
+
+ExemplarSlot* ExemplarSlot::slots(std::atomic<ExemplarSlot*>& a, std::size_t n)
+{
+    auto x = a.load(std::memory_order_acquire);
+    if (x)
+        return x;
+    // without an exemplar rather than failing the update
+    std::unique_ptr<ExemplarSlot[]> made{new (std::nothrow) ExemplarSlot[n]()};
+    if (!made)
+        return nullptr;
+    if (a.compare_exchange_strong(x, made.get(), std::memory_order_acq_rel, std::memory_order_acquire))
+        return made.release();
+    return x;
+}
+
+void ExemplarSlot::store(Exemplar e, double value) noexcept
+{
+    char buf[WORDS * sizeof(Unsigned)] = {};
+    std::size_t size = 0, chars = 0;
+    for (auto& l: e) {
+        chars += l.first.size + l.second.size;
+        if (chars > MAX_LABELS || size + 2 + l.first.size + l.second.size > sizeof buf)
+            return;
+        buf[size++] = char(l.first.size);
+        std::memcpy(buf + size, l.first.data, l.first.size);
+        size += l.first.size;
+        buf[size++] = char(l.second.size);
+        std::memcpy(buf + size, l.second.data, l.second.size);
+        size += l.second.size;
+    }
+
+    auto const now = Unsigned(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    auto const last = time_.load(std::memory_order_relaxed);
+    if (last && now - last < exemplar_interval_ms.load(std::memory_order_relaxed))
+        return;
+
+    auto seq = seq_.load(std::memory_order_relaxed);
+    if ((seq & 1) || !seq_.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed))
+        return;
+    // the odd number is seen before any of the data
+    std::atomic_thread_fence(std::memory_order_release);
+    time_.store(now ? now : 1, std::memory_order_relaxed);
+    value_.store(to_cell(value), std::memory_order_relaxed);
+    size_.store(size, std::memory_order_relaxed);
+    for (std::size_t i = 0; i * sizeof(Unsigned) < size; ++i) {
+        Unsigned w;
+        std::memcpy(&w, buf + i * sizeof(Unsigned), sizeof w);
+        labels_[i].store(w, std::memory_order_relaxed);
+    }
+    seq_.store(seq + 2, std::memory_order_release);
+}
+
+void ExemplarSlot::snapshot(std::vector<Unsigned>& cells) const
+{
+    Unsigned time, value, size, words[WORDS];
+    for (;;) {
+        auto const seq = seq_.load(std::memory_order_acquire);
+        if (seq & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        time = time_.load(std::memory_order_relaxed);
+        value = value_.load(std::memory_order_relaxed);
+        size = std::min<Unsigned>(size_.load(std::memory_order_relaxed), sizeof words);
+        for (std::size_t i = 0; i * sizeof(Unsigned) < size; ++i)
+            words[i] = labels_[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq_.load(std::memory_order_relaxed) == seq)
+            break;
+    }
+    cells.push_back(time);
+    if (!time)
+        return;
+    cells.push_back(value);
+    cells.push_back(size);
+    cells.insert(cells.end(), words, words + (size + sizeof(Unsigned) - 1) / sizeof(Unsigned));
+}
+
+Unsigned const* ExemplarSlot::skip(Unsigned const* cells) noexcept
+{
+    return cells[0] ? cells + 3 + (cells[2] + sizeof(Unsigned) - 1) / sizeof(Unsigned) : cells + 1;
+}
+
+ExemplarCursor::ExemplarCursor(ExemplarTable const& t, std::size_t series) noexcept
+    : next_(t.entries.data()), end_(t.entries.data() + t.entries.size()), cells_(t.cells.data())
+{
+    next_ = std::lower_bound(next_, end_, series, [](ExemplarTable::Entry const& e, std::size_t i) {
+        return e.series < i;
+    });
+}
+
+namespace
+{
+
+// Calls f(name, value) for the labels of exemplar cells
+template<class F>
+void exemplar_labels(Unsigned const* cells, F f)
+{
+    char buf[(ExemplarSlot::MAX_LABELS + 32)];
+    auto const size = std::min<std::size_t>(cells[2], sizeof buf);
+    std::memcpy(buf, cells + 3, size);
+    for (std::size_t i = 0; i + 2 <= size;) {
+        std::size_t const k = static_cast<unsigned char>(buf[i]);
+        StringRef const key{buf + i + 1, k};
+        i += 1 + k;
+        std::size_t const v = static_cast<unsigned char>(buf[i]);
+        f(key, StringRef{buf + i + 1, v});
+        i += 1 + v;
+    }
 }
 
-IHistogram::IHistogram(Buckets const& bounds)
+} // namespace
+
+Unsigned const* ExemplarSlot::format(Writer& w, Unsigned const* cells)
 {
-    buckets_.reserve(bounds.size());
-    for (auto le: bounds)
-        buckets_.emplace_back(le, 0);
+    if (!cells[0])
+        return cells + 1;
+    w << " # {";
+    bool first = true;
+    exemplar_labels(cells, [&](StringRef key, StringRef value) {
+        if (!first)
+            w << ',';
+        first = false;
+        w.write(key.data, key.size);
+        w << "=\"";
+        // escaped as OpenMetrics label values are, these come from requests
+        for (std::size_t i = 0; i < value.size; ++i) {
+            auto const c = value.data[i];
+            if (c == '\\' || c == '"')
+                w << '\\' << c;
+            else if (c == '\n')
+                w << "\\n";
+            else
+                w << c;
+        }
+        w << '"';
+    });
+    w << "} " << from_cell<double>(cells[1]) << ' ' << double(cells[0]) / 1000;
+    return skip(cells);
 }
 
+Unsigned const* ExemplarSlot::encode(ProtoWriter& p, unsigned field, Unsigned const* cells)
+{
+    if (!cells[0])
+        return cells + 1;
+    p.begin(field);
+    exemplar_labels(cells, [&](StringRef key, StringRef value) {
+        p.begin(pb::EXEMPLAR_LABEL);
+        p.bytes(pb::LABEL_NAME, key.data, key.size);
+        p.bytes(pb::LABEL_VALUE, value.data, value.size);
+        p.end();
+    });
+    p.real(pb::EXEMPLAR_VALUE, from_cell<double>(cells[1]));
+    p.begin(pb::EXEMPLAR_TIMESTAMP);
+    p.uint(pb::TIMESTAMP_SECONDS, cells[0] / 1000);
+    p.uint(pb::TIMESTAMP_NANOS, cells[0] % 1000 * 1000000);
+    p.end();
+    p.end();
+    return skip(cells);
+}
+
+} // namespace detail
+
 namespace detail
 {
 namespace
@@ -106,6 +442,15 @@ namespace
 std::string const _BUCKET = "_bucket";
 std::string const _SUM = "_sum";
 std::string const _COUNT = "_count";
+std::string const INF = "+Inf";
+std::string const _TOTAL = "_total";
+std::string const NAME_LABEL = "__name__";
+
+bool ends_with(std::string const& s, std::string const& suffix)
+{
+    return s.size() >= suffix.size()
+        && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
 
 bool key_value_i_lt(KeyValueI const& lhs, KeyValueI const& rhs)
 { return lhs.first < rhs.first; }
@@ -115,60 +460,347 @@ bool key_value_i_eq(KeyValueI const& lhs, KeyValueI const& rhs)
 
 } // namespace
 
-Metric::Metric(std::string type, MetricMeta const& mm,
-               std::vector<std::string> const& values)
-    : name_(mm.name_)
-    , type_(std::move(type))
-    , help_(mm.help_)
+Metric::Metric(char const* type, MetricMeta const& mm,
+               std::vector<std::string> const& values, std::string const& extkey)
+    : names_(mm.names_)
+    , type_(type)
 {
-    if (mm.keys_.size() != values.size())
-        throw Error{"Key/value mismatch for metric '" + name_ + "'"};
+    auto const labels = mm.labels(values);
+    prefix_ = name();
+    if (!labels.empty()) {
+        prefix_ += '{';
+        prefix_ += labels;
+        prefix_ += '}';
+    }
+    prefix_ += ' ';
+    labels_size_ = labels.size();
 
-    auto it = mm.keys_.begin();
-    if (it != mm.keys_.end()) {
-        labels_ += it->first;
-        labels_ += "=\"";
-        labels_ += values.at(it->second);
-        labels_ += '"';
-        while (++it != mm.keys_.end()) {
-            labels_ += ',';
-            labels_ += it->first;
-            labels_ += "=\"";
-            labels_ += values.at(it->second);
-            labels_ += '"';
-        }
+    ProtoWriter p;
+    for (auto& kv: mm.keys_) {
+        pb::label_pair(p, kv.first, values[kv.second]);
+        // keys are sorted, so past the last one before
+        if (kv.first < NAME_LABEL)
+            name_at_ = p.data().size();
+        if (kv.first < extkey)
+            extra_at_ = p.data().size();
     }
+    pairs_ = p.data();
+    assert(extkey.empty() || NAME_LABEL < extkey);
 }
 
 Metric::~Metric() = default;
 
-std::ostream& Metric::header(std::ostream& os, std::string const& suffix,
-                             std::string const& extkey) const
+std::string Metric::total_header() const
+{
+    return ends_with(name(), _TOTAL) ? std::string() : header(_TOTAL);
+}
+
+void Metric::encode_value(ProtoWriter& p, unsigned field, double v) const
 {
-    os << name_ << suffix;
-    if (!labels_.empty() && !extkey.empty())
-        os << '{' << labels_ << ',' << extkey;
-    else if (!labels_.empty())
-        os << '{' << labels_ << '}'; // header is ready
-    else if (!extkey.empty())
-        os << '{' << extkey;
-    return os;
+    p.begin(pb::FAMILY_METRIC);
+    label_pairs(p);
+    p.begin(field);
+    p.real(pb::VALUE, v);
+    p.end();
+    p.end();
 }
 
-void MetricImpl<Histogram>::flush(std::ostream& os) const
+void Metric::remote_sample(ProtoWriter& p, long long timestamp, double v,
+                           std::string const& suffix, StringRef extkey, StringRef extvalue) const
 {
-    std::lock_guard<std::mutex> lock{mtx_};
-    for (auto b: buckets_)
-        header(os, _BUCKET, LE) << "=\"" << b.first << "\"} " << b.second << '\n';
-    header(os, _BUCKET, LE) << "=\"+Inf\"} " << count_ << '\n';
-    header(os, _SUM) << ' ' << sum_ << '\n';
-    header(os, _COUNT) << ' ' << count_ << '\n';
+    p.begin(rw::REQUEST_TIMESERIES);
+    p.raw(pairs_.data(), name_at_);
+    p.begin(rw::SERIES_LABELS);
+    p.bytes(rw::LABEL_NAME, NAME_LABEL);
+    p.begin(rw::LABEL_VALUE);
+    p.raw(name());
+    p.raw(suffix);
+    p.end();
+    p.end();
+    if (extvalue.empty())
+        p.raw(pairs_.data() + name_at_, pairs_.size() - name_at_);
+    else {
+        p.raw(pairs_.data() + name_at_, extra_at_ - name_at_);
+        p.begin(rw::SERIES_LABELS);
+        p.bytes(rw::LABEL_NAME, extkey.data, extkey.size);
+        p.bytes(rw::LABEL_VALUE, extvalue.data, extvalue.size);
+        p.end();
+        p.raw(pairs_.data() + extra_at_, pairs_.size() - extra_at_);
+    }
+    p.begin(rw::SERIES_SAMPLES);
+    p.real(rw::SAMPLE_VALUE, v);
+    p.uint(rw::SAMPLE_TIMESTAMP, static_cast<unsigned long long>(timestamp));
+    p.end();
+    p.end();
+}
+
+void pb::label_pair(ProtoWriter& p, std::string const& name, std::string const& value)
+{
+    p.begin(METRIC_LABEL);
+    p.bytes(LABEL_NAME, name);
+    p.bytes(LABEL_VALUE, value);
+    p.end();
+}
+
+std::string Metric::header(std::string const& suffix, std::string const& extkey,
+                           std::string const& extvalue) const
+{
+    auto const l = labels();
+    std::string h = name() + suffix;
+    if (!l.empty() || !extkey.empty()) {
+        h += '{';
+        h.append(l.data, l.size);
+        if (!extkey.empty()) {
+            if (!l.empty())
+                h += ',';
+            h += extkey;
+            h += "=\"";
+            h += extvalue;
+            h += '"';
+        }
+        h += '}';
+    }
+    h += ' ';
+    return h;
+}
+
+MetricImpl<Histogram>::MetricImpl(Histogram const& h, std::vector<std::string> const& values)
+    : Metric("histogram", h, values, LE)
+    , IHistogram(h)
+{
+    for (auto le: bounds_)
+        lines_.add(header(_BUCKET, LE, std::to_string(le)));
+    lines_.add(header(_BUCKET, LE, INF));
+    lines_.add(header(_SUM));
+    lines_.add(header(_COUNT));
+}
+
+MetricImpl<DenseCounter>::MetricImpl(DenseCounter const& c, std::vector<std::string> const& values)
+    : Metric("counter", c, values)
+    , IDenseCounter(c.dimensions())
+{
+    auto const& dims = c.dimensions();
+    std::vector<std::pair<std::string, std::string>> fixed, labels;
+    for (auto& kv: c.keys())
+        fixed.emplace_back(kv.first, values[kv.second]);
+
+    // cells in row-major order, the last dimension changes fastest
+    auto const total = !ends_with(name(), _TOTAL);
+    std::vector<std::size_t> idx(dims.size(), 0);
+    ProtoWriter p;
+    for (std::size_t cell = 0; cell < size_; ++cell) {
+        labels = fixed;
+        for (std::size_t d = 0; d < dims.size(); ++d)
+            labels.emplace_back(dims[d].key, dims[d].values[idx[d]]);
+        std::sort(labels.begin(), labels.end());
+
+        std::string line(1, '{');
+        p.clear();
+        for (std::size_t i = 0; i < labels.size(); ++i) {
+            if (i > 0)
+                line += ',';
+            line += labels[i].first;
+            line += "=\"";
+            line += labels[i].second;
+            line += '"';
+            pb::label_pair(p, labels[i].first, labels[i].second);
+        }
+        line += "} ";
+        lines_.add(name() + line);
+        if (total)
+            totals_.add(name() + _TOTAL + line);
+        pairs_.add(p.data());
+
+        labels.emplace(std::lower_bound(labels.begin(), labels.end(), std::make_pair(NAME_LABEL, name())),
+                       NAME_LABEL, name());
+        p.clear();
+        for (auto& l: labels)
+            pb::label_pair(p, l.first, l.second);
+        remote_pairs_.add(p.data());
+
+        for (std::size_t d = dims.size(); d-- > 0;) {
+            if (++idx[d] < dims[d].values.size())
+                break;
+            idx[d] = 0;
+        }
+    }
+}
+
+void MetricImpl<DenseCounter>::snapshot(std::vector<Unsigned>& cells) const
+{
+    for (std::size_t i = 0; i < size_; ++i)
+        cells.push_back(value(i));
+}
+
+Unsigned const* MetricImpl<DenseCounter>::format(Writer& w, Unsigned const* cells) const
+{
+    for (std::size_t i = 0; i < size_; ++i)
+        lines_.write(w, i) << cells[i] << '\n';
+    return cells + size_;
+}
+
+Unsigned const* MetricImpl<DenseCounter>::format_openmetrics(Writer& w, Unsigned const* cells,
+                                                              Unsigned const*) const
+{
+    if (totals_.empty())
+        return format(w, cells);
+    for (std::size_t i = 0; i < size_; ++i)
+        totals_.write(w, i) << cells[i] << '\n';
+    return cells + size_;
+}
+
+Unsigned const* MetricImpl<DenseCounter>::encode(ProtoWriter& p, Unsigned const* cells,
+                                                  Unsigned const*) const
+{
+    for (std::size_t i = 0; i < size_; ++i) {
+        p.begin(pb::FAMILY_METRIC);
+        pairs_.write(p, i);
+        p.begin(pb::METRIC_COUNTER);
+        p.real(pb::VALUE, double(cells[i]));
+        p.end();
+        p.end();
+    }
+    return cells + size_;
+}
+
+Unsigned const* MetricImpl<DenseCounter>::remote_write(ProtoWriter& p, Unsigned const* cells,
+                                                        long long timestamp) const
+{
+    for (std::size_t i = 0; i < size_; ++i) {
+        p.begin(rw::REQUEST_TIMESERIES);
+        remote_pairs_.write(p, i);
+        p.begin(rw::SERIES_SAMPLES);
+        p.real(rw::SAMPLE_VALUE, double(cells[i]));
+        p.uint(rw::SAMPLE_TIMESTAMP, static_cast<unsigned long long>(timestamp));
+        p.end();
+        p.end();
+    }
+    return cells + size_;
+}
+
+void MetricImpl<Histogram>::snapshot(std::vector<Unsigned>& cells) const
+{
+    for (std::size_t i = 0; i <= bounds_.size(); ++i)
+        cells.push_back(counts_[i].load(MEMORY_ORDER));
+    // A carry lands in sum_hi_ right after the low word wraps, retry if
+    // one came in between. A reader tearing in between the two adds of a
+    // single carry still sees a small dip, which is as rare as the wrap.
+    Unsigned hi, lo;
+    do {
+        hi = sum_hi_.load(MEMORY_ORDER);
+        lo = sum_.load(MEMORY_ORDER);
+    } while (hi != sum_hi_.load(MEMORY_ORDER));
+    cells.push_back(lo);
+    cells.push_back(hi);
+    cells.push_back(to_cell(real_sum_.load(MEMORY_ORDER)));
+}
+
+void MetricImpl<Histogram>::snapshot_exemplars(ExemplarTable& t, std::size_t series) const
+{
+    if (auto const x = exemplars_.load(std::memory_order_acquire)) {
+        auto& cells = t.add(series);
+        for (std::size_t i = 0; i <= bounds_.size(); ++i)
+            x[i].snapshot(cells);
+    }
+}
+
+Unsigned const* MetricImpl<Histogram>::format(Writer& w, Unsigned const* cells) const
+{
+    return format_openmetrics(w, cells, nullptr);
+}
+
+Unsigned const* MetricImpl<Histogram>::format_openmetrics(Writer& w, Unsigned const* cells,
+                                                          Unsigned const* exemplars) const
+{
+    auto const n = bounds_.size();
+    Unsigned count = 0;
+    for (std::size_t i = 0; i <= n; ++i) {
+        count += cells[i];
+        lines_.write(w, i) << count;
+        if (exemplars)
+            exemplars = ExemplarSlot::format(w, exemplars);
+        w << '\n';
+    }
+    auto const lo = cells[n + 1];
+    auto const hi = cells[n + 2];
+    auto const real_sum = from_cell<double>(cells[n + 3]);
+    if (hi == 0 && real_sum == 0)
+        lines_.write(w, n + 1) << lo << '\n';
+    else
+        lines_.write(w, n + 1) << std::ldexp(double(hi), 64) + double(lo) + real_sum << '\n';
+    lines_.write(w, n + 2) << count << '\n';
+    return cells + n + 4;
+}
+
+Unsigned const* MetricImpl<Histogram>::encode(ProtoWriter& p, Unsigned const* cells,
+                                               Unsigned const* exemplars) const
+{
+    auto const n = bounds_.size();
+    Unsigned count = 0;
+    for (std::size_t i = 0; i <= n; ++i)
+        count += cells[i];
+    auto const hi = cells[n + 2];
+    auto const real_sum = from_cell<double>(cells[n + 3]);
+
+    p.begin(pb::FAMILY_METRIC);
+    label_pairs(p);
+    p.begin(pb::METRIC_HISTOGRAM);
+    p.uint(pb::SAMPLE_COUNT, count);
+    p.real(pb::SAMPLE_SUM, std::ldexp(double(hi), 64) + double(cells[n + 1]) + real_sum);
+    count = 0;
+    for (std::size_t i = 0; i <= n; ++i) {
+        count += cells[i];
+        // +Inf bucket is implied by the count, unless it has an exemplar
+        if (i == n && !(exemplars && *exemplars))
+            break;
+        p.begin(pb::HISTOGRAM_BUCKET);
+        p.uint(pb::BUCKET_CUMULATIVE_COUNT, count);
+        p.real(pb::BUCKET_UPPER_BOUND, i < n ? double(bounds_[i]) : HUGE_VAL);
+        if (exemplars)
+            exemplars = ExemplarSlot::encode(p, pb::BUCKET_EXEMPLAR, exemplars);
+        p.end();
+    }
+    p.end();
+    p.end();
+    return cells + n + 4;
+}
+
+Unsigned const* MetricImpl<Histogram>::remote_write(ProtoWriter& p, Unsigned const* cells,
+                                                     long long timestamp) const
+{
+    auto const n = bounds_.size();
+    char le[Writer::NUMBER_SIZE];
+    Unsigned count = 0;
+    for (std::size_t i = 0; i <= n; ++i) {
+        count += cells[i];
+        auto const size = i < n ? Writer::number(le, static_cast<unsigned long long>(bounds_[i])) : 0;
+        remote_sample(p, timestamp, double(count), _BUCKET, LE,
+                      i < n ? StringRef(le, size) : StringRef(INF));
+    }
+    auto const hi = cells[n + 2];
+    auto const real_sum = from_cell<double>(cells[n + 3]);
+    remote_sample(p, timestamp, std::ldexp(double(hi), 64) + double(cells[n + 1]) + real_sum, _SUM);
+    remote_sample(p, timestamp, double(count), _COUNT);
+    return cells + n + 4;
+}
+
+Unsigned const* MetricImpl<Counter>::encode(ProtoWriter& p, Unsigned const* cells,
+                                             Unsigned const* exemplars) const
+{
+    p.begin(pb::FAMILY_METRIC);
+    label_pairs(p);
+    p.begin(pb::METRIC_COUNTER);
+    p.real(pb::VALUE, double(*cells));
+    if (exemplars)
+        ExemplarSlot::encode(p, pb::COUNTER_EXEMPLAR, exemplars);
+    p.end();
+    p.end();
+    return cells + 1;
 }
 
 MetricMeta::MetricMeta(std::string name, std::vector<std::string> keys,
                        std::string help)
-    : name_(std::move(name))
-    , help_(std::move(help))
+    : names_(std::make_shared<Names>(Names{std::move(name), std::move(help)}))
 {
     keys_.reserve(keys.size());
     for (auto& k: keys)
@@ -176,18 +808,750 @@ MetricMeta::MetricMeta(std::string name, std::vector<std::string> keys,
 
     std::sort(keys_.begin(), keys_.end(), &key_value_i_lt);
     if (std::adjacent_find(keys_.begin(), keys_.end(), &key_value_i_eq) != keys_.end())
-        throw Error{"Metric '" + name_ + "' has duplicate label names"};
+        throw Error{"Metric '" + this->name() + "' has duplicate label names"};
+}
+
+std::string MetricMeta::labels(std::vector<std::string> const& values) const
+{
+    if (keys_.size() != values.size())
+        throw Error{"Key/value mismatch for metric '" + name() + "'"};
+
+    std::string labels;
+    auto it = keys_.begin();
+    if (it != keys_.end()) {
+        labels += it->first;
+        labels += "=\"";
+        labels += values.at(it->second);
+        labels += '"';
+        while (++it != keys_.end()) {
+            labels += ',';
+            labels += it->first;
+            labels += "=\"";
+            labels += values.at(it->second);
+            labels += '"';
+        }
+    }
+    return labels;
+}
+
+} // namespace detail
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+// Room for push_back, so it can't throw after the point of no return
+template<class T>
+void reserve_one(std::vector<T>& v)
+{
+    if (v.size() == v.capacity())
+        v.reserve(v.empty() ? 4 : v.size() * 2);
+}
+
+// FNV-1a of values, to tell if they changed
+std::size_t digest(Unsigned const* first, Unsigned const* last) noexcept
+{
+    std::uint64_t h = 14695981039346656037ull;
+    for (; first != last; ++first) {
+        h ^= *first;
+        h *= 1099511628211ull;
+    }
+    return static_cast<std::size_t>(h);
+}
+
+struct LabelsHash
+{
+    std::size_t operator () (detail::StringRef const& labels) const noexcept
+    {
+        return detail::hash_values(&labels, 1);
+    }
+};
+
+//
+// Bump allocator of the series of a family, so they lie next to each
+// other in the order flush reads them. Chunks grow twice up to MAX_CHUNK,
+// starting small as most families have a few series. Freed memory is
+// reused for series of the same size.
+//
+class Arena: detail::NoCopyMove
+{
+    static std::size_t const FIRST_CHUNK = 512;
+    static std::size_t const MAX_CHUNK = 64 << 10;
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char* pos_ = nullptr;
+    char* end_ = nullptr;
+    std::size_t next_ = FIRST_CHUNK;
+    std::unordered_map<std::size_t, std::vector<void*>> free_;
+
+    static std::size_t key(std::size_t size, std::size_t align) noexcept
+    {
+        return size * 64 + align % 64;
+    }
+
+public:
+    void* allocate(std::size_t size, std::size_t align)
+    {
+        auto it = free_.find(key(size, align));
+        if (it != free_.end() && !it->second.empty()) {
+            auto p = it->second.back();
+            it->second.pop_back();
+            return p;
+        }
+        auto aligned = [align](char* p){
+            auto const a = reinterpret_cast<std::uintptr_t>(p);
+            return p + (align - a % align) % align;
+        };
+        if (!pos_ || aligned(pos_) + size > end_) {
+            auto const n = std::max<std::size_t>(next_, size + align);
+            chunks_.emplace_back(new char[n]);
+            pos_ = chunks_.back().get();
+            end_ = pos_ + n;
+            next_ = next_ < MAX_CHUNK / 2 ? next_ * 2 : +MAX_CHUNK;
+        }
+        auto p = aligned(pos_);
+        pos_ = p + size;
+        return p;
+    }
+
+    void deallocate(void* p, std::size_t size, std::size_t align) noexcept
+    {
+        try {
+            free_[key(size, align)].push_back(p);
+        }
+        catch (...) {
+            // leaked until the arena goes
+        }
+    }
+};
+
+} // namespace
+
+struct Collection::Data
+{
+    struct Family
+    {
+        std::vector<detail::Metric*> series_;
+        detail::SeriesOps const* ops_ = nullptr;
+        std::unordered_set<detail::StringRef, LabelsHash> labels_;
+    };
+
+    // ordered by name to merge with the registry
+    using Map = std::map<std::string, Family>;
+
+    Map families_;
+    std::vector<std::unique_ptr<detail::Metric>> owned_;
+};
+
+Collection::Collection()
+{
+    data_ = new Data();
+}
+
+Collection::~Collection()
+{
+    delete data_;
 }
 
+void Collection::push(std::unique_ptr<detail::Metric> m, detail::SeriesOps const* ops)
+{
+    auto& f = data_->families_[m->name()];
+    if (!f.series_.empty() && m->type() != f.series_.front()->type())
+        throw Error{"Metric '" + m->name() + "' type is ambiguous"};
+    data_->owned_.reserve(data_->owned_.size() + 1);
+    reserve_one(f.series_);
+    if (!f.labels_.insert(m->labels()).second)
+        throw Error{"Metric '" + m->name() + "' has duplicate labels"};
+    if (f.series_.empty())
+        f.ops_ = ops;
+    else if (ops != f.ops_)
+        f.ops_ = &detail::SeriesTable<detail::Metric>::ops;
+    f.series_.push_back(m.get());
+    data_->owned_.push_back(std::move(m));
+}
+
+Collector::~Collector() = default;
+
+namespace
+{
+
+class FunctionCollector final: public Collector
+{
+    std::function<void(Collection&)> f_;
+
+public:
+    explicit FunctionCollector(std::function<void(Collection&)> f): f_(std::move(f)) {}
+
+    void collect(Collection& c) override { f_(c); }
+};
+
+} // namespace
+
+namespace detail
+{
+
+// Removal epochs of a registry and the ones pinned, shared with pins
+// that may outlive it
+struct Epochs
+{
+    std::mutex mtx;
+    std::size_t current = 0;
+    std::multiset<std::size_t> pinned;
+
+    std::size_t pin()
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        pinned.insert(current);
+        return current;
+    }
+
+    void unpin(std::size_t epoch) noexcept
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        pinned.erase(pinned.find(epoch));
+    }
+
+    // Epoch of a new removal
+    std::size_t advance() noexcept
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        return ++current;
+    }
+
+    // Removals up to this epoch are held back by no pin
+    std::size_t oldest() noexcept
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        return pinned.empty() ? current : *pinned.begin();
+    }
+};
+
 } // namespace detail
 
 struct Registry::Data
 {
-    using MetricList = std::list<std::unique_ptr<detail::Metric>>;
-    std::map<std::string, MetricList> map_;
+    struct Family: detail::NoCopyMove
+    {
+        struct Series
+        {
+            std::size_t size;
+            std::size_t align;
+            // for expiry, of the values seen on the last snapshot
+            std::size_t digest = 0;
+            bool seen = false;
+            Clock::time_point changed;
+        };
+
+        std::string const* name_; // key in map_
+        std::shared_ptr<detail::Names const> names_;
+        // in order of registration, made in arena_
+        std::vector<detail::Metric*> series_;
+        std::vector<Series> info_; // of series_
+        detail::SeriesOps const* ops_ = nullptr;
+        // keys are labels() of the series
+        std::unordered_map<detail::StringRef, detail::Metric*, LabelsHash> labels_;
+        detail::Metric* overflow_ = nullptr;
+        detail::SeriesOps const* overflow_ops_ = nullptr;
+        std::size_t limit_ = 0;
+        Clock::duration ttl_{};
+        Arena arena_;
+
+        ~Family()
+        {
+            for (auto m: series_)
+                m->~Metric();
+        }
+    };
+
+    // Removed series, still found through a Family handle while epoch is
+    // 0, then by references under pins older than epoch only
+    struct Retired
+    {
+        Family* family;
+        detail::Metric* series;
+        std::size_t size;
+        std::size_t align;
+        std::size_t epoch;
+    };
+
+    std::unordered_map<std::string, std::unique_ptr<Family>> map_;
+    // families ordered by name for output, rebuilt lazily
+    std::vector<Family*> sorted_;
+    bool unsorted_ = false;
+    std::unordered_map<std::string, std::unique_ptr<detail::FamilyBase>> handles_;
+    std::vector<Retired> retired_;
+    std::shared_ptr<detail::Epochs> epochs_ = std::make_shared<detail::Epochs>();
+    std::mutex mtx_;
+    std::vector<detail::LocalBase*> locals_;
+    std::mutex locals_mtx_;
+    RenderCache render_;
+    std::mutex render_mtx_;
+    std::vector<std::unique_ptr<Collector>> collectors_;
+    std::mutex collectors_mtx_;
+
+    ~Data()
+    {
+        for (auto& r: retired_)
+            r.series->~Metric();
+    }
+
+    Family& family(std::string const& name)
+    {
+        auto it = map_.find(name);
+        if (it == map_.end()) {
+            // listed for output on the first series
+            it = map_.emplace(name, std::unique_ptr<Family>(new Family())).first;
+            it->second->name_ = &it->first;
+        }
+        return *it->second;
+    }
+
+    detail::FamilyBase* handle(std::string const& name) const
+    {
+        auto it = handles_.find(name);
+        return it == handles_.end() ? nullptr : it->second.get();
+    }
+
+    // Unregisters the series marked in the family, under mtx_. They are
+    // still to be dropped from the handle, then made unreachable().
+    void retire(Family& f, std::vector<bool> const& marked)
+    {
+        retired_.reserve(retired_.size() + std::count(marked.begin(), marked.end(), true));
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < f.series_.size(); ++i) {
+            auto m = f.series_[i];
+            if (!marked[i]) {
+                f.series_[n] = m;
+                f.info_[n++] = f.info_[i];
+                continue;
+            }
+            f.labels_.erase(m->labels());
+            if (f.overflow_ == m)
+                f.overflow_ = nullptr;
+            retired_.push_back({&f, m, f.info_[i].size, f.info_[i].align, 0});
+        }
+        f.series_.resize(n);
+        f.info_.resize(n);
+        if (f.series_.empty())
+            sorted_.erase(std::find(sorted_.begin(), sorted_.end(), &f));
+    }
+
+    // Starts the epoch of retired series gone from their handles too, so
+    // pins from now on can't reach them, under mtx_. Their memory may
+    // later make another series at the same address.
+    void unreachable(std::vector<detail::Metric const*> const& gone) noexcept
+    {
+        auto const epoch = epochs_->advance();
+        for (auto& r: retired_)
+            if (!r.epoch && std::find(gone.begin(), gone.end(), r.series) != gone.end())
+                r.epoch = epoch;
+    }
+
+    // A local handle publishes into the series
+    bool targeted(Retired const& r) const noexcept
+    {
+        auto const first = reinterpret_cast<char const*>(r.series);
+        std::less<void const*> const lt;
+        for (auto l: locals_) {
+            auto const p = l->target();
+            if ((!lt(p, first) && lt(p, first + r.size)) || r.series->owns(p))
+                return true;
+        }
+        return false;
+    }
+
+    // Returns memory of retired series no pin or local handle holds back
+    // to the arenas, under mtx_
+    void reclaim() noexcept
+    {
+        auto const oldest = epochs_->oldest();
+        std::lock_guard<std::mutex> lock{locals_mtx_};
+        std::size_t n = 0;
+        for (auto& r: retired_) {
+            if (!r.epoch || r.epoch > oldest || targeted(r)) {
+                retired_[n++] = r;
+                continue;
+            }
+            r.series->~Metric();
+            r.family->arena_.deallocate(r.series, r.size, r.align);
+        }
+        retired_.resize(n);
+    }
+};
+
+Registry::Pin::Pin(Registry const& r)
+    : epochs_(r.data_->epochs_)
+    , epoch_(epochs_->pin())
+{
+}
+
+Registry::Pin::~Pin()
+{
+    epochs_->unpin(epoch_);
+}
+
+void Registry::Pin::refresh()
+{
+    auto const epoch = epochs_->pin();
+    epochs_->unpin(epoch_);
+    epoch_ = epoch;
+}
+std::string const Registry::OVERFLOW_VALUE = "__overflow__";
+
+void Snapshot::clear() noexcept
+{
+    families_.clear();
+    series_.clear();
+    cells_.clear();
+    exemplars_.clear();
+    collected_.reset();
+    pin_.reset();
+}
+
+bool Snapshot::operator == (Snapshot const& other) const noexcept
+{
+    // cells are compared as bits, so NaN values are equal too, and series
+    // by address, which removals may reuse, or made anew by collectors
+    // by what they are
+    if (epoch_ != other.epoch_ || cells_ != other.cells_ || !(exemplars_ == other.exemplars_)
+        || series_.size() != other.series_.size() || families_.size() != other.families_.size())
+        return false;
+    std::size_t i = 0;
+    for (std::size_t f = 0; f < families_.size(); ++f) {
+        auto const& lhs = families_[f];
+        auto const& rhs = other.families_[f];
+        if (lhs.end != rhs.end || lhs.collected != rhs.collected)
+            return false;
+        for (; i < lhs.end; ++i)
+            if (series_[i] != other.series_[i]
+                && !(lhs.collected && series_[i]->same_series(*other.series_[i])))
+                return false;
+    }
+    return true;
+}
+
+void Snapshot::write(Writer& w, Format f) const
+{
+    Cursor c;
+    write(w, f, c, std::size_t(-1));
+}
+
+bool Snapshot::write(Writer& w, Format f, Cursor& c, std::size_t limit) const
+{
+    auto const start = w.written();
+    for (; c.family < families_.size(); ++c.family)
+        if (!write_family(w, f, c, start, limit, proto_))
+            return false;
+    if (f == Format::OpenMetrics && !c.done)
+        w << "# EOF\n";
+    c.done = true;
+    return true;
+}
+
+void Snapshot::remote_write(ProtoWriter& p, long long timestamp) const
+{
+    std::size_t series = 0, cell = 0;
+    for (auto& family: families_) {
+        family.ops->remote_write(p, series_.data() + series, series_.data() + family.end,
+                                 cells_.data() + cell, timestamp);
+        series = family.end;
+        cell = family.cells_end;
+    }
+}
+
+bool Snapshot::write_family(Writer& w, Format f, Cursor& c,
+                            std::size_t start, std::size_t limit, ProtoWriter& proto) const
+{
+    // at least one step per call, so it always advances
+    auto const full = [&]{ return w.written() - start >= limit && w.written() > start; };
+    auto const openmetrics = f == Format::OpenMetrics;
+    auto& family = families_[c.family];
+    auto const& type = family.first->type();
+    auto const& name = family.first->name();
+
+    if (f == Format::Protobuf) {
+        if (full())
+            return false;
+        proto.clear();
+        proto.bytes(detail::pb::FAMILY_NAME, name);
+        if (!family.first->help().empty())
+            proto.bytes(detail::pb::FAMILY_HELP, family.first->help());
+        proto.uint(detail::pb::FAMILY_TYPE,
+            type == "counter" ? detail::pb::TYPE_COUNTER :
+            type == "gauge" ? detail::pb::TYPE_GAUGE :
+            type == "summary" ? detail::pb::TYPE_SUMMARY : detail::pb::TYPE_HISTOGRAM);
+        detail::ExemplarCursor x{exemplars_, c.series};
+        auto const cell = family.ops->encode(proto, series_.data(), c.series, family.end,
+                                             cells_.data() + c.cell, x);
+        c.series = family.end;
+        c.cell = cell - cells_.data();
+
+        // length delimited
+        auto const& data = proto.data();
+        char len[ProtoWriter::VARINT_SIZE];
+        w.write(len, ProtoWriter::varint(len, data.size()));
+        w.write(data.data(), data.size());
+        return true;
+    }
+
+    if (!c.header) {
+        if (full())
+            return false;
+        // write header from the first metric in the group
+        auto size = name.size();
+        // OpenMetrics counter families are named without _total
+        if (openmetrics && type == "counter" && detail::ends_with(name, detail::_TOTAL))
+            size -= detail::_TOTAL.size();
+        w << "# HELP ";
+        w.write(name.data(), size);
+        w << ' ' << family.first->help() << '\n';
+        w << "# TYPE ";
+        w.write(name.data(), size);
+        w << ' ' << type << '\n';
+        c.header = true;
+    }
+    // full() in the loop, at least one series if nothing is written yet
+    auto stop = start + std::min(limit, std::size_t(-1) - start);
+    if (w.written() == start)
+        stop = std::max(stop, start + 1);
+    detail::ExemplarCursor x{exemplars_, c.series};
+    auto const cell = family.ops->format(w, openmetrics, series_.data(), c.series, family.end,
+                                         cells_.data() + c.cell, x, stop);
+    c.cell = cell - cells_.data();
+    if (c.series < family.end)
+        return false;
+    c.header = false;
+    return true;
+}
+
+namespace
+{
+
+//
+// Threads running parts of parallel writes without an Executor, one fewer
+// than the hardware threads, started on first use. The calling thread
+// runs the first part, then takes parts no worker took yet, so a batch
+// finishes even with every worker busy or none started.
+//
+class WorkerPool: detail::NoCopyMove
+{
+    struct Batch
+    {
+        std::vector<std::function<void()>> const& tasks;
+        std::size_t next;  // first task not taken
+        std::size_t left;  // tasks taken by workers, not done yet
+        std::condition_variable done;
+    };
+
     std::mutex mtx_;
+    std::condition_variable ready_;
+    std::deque<Batch*> batches_; // with tasks not taken
+    std::vector<std::thread> threads_;
+    bool stop_ = false;
+
+    WorkerPool()
+    {
+        auto const hc = std::thread::hardware_concurrency();
+        try {
+            for (unsigned i = 1; i < hc && i < 64; ++i)
+                threads_.emplace_back([this]{ work(); });
+        }
+        catch (std::system_error const&) {
+            // with the threads started so far
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock{mtx_};
+            stop_ = true;
+        }
+        ready_.notify_all();
+        for (auto& t: threads_)
+            t.join();
+    }
+
+    // Index of a task of the batch to run, under mtx_
+    std::size_t take(Batch& b)
+    {
+        auto const i = b.next++;
+        if (b.next == b.tasks.size())
+            batches_.erase(std::find(batches_.begin(), batches_.end(), &b));
+        return i;
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock{mtx_};
+        for (;;) {
+            ready_.wait(lock, [this]{ return stop_ || !batches_.empty(); });
+            if (stop_)
+                return;
+            auto& b = *batches_.front();
+            auto const i = take(b);
+            ++b.left;
+            lock.unlock();
+            b.tasks[i]();
+            lock.lock();
+            if (--b.left == 0)
+                b.done.notify_all();
+        }
+    }
+
+public:
+    static WorkerPool& instance()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+
+    // Tasks must not throw
+    void run(std::vector<std::function<void()>> const& tasks)
+    {
+        if (tasks.empty())
+            return;
+        Batch b{tasks, 1, 0, {}};
+        std::unique_lock<std::mutex> lock{mtx_};
+        if (tasks.size() > 1 && !threads_.empty()) {
+            batches_.push_back(&b);
+            ready_.notify_all();
+        }
+        lock.unlock();
+        tasks.front()();
+        lock.lock();
+        while (b.next < tasks.size()) {
+            auto const i = threads_.empty() ? b.next++ : take(b);
+            lock.unlock();
+            tasks[i]();
+            lock.lock();
+        }
+        b.done.wait(lock, [&b]{ return b.left == 0; });
+    }
 };
 
+} // namespace
+
+void Snapshot::write(Sink& sink, Format f, std::size_t parts, Executor const& run) const
+{
+    // first family of each part, then the end
+    std::vector<std::size_t> bounds{0};
+    if (parts > 1) {
+        auto const per_part = cells_.size() / parts + 1;
+        for (std::size_t i = 0; i + 1 < families_.size(); ++i)
+            if (families_[i].cells_end >= bounds.size() * per_part)
+                bounds.push_back(i + 1);
+    }
+    bounds.push_back(families_.size());
+
+    std::vector<std::string> out(bounds.size() - 1);
+    std::vector<std::exception_ptr> errors(out.size());
+    std::vector<std::function<void()>> tasks;
+    for (std::size_t i = 0; i < out.size(); ++i)
+        tasks.emplace_back([this, f, i, &bounds, &out, &errors]{
+            try {
+                StringSink s{out[i]};
+                Writer w{s};
+                ProtoWriter proto;
+                Cursor c;
+                c.family = bounds[i];
+                if (c.family) {
+                    c.series = families_[c.family - 1].end;
+                    c.cell = families_[c.family - 1].cells_end;
+                }
+                for (; c.family < bounds[i + 1]; ++c.family)
+                    write_family(w, f, c, 0, std::size_t(-1), proto);
+                w.flush();
+            }
+            catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+
+    if (run)
+        run(tasks);
+    else
+        WorkerPool::instance().run(tasks);
+    for (auto& e: errors)
+        if (e)
+            std::rethrow_exception(e);
+
+    for (auto& o: out)
+        sink.write(o.data(), o.size());
+    if (f == Format::OpenMetrics)
+        sink.write("# EOF\n", 6);
+}
+
+void RenderCache::exemplars(Snapshot const& s, std::size_t family, std::vector<Unsigned>& out)
+{
+    out.clear();
+    auto const& t = s.exemplars_;
+    auto const first = family ? s.families_[family - 1].end : 0;
+    auto const begin = family ? s.families_[family - 1].exemplars_end : 0;
+    auto const end = s.families_[family].exemplars_end;
+    for (auto i = begin; i < end; ++i) {
+        auto const cell = t.entries[i].cell;
+        auto const next = i + 1 < t.entries.size() ? t.entries[i + 1].cell : t.cells.size();
+        out.push_back(t.entries[i].series - first);
+        out.push_back(next - cell);
+        out.insert(out.end(), t.cells.begin() + cell, t.cells.begin() + next);
+    }
+}
+
+void RenderCache::write(Snapshot const& s, Writer& w, Format f)
+{
+    // after removals new series may have the addresses of old ones
+    if (f != format_ || s.epoch_ != epoch_) {
+        entries_.clear();
+        format_ = f;
+        epoch_ = s.epoch_;
+    }
+    ++generation_;
+
+    Snapshot::Cursor c;
+    for (; c.family < s.families_.size(); ++c.family) {
+        auto const& family = s.families_[c.family];
+        // new objects every time
+        if (family.collected) {
+            s.write_family(w, f, c, 0, std::size_t(-1), s.proto_);
+            continue;
+        }
+        auto const series = s.series_.begin() + c.series;
+        auto const cells = s.cells_.begin() + c.cell;
+        auto& e = entries_[family.first];
+        e.generation = generation_;
+
+        exemplars(s, c.family, scratch_);
+
+        if (e.series.size() != family.end - c.series || e.cells.size() != family.cells_end - c.cell
+            || !std::equal(e.cells.begin(), e.cells.end(), cells)
+            || !std::equal(e.series.begin(), e.series.end(), series)
+            || e.exemplars != scratch_) {
+            e.series.assign(series, s.series_.begin() + family.end);
+            e.cells.assign(cells, s.cells_.begin() + family.cells_end);
+            e.exemplars.swap(scratch_);
+            e.out.clear();
+            StringSink sink{e.out};
+            Writer fw{sink};
+            s.write_family(fw, f, c, 0, std::size_t(-1), s.proto_);
+            fw.flush();
+        }
+        w << e.out;
+        c.series = family.end;
+        c.cell = family.cells_end;
+    }
+    if (f == Format::OpenMetrics)
+        w << "# EOF\n";
+
+    // families gone from the registry
+    for (auto it = entries_.begin(); it != entries_.end();)
+        if (it->second.generation != generation_)
+            it = entries_.erase(it);
+        else
+            ++it;
+}
+
 Registry& Registry::global()
 {
     static Registry r;
@@ -204,36 +1568,327 @@ Registry::~Registry()
     delete data_;
 }
 
-void Registry::push(detail::Metric *ptr)
+void* Registry::allocate(std::string const& name, std::size_t size, std::size_t align)
 {
-    std::unique_ptr<detail::Metric> m{ptr};
-    std::lock_guard<std::mutex > lock{data_->mtx_};
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    return data_->family(name).arena_.allocate(size, align);
+}
 
-    auto r = data_->map_.emplace(m->name(), Data::MetricList());
-    auto& list = r.first->second;
-    if (!list.empty()) {
-        if (m->type() != list.front()->type())
+void Registry::deallocate(std::string const& name, void* p, std::size_t size, std::size_t align) noexcept
+{
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    data_->map_.at(name)->arena_.deallocate(p, size, align);
+}
+
+detail::Metric* Registry::push(detail::Metric *m, detail::SeriesOps const* ops,
+                               std::size_t size, std::size_t align, bool overflow)
+{
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    auto& f = *data_->map_.at(m->name());
+    auto const drop = [&]{
+        m->~Metric();
+        f.arena_.deallocate(m, size, align);
+    };
+    try {
+        if (f.series_.empty())
+            reserve_one(data_->sorted_);
+        else if (m->type() != f.series_.front()->type())
             throw Error{"Metric '" + m->name() + "' type is ambiguous"};
-        for (auto const& v: list)
-            if (m->labels() == v->labels())
-                throw Error{"Metric '" + m->name() + "' has duplicate labels"};
+        // one copy of the family strings
+        else if (*m->names_ == *f.names_)
+            m->names_ = f.names_;
+
+        auto const existing = f.labels_.find(m->labels());
+        if (existing != f.labels_.end() && !(overflow && existing->second == f.overflow_))
+            throw Error{"Metric '" + m->name() + "' has duplicate labels"};
+        if (overflow || (f.limit_ && existing == f.labels_.end()
+                         && f.series_.size() - (f.overflow_ ? 1 : 0) >= f.limit_)) {
+            if (f.overflow_ && ops != f.overflow_ops_)
+                throw Error{"Metric '" + m->name() + "' type is ambiguous"};
+            if (f.overflow_ || !overflow) {
+                drop();
+                return f.overflow_;
+            }
+        }
+        reserve_one(f.series_);
+        reserve_one(f.info_);
+        f.labels_.emplace(m->labels(), m);
     }
-    list.push_back(std::move(m));
+    catch (...) {
+        drop();
+        throw;
+    }
+    if (f.series_.empty()) {
+        f.names_ = m->names_;
+        f.ops_ = ops;
+        data_->sorted_.push_back(&f);
+        data_->unsorted_ = true;
+    }
+    else if (ops != f.ops_)
+        f.ops_ = &detail::SeriesTable<detail::Metric>::ops;
+    f.series_.push_back(m);
+    Data::Family::Series info;
+    info.size = size;
+    info.align = align;
+    info.changed = Clock::now();
+    f.info_.push_back(info);
+    if (overflow) {
+        f.overflow_ = m;
+        f.overflow_ops_ = ops;
+    }
+    return m;
 }
 
-void Registry::flush(std::ostream& os) const
+bool Registry::remove(detail::MetricMeta const& desc, std::vector<std::string> const& values)
 {
+    auto const labels = desc.labels(values);
+    detail::Metric const* m;
+    detail::FamilyBase* handle;
+    {
+        std::lock_guard<std::mutex> lock{data_->mtx_};
+        auto f = data_->map_.find(desc.name());
+        if (f == data_->map_.end())
+            return false;
+        auto& family = *f->second;
+        auto it = family.labels_.find(labels);
+        if (it == family.labels_.end())
+            return false;
+        m = it->second;
+        std::vector<bool> marked(family.series_.size());
+        marked[std::find(family.series_.begin(), family.series_.end(), m) - family.series_.begin()] = true;
+        data_->retire(family, marked);
+        handle = data_->handle(desc.name());
+    }
+    // lookups take the handle lock first, then the registry one
+    if (handle)
+        handle->forget(m);
     std::lock_guard<std::mutex> lock{data_->mtx_};
+    data_->unreachable({m});
+    data_->reclaim();
+    return true;
+}
 
-    for (auto& kv: data_->map_) {
-        auto& list = kv.second;
-        // write header from the first metric in the group
-        auto& m = list.front();
-        os << "# HELP " << m->name() << ' ' << m->help() << '\n';
-        os << "# TYPE " << m->name() << ' ' << m->type() << '\n';
-        for (auto& m: list)
-            m->flush(os);
+void Registry::expire(std::string const& name, std::chrono::seconds ttl)
+{
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    data_->family(name).ttl_ = ttl;
+}
+
+void Registry::limit(std::string const& name, std::size_t max)
+{
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    data_->family(name).limit_ = max;
+}
+
+detail::FamilyBase& Registry::push_family(std::string const& name,
+                                          std::unique_ptr<detail::FamilyBase> f)
+{
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    auto& h = data_->handles_[name];
+    if (!h)
+        h = std::move(f);
+    return *h;
+}
+
+detail::FamilyBase* Registry::find_family(std::string const& name) const
+{
+    std::lock_guard<std::mutex> lock{data_->mtx_};
+    return data_->handle(name);
+}
+
+void Registry::attach(detail::LocalBase *l)
+{
+    std::lock_guard<std::mutex> lock{data_->locals_mtx_};
+    data_->locals_.push_back(l);
+}
+
+void Registry::detach(detail::LocalBase *l) noexcept
+{
+    std::lock_guard<std::mutex> lock{data_->locals_mtx_};
+    auto& v = data_->locals_;
+    auto it = std::find(v.begin(), v.end(), l);
+    if (it != v.end()) {
+        *it = v.back();
+        v.pop_back();
+    }
+}
+
+void Registry::snapshot(Snapshot& s) const
+{
+    {
+        // pending updates of local handles go first
+        std::lock_guard<std::mutex> lock{data_->locals_mtx_};
+        for (auto l: data_->locals_) {
+            std::lock_guard<std::mutex> lock{l->mtx_};
+            l->publish();
+        }
+    }
+
+    s.clear();
+    std::shared_ptr<Collection> collected;
+    {
+        std::lock_guard<std::mutex> lock{data_->collectors_mtx_};
+        if (!data_->collectors_.empty()) {
+            collected = std::make_shared<Collection>();
+            for (auto& c: data_->collectors_)
+                c->collect(*collected);
+        }
+    }
+    Collection::Data::Map empty;
+    auto& from = collected ? collected->data_->families_ : empty;
+    auto next = from.begin();
+    // collected families ordered before name, or all
+    auto const add_collected = [&](std::string const* name){
+        for (; next != from.end() && (!name || next->first <= *name); ++next) {
+            auto const& cf = next->second;
+            if (cf.series_.empty() || (name && next->first == *name))
+                continue;
+            auto const first = cf.series_.data();
+            auto const last = first + cf.series_.size();
+            auto const index = s.series_.size();
+            s.series_.insert(s.series_.end(), first, last);
+            cf.ops_->snapshot(first, last, s.cells_, s.exemplars_, index);
+            s.families_.push_back({cf.series_.front(), cf.ops_, s.series_.size(), s.cells_.size(),
+                                   s.exemplars_.entries.size(), true});
+        }
+    };
+
+    // expired series to drop from handles after the registry lock
+    std::vector<std::pair<detail::FamilyBase*, detail::Metric const*>> expired;
+    std::vector<detail::Metric const*> gone;
+    {
+        std::lock_guard<std::mutex> lock{data_->mtx_};
+        if (data_->unsorted_) {
+            std::sort(data_->sorted_.begin(), data_->sorted_.end(),
+                [](Data::Family const* lhs, Data::Family const* rhs){
+                    return *lhs->name_ < *rhs->name_;
+                });
+            data_->unsorted_ = false;
+        }
+        std::vector<std::pair<Data::Family*, std::vector<bool>>> expiring;
+        auto const now = Clock::now();
+        for (auto f: data_->sorted_) {
+            add_collected(f->name_);
+            auto const first = f->series_.data();
+            auto const last = first + f->series_.size();
+            if (f->ttl_ == Clock::duration::zero()) {
+                auto const index = s.series_.size();
+                s.series_.insert(s.series_.end(), first, last);
+                f->ops_->snapshot(first, last, s.cells_, s.exemplars_, index);
+                s.families_.push_back({f->series_.front(), f->ops_, s.series_.size(), s.cells_.size(),
+                                       s.exemplars_.entries.size(), false});
+                continue;
+            }
+            // series by series to tell which ones changed, by their values
+            auto const start = s.series_.size();
+            std::vector<bool> marked(f->series_.size());
+            for (std::size_t i = 0; i < f->series_.size(); ++i) {
+                auto const cell = s.cells_.size();
+                auto const entry = s.exemplars_.entries.size();
+                auto const exemplar_cell = s.exemplars_.cells.size();
+                f->ops_->snapshot(first + i, first + i + 1, s.cells_, s.exemplars_, s.series_.size());
+                auto const d = digest(s.cells_.data() + cell, s.cells_.data() + s.cells_.size());
+                auto& info = f->info_[i];
+                if (info.seen && d != info.digest)
+                    info.changed = now;
+                info.digest = d;
+                info.seen = true;
+                if (now - info.changed < f->ttl_)
+                    s.series_.push_back(first[i]);
+                else {
+                    s.cells_.resize(cell);
+                    s.exemplars_.entries.resize(entry);
+                    s.exemplars_.cells.resize(exemplar_cell);
+                    marked[i] = true;
+                }
+            }
+            if (s.series_.size() != start)
+                s.families_.push_back({s.series_[start], f->ops_, s.series_.size(), s.cells_.size(),
+                                       s.exemplars_.entries.size(), false});
+            if (s.series_.size() - start != f->series_.size())
+                expiring.emplace_back(f, std::move(marked));
+        }
+        add_collected(nullptr);
+        for (auto& e: expiring) {
+            auto& f = *e.first;
+            auto const handle = data_->handle(*f.name_);
+            for (std::size_t i = 0; i < f.series_.size(); ++i)
+                if (e.second[i]) {
+                    gone.push_back(f.series_[i]);
+                    if (handle)
+                        expired.emplace_back(handle, f.series_[i]);
+                }
+            data_->retire(f, e.second);
+        }
+        data_->reclaim();
+        // holds back the series listed from now on
+        std::shared_ptr<Pin> pin{new Pin(*this)};
+        s.epoch_ = pin->epoch_;
+        s.pin_ = std::move(pin);
     }
+    s.collected_ = std::move(collected);
+    for (auto& e: expired)
+        e.first->forget(e.second);
+    if (!gone.empty()) {
+        std::lock_guard<std::mutex> lock{data_->mtx_};
+        data_->unreachable(gone);
+        data_->reclaim();
+    }
+}
+
+void Registry::flush(Sink& sink, Format f) const
+{
+    Snapshot s;
+    snapshot(s);
+    Writer w{sink};
+    // concurrent flushes format everything rather than wait
+    std::unique_lock<std::mutex> lock{data_->render_mtx_, std::try_to_lock};
+    if (lock)
+        data_->render_.write(s, w, f);
+    else
+        s.write(w, f);
+    w.flush();
+}
+
+Collector& Registry::add_collector(std::unique_ptr<Collector> c)
+{
+    std::lock_guard<std::mutex> lock{data_->collectors_mtx_};
+    data_->collectors_.push_back(std::move(c));
+    return *data_->collectors_.back();
+}
+
+Collector& Registry::add_collector(std::function<void(Collection&)> collect)
+{
+    return add_collector(std::unique_ptr<Collector>(new FunctionCollector(std::move(collect))));
+}
+
+void Registry::remove_collector(Collector& c)
+{
+    std::unique_ptr<Collector> removed;
+    {
+        std::lock_guard<std::mutex> lock{data_->collectors_mtx_};
+        auto& v = data_->collectors_;
+        for (auto it = v.begin(); it != v.end(); ++it)
+            if (it->get() == &c) {
+                removed = std::move(*it);
+                v.erase(it);
+                break;
+            }
+    }
+}
+
+void Registry::flush(Sink& sink, Format f, std::size_t parts,
+                     Snapshot::Executor const& run) const
+{
+    Snapshot s;
+    snapshot(s);
+    s.write(sink, f, parts, run);
+}
+
+void Registry::flush(std::ostream& os, Format f) const
+{
+    OstreamSink sink{os};
+    flush(sink, f);
 }
 
 } // namespace promxx
\ No newline at end of file
@@ -1,11 +1,58 @@
+#include <cmath>
+#include <cstdlib>
+#include <limits>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <cassert>
 
+#include <promxx/family.hpp>
+#include <promxx/local.hpp>
+#include <promxx/native_histogram.hpp>
+#include <promxx/summary.hpp>
 #include <promxx/registry.hpp>
 
 using namespace promxx;
 
+namespace
+{
+
+PROMXX_LABEL(Method, "method");
+PROMXX_LABEL(Code, "code");
+
+// Registers a metric from inside the output, like a concurrent add would
+class RegisteringSink final: public Sink
+{
+    Registry& r_;
+    std::string& s_;
+
+public:
+    RegisteringSink(Registry& r, std::string& s): r_(r), s_(s) {}
+
+    void write(char const* data, std::size_t size) override
+    {
+        r_.add(Counter("late"));
+        s_.append(data, size);
+    }
+};
+
+double value_of(std::string const& out, std::string const& line)
+{
+    auto pos = out.find(line);
+    assert(pos != std::string::npos);
+    return std::strtod(out.c_str() + pos + line.size(), nullptr);
+}
+
+std::string unhex(char const* hex)
+{
+    std::string s;
+    for (; hex[0] && hex[1]; hex += 2)
+        s += char(std::stoi(std::string(hex, 2), nullptr, 16));
+    return s;
+}
+
+} // namespace
+
 #define ASSERT_THROW(EXPR, WHAT) try { \
     (EXPR); \
     int has_exception = 0; \
@@ -153,4 +200,975 @@ int main()
     std::stringstream ss;
     Registry::global().flush(ss);
     assert(ss.str() == expected_metrics);
+
+    std::string out;
+    StringSink sink{out};
+    Registry::global().flush(sink);
+    assert(out == expected_metrics);
+
+    {
+        Registry r;
+        auto& h = r.add(Histogram("h", Buckets{1, 2}));
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back([&h]{
+                for (Unsigned i = 0; i < 10000; ++i)
+                    h.observe(i % 3 + 1);
+            });
+        for (auto& t: threads)
+            t.join();
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP h \n"
+            "# TYPE h histogram\n"
+            "h_bucket{le=\"1\"} 13336\n"
+            "h_bucket{le=\"2\"} 26668\n"
+            "h_bucket{le=\"+Inf\"} 40000\n"
+            "h_sum 79996\n"
+            "h_count 40000\n");
+    }
+
+    {
+        Registry r;
+        auto& c = r.add(ShardedCounter("sc", "Sharded counter", {"l"}), {"v"});
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t)
+            threads.emplace_back([&c]{
+                for (int i = 0; i < 10000; ++i)
+                    c.inc();
+            });
+        for (auto& t: threads)
+            t.join();
+        c.inc(5);
+
+        ASSERT_THROW(r.add(Counter("sc", "", {"l"}), {"v"}), "Metric 'sc' has duplicate labels")
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP sc Sharded counter\n"
+            "# TYPE sc counter\n"
+            "sc{l=\"v\"} 80005\n");
+    }
+
+    {
+        Registry r;
+        auto& c = r.add(Counter("lc"));
+        auto& g = r.add(Gauge<int>("lg"));
+        auto& h = r.add(Histogram("lh", Buckets{10}));
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back([&]{
+                LocalCounter lc(c, 100, r);
+                LocalHistogram lh(h, 100, r);
+                for (int i = 0; i < 1001; ++i) {
+                    lc.inc();
+                    lh.observe(i % 20);
+                }
+                lc.commit();
+            });
+        for (auto& t: threads)
+            t.join();
+
+        // never committed explicitly, published by the flush
+        LocalCounter lc(c, 1000000, r);
+        LocalGauge<int> lg(g, 1000000, r);
+        lc.inc(3);
+        lg.set(10);
+        lg.inc(5);
+        lg.dec(2);
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP lc \n"
+            "# TYPE lc counter\n"
+            "lc 4007\n"
+            "# HELP lg \n"
+            "# TYPE lg gauge\n"
+            "lg 13\n"
+            "# HELP lh \n"
+            "# TYPE lh histogram\n"
+            "lh_bucket{le=\"10\"} 2204\n"
+            "lh_bucket{le=\"+Inf\"} 4004\n"
+            "lh_sum 38000\n"
+            "lh_count 4004\n");
+
+        // a second scrape doesn't publish the same updates again
+        std::stringstream ss2;
+        r.flush(ss2);
+        assert(ss2.str() == ss.str());
+    }
+
+    {
+        Registry r;
+        auto& c = r.add(Counter("c"));
+        c.inc(2);
+
+        Snapshot snap;
+        r.snapshot(snap);
+        c.inc(5);
+
+        std::string out;
+        RegisteringSink sink{r, out};
+        Writer w{sink};
+        snap.write(w);
+        w.flush();
+        assert(out ==
+            "# HELP c \n"
+            "# TYPE c counter\n"
+            "c 2\n");
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP c \n"
+            "# TYPE c counter\n"
+            "c 7\n"
+            "# HELP late \n"
+            "# TYPE late counter\n"
+            "late 0\n");
+    }
+
+    {
+        Registry r;
+        Counter b("b", "", {"id"});
+        for (int i = 0; i < 50000; ++i)
+            r.add(b, {std::to_string(i)});
+        ASSERT_THROW(r.add(b, {"49999"}), "Metric 'b' has duplicate labels")
+        r.add(Counter("a"));
+
+        std::stringstream ss;
+        r.flush(ss);
+        auto out = ss.str();
+        // families sorted by name, series in registration order
+        assert(out.find("# HELP a \n# TYPE a counter\na 0\n# HELP b \n") == 0);
+        assert(out.find("b{id=\"0\"} 0\nb{id=\"1\"} 0\n") != std::string::npos);
+        assert(out.find("b{id=\"49999\"} 0\n") == out.size() - 16);
+    }
+
+    {
+        Registry r;
+        auto& f = r.family(Counter("requests", "Requests", {"method","code"}));
+        assert(&r.family(Counter("requests", "Requests", {"method","code"})) == &f);
+        ASSERT_THROW(r.family(Gauge<int>("requests")), "Metric 'requests' type is ambiguous")
+        ASSERT_THROW(r.family(Counter("requests")), "Metric 'requests' differs from the registered family")
+        ASSERT_THROW(r.family(Counter("requests", "Requests", {"code","method"})),
+                     "Metric 'requests' differs from the registered family")
+
+        std::string const get = "GET";
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t)
+            threads.emplace_back([&f, &get]{
+                for (int i = 0; i < 1000; ++i) {
+                    f.labels(get, "200").inc();
+                    f.labels("POST", i % 2 ? "200" : "500").inc();
+                }
+            });
+        for (auto& t: threads)
+            t.join();
+        assert(&f.labels("GET", "200") == &f.labels(std::vector<std::string>{"GET","200"}));
+
+        ASSERT_THROW(f.labels("GET"), "Key/value mismatch for metric 'requests'")
+
+        std::stringstream ss;
+        r.flush(ss);
+        auto out = ss.str();
+        assert(out.find("requests{code=\"200\",method=\"GET\"} 4000\n") != std::string::npos);
+        assert(out.find("requests{code=\"200\",method=\"POST\"} 2000\n") != std::string::npos);
+        assert(out.find("requests{code=\"500\",method=\"POST\"} 2000\n") != std::string::npos);
+    }
+
+    {
+        Registry r;
+        auto& f = r.family<Method, Code>(Histogram("latency", Buckets{10}, "Latency"));
+        f.labels("GET", "200").observe(5);
+        f.labels("GET", "200").observe(50);
+        assert((&r.family<Method, Code>(Histogram("latency", Buckets{10}, "Latency")) == &f));
+        ASSERT_THROW((r.family<Method, Code>(Histogram("latency", Buckets{20}, "Latency"))),
+                     "Metric 'latency' differs from the registered family")
+        ASSERT_THROW(r.family<Method>(Histogram("latency", Buckets{10})), "Metric 'latency' type is ambiguous")
+        ASSERT_THROW(r.family<Method>(Counter("c", "", {"method"})), "Metric 'c' label names are set by its schema")
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP latency Latency\n"
+            "# TYPE latency histogram\n"
+            "latency_bucket{code=\"200\",method=\"GET\",le=\"10\"} 1\n"
+            "latency_bucket{code=\"200\",method=\"GET\",le=\"+Inf\"} 2\n"
+            "latency_sum{code=\"200\",method=\"GET\"} 55\n"
+            "latency_count{code=\"200\",method=\"GET\"} 2\n");
+    }
+
+    // families of every descriptor type, with and without a schema, and
+    // the same name with other type specific parts
+    {
+        Registry r;
+        r.family(Counter("c", "", {"k"})).labels("1").inc();
+        r.family(RealCounter("rc", "", {"k"})).labels("1").inc(0.5);
+        r.family(ShardedCounter("sc", "", {"k"})).labels("1").inc();
+        r.family(Gauge<int>("g", "", {"k"})).labels("1").set(-2);
+        r.family(Histogram("h", Buckets{1}, "", {"k"})).labels("1").observe(Unsigned(1));
+        r.family(Summary("s", Quantiles{0.5}, "", {"k"})).labels("1").observe(2);
+        r.family(NativeHistogram("n", 3, "", {"k"})).labels("1").observe(2);
+        std::vector<Dimension> const dims{{"code", {"ok", "err"}}};
+        r.family(DenseCounter("d", dims, "", {"k"})).labels("1").at(1).inc();
+
+        r.family<Method>(Summary("ts", Quantiles{0.5, 0.9}, "", {}, std::chrono::seconds(60), 3, 0.02))
+            .labels("GET").observe(1);
+        r.family<Method>(NativeHistogram("tn", 2)).labels("GET").observe(1);
+        r.family<Method>(DenseCounter("td", dims)).labels("GET").at(0).inc();
+        r.family<Method>(Gauge<double>("tg")).labels("GET").set(1.5);
+        auto const& ts = r.family<Method>(Summary("ts", Quantiles{0.5, 0.9}, "", {},
+                                                  std::chrono::seconds(60), 3, 0.02)).descriptor();
+        assert(ts.keys().size() == 1 && ts.max_age() == std::chrono::seconds(60)
+               && ts.age_buckets() == 3 && ts.accuracy() == 0.02);
+
+        ASSERT_THROW(r.family(Summary("s", Quantiles{0.9}, "", {"k"})),
+                     "Metric 's' differs from the registered family")
+        ASSERT_THROW(r.family(Summary("s", Quantiles{0.5}, "", {"k"}, std::chrono::seconds(60))),
+                     "Metric 's' differs from the registered family")
+        ASSERT_THROW(r.family(NativeHistogram("n", 4, "", {"k"})),
+                     "Metric 'n' differs from the registered family")
+        ASSERT_THROW(r.family(DenseCounter("d", {{"code", {"ok"}}}, "", {"k"})),
+                     "Metric 'd' differs from the registered family")
+        ASSERT_THROW(r.family(DenseCounter("d", {{"status", {"ok", "err"}}}, "", {"k"})),
+                     "Metric 'd' differs from the registered family")
+        ASSERT_THROW(r.family<Method>(NativeHistogram("tn", 3)),
+                     "Metric 'tn' differs from the registered family")
+        ASSERT_THROW(r.family<Method>(DenseCounter("td", {{"code", {"err", "ok"}}})),
+                     "Metric 'td' differs from the registered family")
+        ASSERT_THROW(r.family(Gauge<int>("g", "Other", {"k"})),
+                     "Metric 'g' differs from the registered family")
+
+        std::stringstream ss;
+        r.flush(ss);
+        auto const out = ss.str();
+        for (auto line: {"c{k=\"1\"} 1\n", "rc{k=\"1\"} 0.5\n", "sc{k=\"1\"} 1\n", "g{k=\"1\"} -2\n",
+                         "h_count{k=\"1\"} 1\n", "s_count{k=\"1\"} 1\n", "n_count{k=\"1\"} 1\n",
+                         "d{code=\"err\",k=\"1\"} 1\n", "ts_count{method=\"GET\"} 1\n",
+                         "tn_count{method=\"GET\"} 1\n", "td{code=\"ok\",method=\"GET\"} 1\n",
+                         "tg{method=\"GET\"} 1.5\n"})
+            assert(out.find(line) != std::string::npos);
+    }
+
+    {
+        // computed bucket lookup gives the same result as a plain search
+        Histogram const layouts[] = {
+            Histogram("h", LinearBuckets{100, 7, 40}),
+            Histogram("h", LinearBuckets{0, 1, 3}),
+            Histogram("h", ExponentialBuckets{1, 2, 60}),
+            Histogram("h", ExponentialBuckets{3, 1.7, 50}),
+            Histogram("h", ExponentialBuckets{10, 10, 19}),
+            Histogram("h", Buckets{1, 5, 6, 7, 100, 1000, 1001}),
+        };
+        for (auto& desc: layouts) {
+            Registry computed, searched;
+            auto& hc = computed.add(desc);
+            auto& hs = searched.add(Histogram("h", desc.bounds()));
+            Unsigned v = 0;
+            for (int i = 0; i < 20000; ++i) {
+                for (auto b: {v, v + 1, v - 1}) {
+                    hc.observe(b);
+                    hs.observe(b);
+                }
+                v = v * 3 / 2 + i % 5 + 1;
+            }
+            for (auto b: desc.bounds())
+                for (auto x: {b - 1, b, b + 1}) {
+                    hc.observe(x);
+                    hs.observe(x);
+                }
+            std::stringstream sc, ss;
+            computed.flush(sc);
+            searched.flush(ss);
+            assert(sc.str() == ss.str());
+        }
+    }
+
+    {
+        Registry r;
+        auto& h = r.add(NativeHistogram("nh", 0, "Native", {"a"}), {"b"});
+        for (double v: {1.0, 3.0, 3.0, 0.0, -2.0})
+            h.observe(v);
+        auto& hm = r.add(NativeHistogram("nhm", -2));
+        for (double v: {1.0, 15.0, 17.0, 0.125, -100.0})
+            hm.observe(v);
+        r.add(NativeHistogram("nhz", 8));
+
+        ASSERT_THROW(NativeHistogram("nh", 9), "Histogram 'nh' schema must be from -4 to 8")
+        ASSERT_THROW(NativeHistogram("nh", 0, "", {"le"}), "\"le\" is not allowed as label name in histogram")
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP nh Native\n"
+            "# TYPE nh histogram\n"
+            "nh_bucket{a=\"b\",le=\"-1\"} 1\n"
+            "nh_bucket{a=\"b\",le=\"2.938735877055719e-39\"} 2\n"
+            "nh_bucket{a=\"b\",le=\"1\"} 3\n"
+            "nh_bucket{a=\"b\",le=\"4\"} 5\n"
+            "nh_bucket{a=\"b\",le=\"+Inf\"} 5\n"
+            "nh_sum{a=\"b\"} 5\n"
+            "nh_count{a=\"b\"} 5\n"
+            "# HELP nhm \n"
+            "# TYPE nhm histogram\n"
+            "nhm_bucket{le=\"-16\"} 1\n"
+            "nhm_bucket{le=\"2.938735877055719e-39\"} 1\n"
+            "nhm_bucket{le=\"1\"} 3\n"
+            "nhm_bucket{le=\"16\"} 4\n"
+            "nhm_bucket{le=\"256\"} 5\n"
+            "nhm_bucket{le=\"+Inf\"} 5\n"
+            "nhm_sum -66.875\n"
+            "nhm_count 5\n"
+            "# HELP nhz \n"
+            "# TYPE nhz histogram\n"
+            "nhz_bucket{le=\"2.938735877055719e-39\"} 0\n"
+            "nhz_bucket{le=\"+Inf\"} 0\n"
+            "nhz_sum 0\n"
+            "nhz_count 0\n");
+    }
+
+    // the finest schema with buckets far apart, counted in key order
+    {
+        Registry r;
+        auto& h = r.add(NativeHistogram("nhf", 8));
+        for (double v: {1e300, 1e-300, 1.0, -1e300, -1e-300, 1e300})
+            h.observe(v);
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP nhf \n"
+            "# TYPE nhf histogram\n"
+            "nhf_bucket{le=\"-9.997896753743672e+299\"} 1\n"
+            "nhf_bucket{le=\"2.938735877055719e-39\"} 3\n"
+            "nhf_bucket{le=\"1\"} 4\n"
+            "nhf_bucket{le=\"1.0025003801766598e+300\"} 6\n"
+            "nhf_bucket{le=\"+Inf\"} 6\n"
+            "nhf_sum 1e+300\n"
+            "nhf_count 6\n");
+    }
+
+    {
+        Registry r;
+        auto& s = r.add(Summary("s", Quantiles{0, 0.5, 0.75, 1}, "Summary", {"a"}), {"b"});
+        for (int i = 1; i <= 100; ++i)
+            s.observe(i);
+        auto& neg = r.add(Summary("sn", Quantiles{0.5}));
+        for (int i = -10; i <= 10; ++i)
+            neg.observe(i);
+        r.add(Summary("se", Quantiles{0.5}));
+
+        ASSERT_THROW(Summary("s", Quantiles{1.5}), "Summary 's' quantiles must be from 0 to 1")
+        ASSERT_THROW(Summary("s", Quantiles{}, "", {"quantile"}), "\"quantile\" is not allowed as label name in summary")
+        ASSERT_THROW(Summary("s", Quantiles{}, "", {}, std::chrono::seconds(0)), "Summary 's' max age and age buckets must be positive")
+        ASSERT_THROW(Summary("s", Quantiles{}, "", {}, std::chrono::seconds(1), 1, 0), "Summary 's' accuracy must be between 0 and 1")
+
+        std::stringstream ss;
+        r.flush(ss);
+        auto out = ss.str();
+        auto near = [](double v, double expected){ return std::fabs(v - expected) <= 0.01 * std::fabs(expected); };
+        assert(out.find("# HELP s Summary\n# TYPE s summary\n") == 0);
+        assert(near(value_of(out, "s{a=\"b\",quantile=\"0\"} "), 1));
+        assert(near(value_of(out, "s{a=\"b\",quantile=\"0.5\"} "), 50));
+        assert(near(value_of(out, "s{a=\"b\",quantile=\"0.75\"} "), 75));
+        assert(near(value_of(out, "s{a=\"b\",quantile=\"1\"} "), 100));
+        assert(out.find("s_sum{a=\"b\"} 5050\ns_count{a=\"b\"} 100\n") != std::string::npos);
+        assert(value_of(out, "sn{quantile=\"0.5\"} ") == 0);
+        assert(out.find("sn_sum 0\nsn_count 21\n") != std::string::npos);
+        assert(out.find("se{quantile=\"0.5\"} NaN\nse_sum 0\nse_count 0\n") != std::string::npos);
+    }
+
+    {
+        Registry r;
+        auto& g = r.add(Gauge<double>("gd"));
+        g.set(1.5);
+        g.inc(0.25);
+        g.dec();
+        g.inc(0.5f);
+        auto& h = r.add(Histogram("hd", Buckets{1, 2}));
+        h.observe(0.5);
+        h.observe(1.0);
+        h.observe(1.25);
+        h.observe(-3.0);
+        h.observe(2);
+        h.observe(std::nan(""));
+        auto& hi = r.add(Histogram("hi", Buckets{1}));
+        hi.observe(1.0);
+        hi.observe(3.0);
+        {
+            LocalGauge<double> lg(g, LocalGauge<double>::THRESHOLD, r);
+            lg.inc(0.125);
+            LocalHistogram lh(hi, LocalHistogram::THRESHOLD, r);
+            lh.observe(0.5);
+            lh.observe(7.0);
+        }
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP gd \n"
+            "# TYPE gd gauge\n"
+            "gd 1.375\n"
+            "# HELP hd \n"
+            "# TYPE hd histogram\n"
+            "hd_bucket{le=\"1\"} 3\n"
+            "hd_bucket{le=\"2\"} 5\n"
+            "hd_bucket{le=\"+Inf\"} 6\n"
+            "hd_sum NaN\n"
+            "hd_count 6\n"
+            "# HELP hi \n"
+            "# TYPE hi histogram\n"
+            "hi_bucket{le=\"1\"} 2\n"
+            "hi_bucket{le=\"+Inf\"} 4\n"
+            "hi_sum 11.5\n"
+            "hi_count 4\n");
+    }
+
+    {
+        Registry r;
+        auto& h = r.add(Histogram("big", Buckets{1}));
+        auto const max = std::numeric_limits<Unsigned>::max();
+        h.observe(max);
+        h.observe(max);
+        h.observe(Unsigned(2));
+        {
+            LocalHistogram lh(h, LocalHistogram::THRESHOLD, r);
+            lh.observe(max);
+        }
+
+        std::stringstream ss;
+        r.flush(ss);
+        // 3 * (2^64 - 1) + 2 = 3 * 2^64 - 1
+        assert(ss.str() ==
+            "# HELP big \n"
+            "# TYPE big histogram\n"
+            "big_bucket{le=\"1\"} 0\n"
+            "big_bucket{le=\"+Inf\"} 4\n"
+            "big_sum 5.5340232221128655e+19\n"
+            "big_count 4\n");
+    }
+
+    {
+        Registry r;
+        DenseCounter dc("rpc", {{"method", {"get", "put"}}, {"code", {"ok", "err"}}}, "RPC calls", {"host"});
+        auto& d = r.add(dc, {"h1"});
+        d.at(0, 0).inc();
+        d.at(1, 1).inc(3);
+        d.at(1, 0).inc();
+
+        ASSERT_THROW(DenseCounter("d", {}), "Metric 'd' has no dimensions")
+        ASSERT_THROW(DenseCounter("d", {{"a", {}}}), "Metric 'd' dimension 'a' has no values")
+        ASSERT_THROW(DenseCounter("d", {{"a", {"x"}}, {"a", {"y"}}}), "Metric 'd' has duplicate label names")
+        ASSERT_THROW(DenseCounter("d", {{"a", {"x"}}}, "", {"a"}), "Metric 'd' has duplicate label names")
+
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() ==
+            "# HELP rpc RPC calls\n"
+            "# TYPE rpc counter\n"
+            "rpc{code=\"ok\",host=\"h1\",method=\"get\"} 1\n"
+            "rpc{code=\"err\",host=\"h1\",method=\"get\"} 0\n"
+            "rpc{code=\"ok\",host=\"h1\",method=\"put\"} 1\n"
+            "rpc{code=\"err\",host=\"h1\",method=\"put\"} 3\n");
+    }
+
+    {
+        Registry r;
+        r.add(Counter("c_total", "Calls", {"a"}), {"b"}).inc(3);
+        auto& h = r.add(Histogram("h", Buckets{1}));
+        h.observe(Unsigned(1));
+        h.observe(Unsigned(5));
+        auto& n = r.add(NativeHistogram("n", 0));
+        n.observe(1);
+        n.observe(4);
+        n.observe(-0.5);
+
+        std::stringstream om;
+        r.flush(om, Format::OpenMetrics);
+        assert(om.str() ==
+            "# HELP c Calls\n"
+            "# TYPE c counter\n"
+            "c_total{a=\"b\"} 3\n"
+            "# HELP h \n"
+            "# TYPE h histogram\n"
+            "h_bucket{le=\"1\"} 1\n"
+            "h_bucket{le=\"+Inf\"} 2\n"
+            "h_sum 6\n"
+            "h_count 2\n"
+            "# HELP n \n"
+            "# TYPE n histogram\n"
+            "n_bucket{le=\"-0.25\"} 1\n"
+            "n_bucket{le=\"2.938735877055719e-39\"} 1\n"
+            "n_bucket{le=\"1\"} 2\n"
+            "n_bucket{le=\"4\"} 3\n"
+            "n_bucket{le=\"+Inf\"} 3\n"
+            "n_sum 4.5\n"
+            "n_count 3\n"
+            "# EOF\n");
+
+        // delimited MetricFamily messages, checked against an independent encoder
+        std::stringstream pb;
+        r.flush(pb, Format::Protobuf);
+        assert(pb.str() == unhex(
+            "270a07635f746f74616c120543616c6c73180022130a060a01611201621a0909"
+            "0000000000000840210a01681804221a3a1808021100000000000018401a0b08"
+            "0111000000000000f03f3a0a016e180422333a31080311000000000000124028"
+            "0031000000000000f03738004a04080110015201026204080010016204080210"
+            "016a020200"));
+
+        Registry r2;
+        r2.add(Counter("c", "Calls"));
+        DenseCounter dc("d", {{"x", {"1", "2"}}});
+        r2.add(dc);
+        std::stringstream om2;
+        r2.flush(om2, Format::OpenMetrics);
+        assert(om2.str() ==
+            "# HELP c Calls\n"
+            "# TYPE c counter\n"
+            "c_total 0\n"
+            "# HELP d \n"
+            "# TYPE d counter\n"
+            "d_total{x=\"1\"} 0\n"
+            "d_total{x=\"2\"} 0\n"
+            "# EOF\n");
+    }
+
+    // cached families are formatted again only when their values change
+    {
+        Registry r;
+        auto& a = r.add(Counter("a", "A", {"k"}), {"1"});
+        r.add(Counter("a", "A", {"k"}), {"2"});
+        auto& b = r.add(Gauge<double>("b"));
+        auto fresh = [&r](Format f){
+            Snapshot s;
+            r.snapshot(s);
+            std::string out;
+            StringSink sink{out};
+            Writer w{sink};
+            s.write(w, f);
+            w.flush();
+            return out;
+        };
+        auto flushed = [&r](Format f){
+            std::stringstream ss;
+            r.flush(ss, f);
+            return ss.str();
+        };
+
+        for (auto f: {Format::Text, Format::OpenMetrics, Format::Protobuf, Format::Text}) {
+            assert(flushed(f) == fresh(f));
+            a.inc();
+            assert(flushed(f) == fresh(f));
+            b.set(0.5);
+            assert(flushed(f) == fresh(f));
+            assert(flushed(f) == fresh(f));
+        }
+        auto const before = flushed(Format::Text);
+        r.add(Counter("a", "A", {"k"}), {"3"});
+        r.add(Counter("c"));
+        auto const after = flushed(Format::Text);
+        assert(after == fresh(Format::Text));
+        assert(after.find("a{k=\"3\"} 0\n") != std::string::npos);
+        assert(after.size() > before.size());
+
+        RenderCache cache;
+        Snapshot s;
+        r.snapshot(s);
+        std::string out;
+        StringSink sink{out};
+        Writer w{sink};
+        cache.write(s, w, Format::Text);
+        cache.write(s, w, Format::Text);
+        w.flush();
+        assert(out == after + after);
+    }
+
+    // families of one concrete type are looped over without virtual calls,
+    // mixed ones through them, written whole or in pieces the same
+    {
+        Registry r;
+        for (int i = 0; i < 100; ++i)
+            r.add(Counter("n", "", {"i"}), {std::to_string(i)}).inc(i);
+        r.add(Gauge<double>("m", "", {"t"}), {"double"}).set(0.5);
+        r.add(Gauge<Unsigned>("m", "", {"t"}), {"unsigned"}).set(7);
+        Snapshot s;
+        r.snapshot(s);
+        for (auto f: {Format::Text, Format::OpenMetrics, Format::Protobuf}) {
+            std::string whole, pieces;
+            StringSink ws{whole}, ps{pieces};
+            Writer w{ws}, p{ps};
+            s.write(w, f);
+            w.flush();
+            Snapshot::Cursor c;
+            std::size_t calls = 0;
+            while (!s.write(p, f, c, 100))
+                ++calls;
+            p.flush();
+            assert(pieces == whole);
+            assert(f == Format::Protobuf || calls > 10);
+        }
+        std::stringstream ss;
+        r.flush(ss);
+        auto const out = ss.str();
+        assert(out.find("m{t=\"double\"} 0.5\nm{t=\"unsigned\"} 7\n") != std::string::npos);
+        assert(out.find("n{i=\"99\"} 99\n") != std::string::npos);
+    }
+
+    // series removal, the overflow series past a limit and idle expiry
+    {
+        Registry r;
+        auto text = [&r]{
+            std::stringstream ss;
+            r.flush(ss);
+            return ss.str();
+        };
+        Counter c("churn", "", {"pod"});
+        // a is used after its removal, under a pin taken before it was got
+        Registry::Pin pin{r};
+        auto& a = r.add(c, {"a"});
+        r.add(c, {"b"}).inc(2);
+        a.inc();
+        auto const before = text();
+        assert(r.remove(c, {"a"}));
+        assert(!r.remove(c, {"a"}));
+        assert(!r.remove(Counter("none")));
+        ASSERT_THROW(r.remove(c), "Key/value mismatch for metric 'churn'")
+        a.inc();
+        auto out = text();
+        assert(out != before);
+        assert(out.find("churn{pod=\"a\"}") == std::string::npos);
+        assert(out.find("churn{pod=\"b\"} 2\n") != std::string::npos);
+        r.add(c, {"a"});
+        assert(text().find("churn{pod=\"a\"} 0\n") != std::string::npos);
+        assert(r.remove(c, {"a"}) && r.remove(c, {"b"}));
+        assert(text().find("churn") == std::string::npos);
+
+        auto& f = r.family(Gauge<Unsigned>("g", "", {"k"}));
+        f.labels("x").set(1);
+        assert(f.remove("x"));
+        assert(!f.remove("x"));
+        f.labels("x");
+        assert(text().find("g{k=\"x\"} 0\n") != std::string::npos);
+
+        r.limit("capped", 2);
+        Counter capped("capped", "", {"id"});
+        r.add(capped, {"1"});
+        r.add(capped, {"2"});
+        auto& o = r.add(capped, {"3"});
+        auto& o2 = r.add(capped, {"4"});
+        assert(&o == &o2);
+        o.inc();
+        o2.inc();
+        ASSERT_THROW(r.add(capped, {"2"}), "Metric 'capped' has duplicate labels")
+        out = text();
+        assert(out.find("capped{id=\"__overflow__\"} 2\n") != std::string::npos);
+        assert(out.find("capped{id=\"3\"}") == std::string::npos);
+        assert(r.remove(capped, {"1"}));
+        assert(&r.add(capped, {"5"}) != &o);
+
+        r.expire("idle", std::chrono::seconds(1));
+        auto& idle = r.family(Gauge<Unsigned>("idle", "", {"k"}));
+        idle.labels("busy");
+        idle.labels("quiet");
+        Snapshot s;
+        r.snapshot(s);
+        for (int i = 1; i <= 3; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(400));
+            idle.labels("busy").set(i);
+            r.snapshot(s);
+        }
+        out = text();
+        assert(out.find("idle{k=\"busy\"} 3\n") != std::string::npos);
+        assert(out.find("quiet") == std::string::npos);
+        // a new series, not the expired one
+        idle.labels("quiet");
+        assert(text().find("idle{k=\"quiet\"} 0\n") != std::string::npos);
+    }
+
+    // removed series are reclaimed once no pin, snapshot or local handle
+    // holds them back, then their memory makes new series
+    {
+        Counter c("reclaimed", "", {"k"});
+        {
+            Registry r;
+            auto x = &r.add(c, {"x"});
+            assert(r.remove(c, {"x"}));
+            assert(&r.add(c, {"y"}) == x);
+        }
+        {
+            Registry r;
+            Registry::Pin pin{r};
+            auto& x = r.add(c, {"x"});
+            assert(r.remove(c, {"x"}));
+            x.inc();
+            Snapshot s;
+            r.snapshot(s);
+            assert(&r.add(c, {"y"}) != &x);
+            // let go of by a refresh
+            pin.refresh();
+            r.snapshot(s);
+            assert(&r.add(c, {"z"}) == &x);
+        }
+        {
+            Registry r;
+            auto& x = r.add(c, {"x"});
+            x.inc(5);
+            Snapshot s;
+            r.snapshot(s);
+            assert(r.remove(c, {"x"}));
+            assert(&r.add(c, {"y"}) != &x);
+            // written from the series removed meanwhile
+            Snapshot other;
+            r.snapshot(other);
+            std::string out;
+            StringSink sink{out};
+            Writer w{sink};
+            s.write(w);
+            w.flush();
+            assert(out.find("reclaimed{k=\"x\"} 5\n") != std::string::npos);
+            s.clear();
+            r.snapshot(s);
+            assert(&r.add(c, {"z"}) == &x);
+        }
+        {
+            Registry r;
+            auto& x = r.add(c, {"x"});
+            auto& h = r.add(Histogram("reclaimed_h", Buckets{1}, "", {"k"}), {"x"});
+            Snapshot s;
+            {
+                LocalCounter lc{x, 1000, r};
+                LocalHistogram lh{h, 1000, r};
+                lc.inc();
+                lh.observe(Unsigned(1));
+                assert(r.remove(c, {"x"}));
+                assert(r.remove(Histogram("reclaimed_h", Buckets{1}, "", {"k"}), {"x"}));
+                // publishes into the removed series, which are kept
+                r.snapshot(s);
+                assert(&r.add(c, {"y"}) != &x);
+            }
+            r.snapshot(s);
+            assert(&r.add(c, {"z"}) == &x);
+        }
+    }
+
+    // parallel formatting, in parts of whole families
+    {
+        Registry r;
+        for (int i = 0; i < 50; ++i) {
+            Counter c("p" + std::to_string(i), "Part", {"k"});
+            for (int j = 0; j <= i; ++j)
+                r.add(c, {std::to_string(j)}).inc(j);
+        }
+        r.add(Histogram("ph", Buckets{1, 10})).observe(5);
+        for (auto f: {Format::Text, Format::OpenMetrics, Format::Protobuf}) {
+            std::stringstream ss;
+            r.flush(ss, f);
+            auto const serial = ss.str();
+            for (std::size_t parts: {1, 2, 3, 8, 100}) {
+                std::string out;
+                StringSink sink{out};
+                r.flush(sink, f, parts);
+                assert(out == serial);
+            }
+            std::size_t tasks = 0;
+            std::string out;
+            StringSink sink{out};
+            r.flush(sink, f, 4, [&tasks](std::vector<std::function<void()>> const& t){
+                tasks = t.size();
+                for (auto& task: t)
+                    task();
+            });
+            assert(out == serial);
+            assert(tasks == 4);
+        }
+    }
+
+    // collectors make whole families on each snapshot, merged by name
+    {
+        Registry r;
+        r.add(Gauge<Unsigned>("b_registered")).set(1);
+        r.add(Counter("d_clash")).inc();
+        Unsigned depth = 3;
+        auto& queues = r.add_collector([&depth](Collection& c){
+            c.add(Gauge<Unsigned>("c_queue_depth", "Queue depth", {"queue"}), {"in"}).set(depth);
+            c.add(Gauge<Unsigned>("c_queue_depth", "Queue depth", {"queue"}), {"out"}).set(depth * 2);
+            c.add(Counter("a_collected_total", "Collected")).inc(depth);
+            c.add(Gauge<double>("d_clash")).set(5);
+            c.add(Histogram("e_sizes", Buckets{10}), {}).observe(depth);
+        });
+        auto text = [&r](Format f){
+            std::stringstream ss;
+            r.flush(ss, f);
+            return ss.str();
+        };
+        assert(text(Format::Text) ==
+            "# HELP a_collected_total Collected\n"
+            "# TYPE a_collected_total counter\n"
+            "a_collected_total 3\n"
+            "# HELP b_registered \n"
+            "# TYPE b_registered gauge\n"
+            "b_registered 1\n"
+            "# HELP c_queue_depth Queue depth\n"
+            "# TYPE c_queue_depth gauge\n"
+            "c_queue_depth{queue=\"in\"} 3\n"
+            "c_queue_depth{queue=\"out\"} 6\n"
+            "# HELP d_clash \n"
+            "# TYPE d_clash counter\n"
+            "d_clash 1\n"
+            "# HELP e_sizes \n"
+            "# TYPE e_sizes histogram\n"
+            "e_sizes_bucket{le=\"10\"} 1\n"
+            "e_sizes_bucket{le=\"+Inf\"} 1\n"
+            "e_sizes_sum 3\n"
+            "e_sizes_count 1\n");
+
+        // equal snapshots while the collected values are the same
+        Snapshot s1, s2;
+        r.snapshot(s1);
+        r.snapshot(s2);
+        assert(s1 == s2);
+        depth = 4;
+        auto const changed = text(Format::Text);
+        assert(changed.find("c_queue_depth{queue=\"out\"} 8\n") != std::string::npos);
+        r.snapshot(s2);
+        assert(s1 != s2);
+        // copies keep the collected series
+        Snapshot copy = s1;
+        s1.clear();
+        std::string out;
+        StringSink sink{out};
+        Writer w{sink};
+        copy.write(w);
+        w.flush();
+        assert(out.find("c_queue_depth{queue=\"out\"} 6\n") != std::string::npos);
+
+        struct Failing final: Collector
+        {
+            void collect(Collection& c) override
+            {
+                c.add(Counter("f"));
+                c.add(Counter("f"));
+            }
+        };
+        auto& failing = r.add_collector(std::unique_ptr<Collector>(new Failing()));
+        ASSERT_THROW(r.snapshot(s1), "Metric 'f' has duplicate labels")
+        r.remove_collector(failing);
+        r.remove_collector(queues);
+        assert(text(Format::OpenMetrics).find("queue") == std::string::npos);
+    }
+
+    // counters of real numbers
+    {
+        Registry r;
+        auto& c = r.add(RealCounter("cpu_seconds", "CPU"));
+        c.inc(0.25);
+        c.inc(1);
+        std::stringstream ss;
+        r.flush(ss);
+        assert(ss.str() == "# HELP cpu_seconds CPU\n# TYPE cpu_seconds counter\ncpu_seconds 1.25\n");
+        ss.str({});
+        r.flush(ss, Format::OpenMetrics);
+        assert(ss.str().find("cpu_seconds_total 1.25\n") != std::string::npos);
+    }
+
+    // exemplars, in OpenMetrics only
+    {
+        Registry r;
+        auto& c = r.add(Counter("c", "Calls"));
+        auto& h = r.add(Histogram("h", Buckets{1, 10}));
+        c.inc();
+        h.observe(Unsigned(5));
+        auto text = [&](Format f) {
+            std::stringstream ss;
+            r.flush(ss, f);
+            return ss.str();
+        };
+        auto const plain = text(Format::Text);
+        auto const pb = text(Format::Protobuf);
+
+        c.inc(2, {{"trace_id", "abc"}});
+        h.observe(0.5, {{"trace_id", "a\"b"}, {"span_id", "1"}});
+        h.observe(Unsigned(20), {{"trace_id", std::string(200, 'x')}});
+        assert(text(Format::Text) != plain);
+        assert(text(Format::Text).find('#' + std::string(" {")) == std::string::npos);
+        auto const om = text(Format::OpenMetrics);
+        assert(om.find("c_total 3 # {trace_id=\"abc\"} 2 1") != std::string::npos);
+        assert(om.find("h_bucket{le=\"1\"} 1 # {trace_id=\"a\\\"b\",span_id=\"1\"} 0.5 1") != std::string::npos);
+        assert(om.find("h_bucket{le=\"10\"} 2\n") != std::string::npos);
+        // too long labels are dropped, not cut
+        assert(om.find("h_bucket{le=\"+Inf\"} 3\n") != std::string::npos);
+        auto const with = text(Format::Protobuf);
+        assert(with != pb && with.find("abc") != std::string::npos && with.find("span_id") != std::string::npos);
+
+        // replaced at most once per interval
+        exemplar_interval(std::chrono::hours(1));
+        c.inc(1, {{"trace_id", "def"}});
+        assert(text(Format::OpenMetrics).find("trace_id=\"abc\"") != std::string::npos);
+        exemplar_interval(std::chrono::milliseconds(0));
+        c.inc(1, {{"trace_id", "def"}});
+        assert(text(Format::OpenMetrics).find("c_total 5 # {trace_id=\"def\"} 1 ") != std::string::npos);
+
+        // readers never see a torn exemplar
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 2; ++t)
+            writers.emplace_back([&, t]{
+                auto const id = std::string(t ? 40 : 8, char('a' + t));
+                while (!stop.load())
+                    h.observe(Unsigned(0), {{"trace_id", id}});
+            });
+        for (int i = 0; i < 200; ++i) {
+            auto const out = text(Format::OpenMetrics);
+            auto const at = out.find("h_bucket{le=\"1\"}");
+            auto const line = out.substr(at, out.find('\n', at) - at);
+            assert(line.find("{trace_id=\"" + std::string(8, 'a') + "\"}") != std::string::npos
+                   || line.find("{trace_id=\"" + std::string(40, 'b') + "\"}") != std::string::npos
+                   || line.find("span_id") != std::string::npos);
+        }
+        stop = true;
+        for (auto& w: writers)
+            w.join();
+    }
+
+    // exemplars of a snapshot are apart from values, listed by series
+    {
+        Registry r;
+        Counter calls("calls", "Calls", {"x"});
+        auto& a = r.add(calls, {"a"});
+        r.add(calls, {"b"}).inc();
+        auto& c = r.add(calls, {"c"});
+        c.inc(1, {{"trace_id", "c1"}});
+        Snapshot s1, s2;
+        r.snapshot(s1);
+        r.snapshot(s2);
+        assert(s1 == s2);
+        RenderCache cache;
+        auto render = [&](Snapshot const& s) {
+            std::string out;
+            StringSink sink{out};
+            Writer w{sink};
+            cache.write(s, w, Format::OpenMetrics);
+            w.flush();
+            return out;
+        };
+        auto const first = render(s1);
+        assert(first.find("calls_total{x=\"b\"} 1\n") != std::string::npos);
+        assert(first.find("calls_total{x=\"c\"} 1 # {trace_id=\"c1\"} 1 ") != std::string::npos);
+
+        // a new exemplar alone changes the snapshot and its rendering
+        a.inc(0, {{"trace_id", "a1"}});
+        r.snapshot(s2);
+        assert(!(s1 == s2));
+        auto const second = render(s2);
+        assert(second.find("calls_total{x=\"a\"} 0 # {trace_id=\"a1\"} 0 ") != std::string::npos);
+        assert(second.find("calls_total{x=\"b\"} 1\n") != std::string::npos);
+        assert(second.find("calls_total{x=\"c\"} 1 # {trace_id=\"c1\"} 1 ") != std::string::npos);
+        assert(render(s1) == first);
+    }
 }
@@ -0,0 +1,439 @@
+#include <promxx/shared.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace promxx
+{
+namespace
+{
+
+char const MAGIC[8] = {'p', 'r', 'o', 'm', 'x', 'x', 's', 'h'};
+
+struct Header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    std::uint64_t size;
+    // end of the entries, advanced once one is written
+    std::atomic<std::uint64_t> used;
+    // pid of the process appending an entry, 0 if none
+    std::atomic<std::int32_t> lock;
+    std::uint32_t reserved2;
+};
+
+//
+// Followed by its cells, the histogram bounds, then the strings, each
+// a 32-bit length and the bytes: name, help, label names in sorted order
+// and the values in the same order
+//
+struct Entry
+{
+    std::uint32_t size; // in all, a multiple of 8
+    std::uint32_t kind;
+    std::int32_t pid;
+    std::uint32_t cells;
+    std::uint32_t keys;
+    std::uint32_t bounds;
+};
+
+static_assert(sizeof(Header) % 8 == 0 && sizeof(Entry) % 8 == 0, "Cells must stay aligned");
+static_assert(sizeof(ICounter) == sizeof(Unsigned) && sizeof(IRealCounter) == sizeof(Unsigned)
+              && sizeof(IGauge<Unsigned>) == sizeof(Unsigned)
+              && sizeof(IGauge<double>) == sizeof(Unsigned),
+              "Interfaces must be one cell");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "Shared atomics must be lock-free");
+
+std::size_t const HISTOGRAM_CELLS = 3; // sum, its high word and the real one
+
+bool alive(std::int32_t pid)
+{
+    return ::kill(pid, 0) == 0 || errno == EPERM;
+}
+
+void put(char*& p, std::string const& s)
+{
+    std::uint32_t const n = s.size();
+    std::memcpy(p, &n, sizeof n);
+    std::memcpy(p + sizeof n, s.data(), n);
+    p += sizeof n + n;
+}
+
+std::string get(char const*& p)
+{
+    std::uint32_t n;
+    std::memcpy(&n, p, sizeof n);
+    std::string s(p + sizeof n, n);
+    p += sizeof n + n;
+    return s;
+}
+
+} // namespace
+
+struct SharedSegment::Data
+{
+    std::string path;
+    Header *h = nullptr;
+    std::size_t size = 0;
+
+    std::mutex mtx;
+    // series of the process, by kind, name and labels
+    pid_t pid = -1;
+    std::unordered_map<std::string, void*> series;
+    std::unordered_map<std::string, Kind> kinds;
+    std::unordered_map<void*, std::unique_ptr<SharedHistogram>> histograms;
+
+    char* base() const noexcept { return reinterpret_cast<char*>(h); }
+
+    void lock() noexcept
+    {
+        auto const me = std::int32_t(::getpid());
+        for (unsigned spins = 1;; ++spins) {
+            std::int32_t holder = 0;
+            if (h->lock.compare_exchange_weak(holder, me, std::memory_order_acquire,
+                                              std::memory_order_relaxed))
+                return;
+            // taken over from a process that died holding it, which didn't
+            // advance used yet
+            if (holder && spins % 1024 == 0 && !alive(holder)
+                && h->lock.compare_exchange_strong(holder, me, std::memory_order_acquire,
+                                                   std::memory_order_relaxed))
+                return;
+            std::this_thread::yield();
+        }
+    }
+
+    void unlock() noexcept { h->lock.store(0, std::memory_order_release); }
+};
+
+SharedHistogram::SharedHistogram(Histogram const& h, std::atomic<Unsigned> *cells)
+    : search_(h)
+    , counts_(cells)
+    , sum_(cells + h.bounds().size() + 1)
+    , sum_hi_(sum_ + 1)
+    , real_sum_(reinterpret_cast<std::atomic<double>*>(sum_ + 2))
+{
+}
+
+SharedSegment::SharedSegment(std::string const& path, std::size_t size)
+    : data_(new Data())
+{
+    std::unique_ptr<Data> d{data_};
+    d->path = path;
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        throw Error{"Can't open shared segment " + path + ": " + std::strerror(errno)};
+    auto fail = [&](std::string const& what) {
+        auto const error = errno;
+        ::close(fd);
+        throw Error{"Can't " + what + " shared segment " + path + ": " + std::strerror(error)};
+    };
+    // one process makes the header, the others wait for it
+    if (::flock(fd, LOCK_EX) != 0)
+        fail("lock");
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+        fail("stat");
+    bool const make = st.st_size == 0;
+    if (make) {
+        if (size < sizeof(Header) + sizeof(Entry)) {
+            ::close(fd);
+            throw Error{"Shared segment " + path + " is too small"};
+        }
+        if (::ftruncate(fd, off_t(size)) != 0)
+            fail("resize");
+    }
+    else
+        size = std::size_t(st.st_size);
+    auto p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        fail("map");
+    d->h = static_cast<Header*>(p);
+    d->size = size;
+    if (make) {
+        // the file is zero filled
+        d->h->version = VERSION;
+        d->h->size = size;
+        d->h->used.store(sizeof(Header), std::memory_order_relaxed);
+        std::memcpy(d->h->magic, MAGIC, sizeof MAGIC);
+    }
+    // the mapping keeps the file open, and so the lock
+    ::flock(fd, LOCK_UN);
+    ::close(fd);
+    if (std::memcmp(d->h->magic, MAGIC, sizeof MAGIC) != 0 || d->h->version != VERSION
+        || d->h->size != size) {
+        ::munmap(p, size);
+        throw Error{"Shared segment " + path + " has another layout"};
+    }
+    d.release();
+}
+
+SharedSegment::~SharedSegment()
+{
+    ::munmap(data_->h, data_->size);
+    delete data_;
+}
+
+void SharedSegment::unlink(std::string const& path)
+{
+    ::unlink(path.c_str());
+}
+
+std::size_t SharedSegment::used() const noexcept
+{
+    return std::size_t(data_->h->used.load(std::memory_order_acquire));
+}
+
+std::size_t SharedSegment::size() const noexcept
+{
+    return data_->size;
+}
+
+void* SharedSegment::cells(Kind kind, detail::MetricMeta const& desc,
+                           std::vector<std::string> const& values, Buckets const* bounds)
+{
+    auto& d = *data_;
+    auto const labels = desc.labels(values);
+
+    std::lock_guard<std::mutex> guard{d.mtx};
+    auto const pid = ::getpid();
+    if (d.pid != pid) {
+        // those of the parent stay shared through the references to them
+        d.pid = pid;
+        d.series.clear();
+    }
+    auto const kit = d.kinds.emplace(desc.name(), kind).first;
+    if (kit->second != kind)
+        throw Error{"Metric '" + desc.name() + "' is in the shared segment with another type"};
+    std::string key = desc.name();
+    key += '\0';
+    key += labels;
+    auto it = d.series.find(key);
+    if (it != d.series.end()) {
+        if (bounds) {
+            auto& e = reinterpret_cast<Entry const*>(it->second)[-1];
+            auto const b = reinterpret_cast<Unsigned const*>(it->second) + e.cells;
+            if (e.bounds != bounds->size() || !std::equal(bounds->begin(), bounds->end(), b))
+                throw Error{"Histogram '" + desc.name() + "' is in the shared segment with other buckets"};
+        }
+        return it->second;
+    }
+
+    std::size_t const cells = bounds ? bounds->size() + 1 + HISTOGRAM_CELLS : 1;
+    std::size_t const nbounds = bounds ? bounds->size() : 0;
+    std::size_t size = sizeof(Entry) + (cells + nbounds) * sizeof(Unsigned)
+        + 2 * sizeof(std::uint32_t) + desc.name().size() + desc.help().size();
+    for (auto& k: desc.keys())
+        size += 2 * sizeof(std::uint32_t) + k.first.size() + values[k.second].size();
+    size = (size + 7) & ~std::size_t(7);
+
+    d.lock();
+    auto const used = std::size_t(d.h->used.load(std::memory_order_relaxed));
+    if (size > d.size - used) {
+        d.unlock();
+        throw Error{"Metric '" + desc.name() + "' doesn't fit into shared segment " + d.path};
+    }
+    auto const at = d.base() + used;
+    // maybe left over by a process that died writing it
+    std::memset(at, 0, size);
+    auto& e = *reinterpret_cast<Entry*>(at);
+    e.size = std::uint32_t(size);
+    e.kind = std::uint32_t(kind);
+    e.pid = std::int32_t(pid);
+    e.cells = std::uint32_t(cells);
+    e.keys = std::uint32_t(desc.keys().size());
+    e.bounds = std::uint32_t(nbounds);
+    auto const p = at + sizeof(Entry);
+    switch (kind) {
+    case Kind::Counter: new (p) ICounter(); break;
+    case Kind::RealCounter: new (p) IRealCounter(); break;
+    case Kind::Gauge: new (p) IGauge<Unsigned>(); break;
+    case Kind::RealGauge: new (p) IGauge<double>(); break;
+    case Kind::Histogram:
+        for (std::size_t i = 0; i < cells - 1; ++i)
+            new (p + i * sizeof(Unsigned)) std::atomic<Unsigned>(0);
+        new (p + (cells - 1) * sizeof(Unsigned)) std::atomic<double>(0);
+        break;
+    }
+    auto s = p + cells * sizeof(Unsigned);
+    if (nbounds) {
+        std::memcpy(s, bounds->data(), nbounds * sizeof(Unsigned));
+        s += nbounds * sizeof(Unsigned);
+    }
+    put(s, desc.name());
+    put(s, desc.help());
+    for (auto& k: desc.keys())
+        put(s, k.first);
+    for (auto& k: desc.keys())
+        put(s, values[k.second]);
+    d.h->used.store(used + size, std::memory_order_release);
+    d.unlock();
+
+    d.series.emplace(std::move(key), p);
+    return p;
+}
+
+SharedHistogram& SharedSegment::histogram(Histogram const& h, std::atomic<Unsigned> *cells)
+{
+    auto& d = *data_;
+    std::lock_guard<std::mutex> guard{d.mtx};
+    auto& sh = d.histograms[cells];
+    if (!sh)
+        sh.reset(new SharedHistogram(h, cells));
+    return *sh;
+}
+
+void SharedSegment::collect(Collection& c) const
+{
+    struct Sums
+    {
+        std::vector<Unsigned> cells;
+        double real = 0;
+    };
+
+    struct Family
+    {
+        Kind kind;
+        std::string help;
+        std::vector<std::string> keys;
+        Buckets bounds;
+        std::map<std::vector<std::string>, Sums> series;
+    };
+
+    auto const& d = *data_;
+    std::map<std::string, Family> families;
+    std::unordered_map<std::int32_t, bool> live;
+
+    auto const end = d.base() + d.h->used.load(std::memory_order_acquire);
+    for (auto at = d.base() + sizeof(Header); at < end;) {
+        auto const& e = *reinterpret_cast<Entry const*>(at);
+        auto const kind = Kind(e.kind);
+        auto const cells = reinterpret_cast<std::atomic<Unsigned> const*>(at + sizeof(Entry));
+        auto const bounds = reinterpret_cast<Unsigned const*>(cells + e.cells);
+        auto s = reinterpret_cast<char const*>(bounds + e.bounds);
+        at += e.size;
+
+        if (kind == Kind::Gauge || kind == Kind::RealGauge) {
+            auto l = live.find(e.pid);
+            if (l == live.end())
+                l = live.emplace(e.pid, alive(e.pid)).first;
+            if (!l->second)
+                continue;
+        }
+
+        auto const name = get(s);
+        auto const help = get(s);
+        std::vector<std::string> keys(e.keys), values(e.keys);
+        for (auto& k: keys)
+            k = get(s);
+        for (auto& v: values)
+            v = get(s);
+
+        auto fit = families.find(name);
+        if (fit == families.end()) {
+            Family f{kind, help, keys, Buckets(bounds, bounds + e.bounds), {}};
+            fit = families.emplace(name, std::move(f)).first;
+        }
+        auto& f = fit->second;
+        // the first one seen wins a clash between processes
+        if (f.kind != kind || f.keys != keys || f.bounds.size() != e.bounds
+            || !std::equal(f.bounds.begin(), f.bounds.end(), bounds))
+            continue;
+
+        auto& sums = f.series[std::move(values)];
+        sums.cells.resize(e.cells);
+        switch (kind) {
+        case Kind::Counter:
+            sums.cells[0] += reinterpret_cast<ICounter const*>(cells)->v_.load(detail::MEMORY_ORDER);
+            break;
+        case Kind::RealCounter:
+            sums.real += reinterpret_cast<IRealCounter const*>(cells)->v_.load(detail::MEMORY_ORDER);
+            break;
+        case Kind::Gauge:
+            sums.cells[0] += reinterpret_cast<IGauge<Unsigned> const*>(cells)->v_.load(detail::MEMORY_ORDER);
+            break;
+        case Kind::RealGauge:
+            sums.real += reinterpret_cast<IGauge<double> const*>(cells)->v_.load(detail::MEMORY_ORDER);
+            break;
+        case Kind::Histogram: {
+            auto const n = e.bounds + 1;
+            for (std::size_t i = 0; i < n; ++i)
+                sums.cells[i] += cells[i].load(detail::MEMORY_ORDER);
+            // 128-bit sum
+            auto const lo = cells[n].load(detail::MEMORY_ORDER);
+            sums.cells[n] += lo;
+            sums.cells[n + 1] += cells[n + 1].load(detail::MEMORY_ORDER) + (sums.cells[n] < lo);
+            sums.real += reinterpret_cast<std::atomic<double> const*>(cells + n + 2)->load(detail::MEMORY_ORDER);
+            break;
+        }
+        }
+    }
+
+    for (auto& fit: families) {
+        auto const& name = fit.first;
+        auto& f = fit.second;
+        if (f.series.empty())
+            continue;
+        switch (f.kind) {
+        case Kind::Counter: {
+            Counter const desc{name, f.help, f.keys};
+            for (auto& s: f.series)
+                c.add(desc, s.first).inc(s.second.cells[0]);
+            break;
+        }
+        case Kind::RealCounter: {
+            RealCounter const desc{name, f.help, f.keys};
+            for (auto& s: f.series)
+                c.add(desc, s.first).inc(s.second.real);
+            break;
+        }
+        case Kind::Gauge: {
+            Gauge<Unsigned> const desc{name, f.help, f.keys};
+            for (auto& s: f.series)
+                c.add(desc, s.first).set(s.second.cells[0]);
+            break;
+        }
+        case Kind::RealGauge: {
+            Gauge<double> const desc{name, f.help, f.keys};
+            for (auto& s: f.series)
+                c.add(desc, s.first).set(s.second.real);
+            break;
+        }
+        case Kind::Histogram: {
+            Histogram const desc{name, f.bounds, f.help, f.keys};
+            auto const n = f.bounds.size() + 1;
+            for (auto& s: f.series) {
+                auto& h = c.add(desc, s.first);
+                for (std::size_t i = 0; i < n; ++i)
+                    h.counts_[i].store(s.second.cells[i], std::memory_order_relaxed);
+                h.sum_.store(s.second.cells[n], std::memory_order_relaxed);
+                h.sum_hi_.store(s.second.cells[n + 1], std::memory_order_relaxed);
+                h.real_sum_.store(s.second.real, std::memory_order_relaxed);
+            }
+            break;
+        }
+        }
+    }
+}
+
+Collector& add_shared_collector(SharedSegment const& s, Registry& r)
+{
+    return r.add_collector([&s](Collection& c) { s.collect(c); });
+}
+
+} // namespace promxx
@@ -0,0 +1,155 @@
+#include <cassert>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <promxx/shared.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+std::string text(Registry& r)
+{
+    std::stringstream ss;
+    r.flush(ss);
+    return ss.str();
+}
+
+bool has(std::string const& out, std::string const& line)
+{
+    return out.find(line + '\n') != std::string::npos;
+}
+
+template<class F>
+bool throws(F f)
+{
+    try {
+        f();
+    }
+    catch (Error const&) {
+        return true;
+    }
+    return false;
+}
+
+} // namespace
+
+int main()
+{
+    auto const path = "/tmp/promxx_shared_test_" + std::to_string(::getpid());
+    SharedSegment::unlink(path);
+
+    {
+        SharedSegment seg{path, 1 << 16};
+        // shared with the workers forked below
+        auto& forks = seg.add(Counter("forks", "Forks"));
+
+        int ready[2], done[2];
+        auto rc = ::pipe(ready) | ::pipe(done);
+        assert(rc == 0);
+        (void)rc;
+
+        int const WORKERS = 3;
+        std::vector<pid_t> workers;
+        for (int w = 0; w < WORKERS; ++w) {
+            auto pid = ::fork();
+            assert(pid >= 0);
+            if (pid) {
+                workers.push_back(pid);
+                continue;
+            }
+            ::close(ready[0]);
+            ::close(done[1]);
+            forks.inc();
+            auto& requests = seg.add(Counter("requests", "Requests", {"code"}), {"200"});
+            for (int i = 0; i < (w + 1) * 1000; ++i)
+                requests.inc();
+            seg.add(Counter("requests", "Requests", {"code"}), {"500"}).inc();
+            seg.add(Gauge<Unsigned>("busy", "Busy workers")).set(1);
+            seg.add(Gauge<double>("load", "Load")).set(0.25);
+            auto& latency = seg.add(Histogram("latency", Buckets{10, 100}, "Latency"));
+            latency.observe(Unsigned(5));
+            latency.observe(50.5);
+            seg.add(RealCounter("seconds", "Seconds")).inc(0.5);
+            char c = 0;
+            ::write(ready[1], &c, 1);
+            // alive until told
+            ::read(done[0], &c, 1);
+            ::_exit(0);
+        }
+        ::close(ready[1]);
+        ::close(done[0]);
+        for (int w = 0; w < WORKERS; ++w) {
+            char c;
+            auto n = ::read(ready[0], &c, 1);
+            assert(n == 1);
+            (void)n;
+        }
+
+        // the exporter maps the segment on its own
+        SharedSegment exporter{path};
+        assert(exporter.size() == 1 << 16);
+        assert(exporter.used() == seg.used());
+        Registry r;
+        add_shared_collector(exporter, r);
+        auto out = text(r);
+        assert(has(out, "# TYPE requests counter"));
+        assert(has(out, "requests{code=\"200\"} 6000"));
+        assert(has(out, "requests{code=\"500\"} 3"));
+        assert(has(out, "forks 3"));
+        assert(has(out, "busy 3"));
+        assert(has(out, "load 0.75"));
+        assert(has(out, "seconds 1.5"));
+        assert(has(out, "latency_bucket{le=\"10\"} 3"));
+        assert(has(out, "latency_bucket{le=\"100\"} 6"));
+        assert(has(out, "latency_bucket{le=\"+Inf\"} 6"));
+        assert(has(out, "latency_sum 166.5"));
+        assert(has(out, "latency_count 6"));
+
+        // gauges of exited workers don't show, the rest stays
+        ::close(done[1]);
+        for (auto pid: workers) {
+            int status;
+            ::waitpid(pid, &status, 0);
+            assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+        out = text(r);
+        assert(!has(out, "busy 3"));
+        assert(out.find("# TYPE busy") == std::string::npos);
+        assert(has(out, "requests{code=\"200\"} 6000"));
+        assert(has(out, "forks 3"));
+
+        // series of the process are found again, not added
+        auto const used = seg.used();
+        auto& again = seg.add(Counter("forks", "Forks"));
+        assert(&again == &forks);
+        assert(&seg.add(Histogram("latency", Buckets{10, 100})) == &seg.add(Histogram("latency", Buckets{10, 100})));
+        auto const after = seg.used();
+        seg.add(Histogram("latency", Buckets{10, 100}));
+        assert(seg.used() == after && after > used);
+
+        assert(throws([&]{ seg.add(Gauge<Unsigned>("forks")); }));
+        assert(throws([&]{ seg.add(Histogram("latency", Buckets{10, 1000})); }));
+        assert(throws([&]{ seg.add(Counter("requests", "", {"code"})); }));
+        assert(throws([&]{
+            for (int i = 0;; ++i)
+                seg.add(Counter("many", "", {"i"}), {std::to_string(i)});
+        }));
+    }
+    SharedSegment::unlink(path);
+
+    // not a segment
+    {
+        auto f = std::fopen(path.c_str(), "w");
+        std::fputs("not a segment, but long enough to be one", f);
+        std::fclose(f);
+        assert(throws([&]{ SharedSegment s{path}; }));
+        SharedSegment::unlink(path);
+    }
+}
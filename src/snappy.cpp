@@ -0,0 +1,186 @@
+#include <promxx/snappy.hpp>
+#include <promxx/writer.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace promxx
+{
+namespace
+{
+
+std::size_t const BLOCK = 1 << 16;
+unsigned const HASH_BITS = 14;
+
+enum Tag: unsigned { LITERAL = 0, COPY1 = 1, COPY2 = 2, COPY4 = 3 };
+
+std::uint32_t load32(char const* p) noexcept
+{
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof v);
+    return v;
+}
+
+std::uint32_t hash(std::uint32_t v) noexcept
+{
+    return (v * 0x1e35a7bdu) >> (32 - HASH_BITS);
+}
+
+void literal(char const* data, std::size_t size, std::string& out)
+{
+    if (!size)
+        return;
+    auto const n = size - 1;
+    if (n < 60)
+        out += char(n << 2 | LITERAL);
+    else {
+        // length in the next 1 to 4 bytes
+        char len[4];
+        unsigned bytes = 0;
+        for (auto v = n; v; v >>= 8)
+            len[bytes++] = char(v);
+        out += char((59 + bytes) << 2 | LITERAL);
+        out.append(len, bytes);
+    }
+    out.append(data, size);
+}
+
+// A copy of 4 to 64 bytes
+void copy(std::size_t offset, std::size_t size, std::string& out)
+{
+    if (size < 12 && offset < 2048) {
+        out += char((offset >> 8) << 5 | (size - 4) << 2 | COPY1);
+        out += char(offset);
+    }
+    else {
+        out += char((size - 1) << 2 | COPY2);
+        out += char(offset);
+        out += char(offset >> 8);
+    }
+}
+
+void copies(std::size_t offset, std::size_t size, std::string& out)
+{
+    // pieces of at least 4 bytes
+    while (size >= 68) {
+        copy(offset, 64, out);
+        size -= 64;
+    }
+    if (size > 64) {
+        copy(offset, 60, out);
+        size -= 60;
+    }
+    copy(offset, size, out);
+}
+
+void compress_block(char const* in, std::size_t size, std::vector<std::uint16_t>& table,
+                    std::string& out)
+{
+    std::size_t next = 0; // of the pending literal
+    if (size >= 16) {
+        std::fill(table.begin(), table.end(), 0);
+        // a 4-byte read fits from every position up to limit
+        auto const limit = size - 4;
+        for (std::size_t i = 1; i <= limit;) {
+            auto const v = load32(in + i);
+            auto& slot = table[hash(v)];
+            std::size_t const candidate = slot;
+            slot = std::uint16_t(i);
+            if (candidate >= i || load32(in + candidate) != v) {
+                ++i;
+                continue;
+            }
+            literal(in + next, i - next, out);
+            auto n = std::size_t(4);
+            while (i + n < size && in[candidate + n] == in[i + n])
+                ++n;
+            copies(i - candidate, n, out);
+            i += n;
+            next = i;
+        }
+    }
+    literal(in + next, size - next, out);
+}
+
+} // namespace
+
+void snappy_compress(char const* data, std::size_t size, std::string& out)
+{
+    char len[ProtoWriter::VARINT_SIZE];
+    out.append(len, ProtoWriter::varint(len, size));
+    std::vector<std::uint16_t> table(std::size_t(1) << HASH_BITS);
+    for (std::size_t pos = 0; pos < size; pos += BLOCK)
+        compress_block(data + pos, std::min(BLOCK, size - pos), table, out);
+}
+
+bool snappy_uncompress(char const* data, std::size_t size, std::string& out)
+{
+    auto p = reinterpret_cast<unsigned char const*>(data);
+    auto const end = p + size;
+
+    std::uint64_t expected = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        if (p == end || shift > 63)
+            return false;
+        expected |= std::uint64_t(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            break;
+    }
+    auto const start = out.size();
+    // not trusting the length for more than the ratio a copy can reach
+    out.reserve(start + std::min<std::uint64_t>(expected, std::uint64_t(size) * 22));
+
+    while (p != end) {
+        auto const tag = *p++;
+        std::size_t len, offset = 0;
+        switch (tag & 3) {
+        case LITERAL:
+            len = tag >> 2;
+            if (len >= 60) {
+                unsigned const bytes = len - 59;
+                if (std::size_t(end - p) < bytes)
+                    return false;
+                len = 0;
+                for (unsigned i = 0; i < bytes; ++i)
+                    len |= std::size_t(p[i]) << (8 * i);
+                p += bytes;
+            }
+            ++len;
+            if (std::size_t(end - p) < len || out.size() - start + len > expected)
+                return false;
+            out.append(reinterpret_cast<char const*>(p), len);
+            p += len;
+            continue;
+        case COPY1:
+            if (p == end)
+                return false;
+            len = 4 + ((tag >> 2) & 7);
+            offset = std::size_t(tag >> 5) << 8 | *p++;
+            break;
+        case COPY2:
+            if (end - p < 2)
+                return false;
+            len = 1 + (tag >> 2);
+            offset = p[0] | std::size_t(p[1]) << 8;
+            p += 2;
+            break;
+        default:
+            if (end - p < 4)
+                return false;
+            len = 1 + (tag >> 2);
+            offset = p[0] | std::size_t(p[1]) << 8 | std::size_t(p[2]) << 16 | std::size_t(p[3]) << 24;
+            p += 4;
+        }
+        if (!offset || offset > out.size() - start || out.size() - start + len > expected)
+            return false;
+        // byte by byte, a copy may overlap its own output
+        auto from = out.size() - offset;
+        for (std::size_t i = 0; i < len; ++i)
+            out += out[from + i];
+    }
+    return out.size() - start == expected;
+}
+
+} // namespace promxx
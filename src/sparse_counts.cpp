@@ -0,0 +1,107 @@
+#include <promxx/sparse_counts.hpp>
+
+#include <new>
+
+namespace promxx
+{
+namespace detail
+{
+namespace
+{
+
+// The object at slot, made by make() on first use, null if it failed
+template<class T, class Make>
+T* made(std::atomic<T*>& slot, Make make) noexcept
+{
+    auto p = slot.load(std::memory_order_acquire);
+    if (p)
+        return p;
+    auto fresh = make();
+    if (!fresh)
+        return nullptr;
+    if (slot.compare_exchange_strong(p, fresh, std::memory_order_acq_rel))
+        return fresh;
+    delete[] fresh;
+    return p;
+}
+
+} // namespace
+
+SparseCounts::SparseCounts(long min_key, long max_key) noexcept
+    : min_key_(min_key)
+    , segments_((max_key - min_key) / (SEGMENT * CHUNK) + 1)
+{
+}
+
+SparseCounts::~SparseCounts()
+{
+    auto dir = dir_.load(std::memory_order_relaxed);
+    if (!dir)
+        return;
+    for (std::size_t d = 0; d < segments_; ++d) {
+        auto segment = dir[d].load(std::memory_order_relaxed);
+        if (!segment)
+            continue;
+        for (auto& c: segment->chunks)
+            delete[] c.load(std::memory_order_relaxed);
+        delete[] segment;
+    }
+    delete[] dir;
+}
+
+bool SparseCounts::add(long key, Unsigned n) noexcept
+{
+    auto const i = std::size_t(key - min_key_);
+
+    auto dir = made(dir_, [this]{
+        auto fresh = new (std::nothrow) std::atomic<Segment*>[segments_];
+        if (fresh)
+            for (std::size_t d = 0; d < segments_; ++d)
+                fresh[d].store(nullptr, std::memory_order_relaxed);
+        return fresh;
+    });
+    if (!dir)
+        return false;
+    auto segment = made(dir[i / (SEGMENT * CHUNK)], []{
+        auto fresh = new (std::nothrow) Segment[1];
+        if (fresh)
+            for (auto& c: fresh->chunks)
+                c.store(nullptr, std::memory_order_relaxed);
+        return fresh;
+    });
+    if (!segment)
+        return false;
+    auto chunk = made(segment->chunks[i / CHUNK % SEGMENT], []{
+        auto fresh = new (std::nothrow) Chunk[1];
+        if (fresh)
+            for (auto& v: fresh->v)
+                v.store(0, std::memory_order_relaxed);
+        return fresh;
+    });
+    if (!chunk)
+        return false;
+
+    chunk->v[i % CHUNK].fetch_add(n, MEMORY_ORDER);
+    return true;
+}
+
+void SparseCounts::clear() noexcept
+{
+    auto dir = dir_.load(std::memory_order_acquire);
+    if (!dir)
+        return;
+    for (std::size_t d = 0; d < segments_; ++d) {
+        auto segment = dir[d].load(std::memory_order_acquire);
+        if (!segment)
+            continue;
+        for (auto& c: segment->chunks) {
+            auto chunk = c.load(std::memory_order_acquire);
+            if (chunk)
+                for (auto& v: chunk->v)
+                    v.store(0, MEMORY_ORDER);
+        }
+    }
+}
+
+} // namespace detail
+} // namespace promxx
@@ -0,0 +1,120 @@
+//
+// Updates from many threads while others register series and flush,
+// then checks that the totals are exact: no increment lost or counted
+// twice under contention.
+//
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <promxx/family.hpp>
+#include <promxx/local.hpp>
+#include <promxx/registry.hpp>
+
+using namespace promxx;
+
+namespace
+{
+
+unsigned const THREADS = 8;
+Unsigned const ITERATIONS = 100000;
+
+class NullSink final: public Sink
+{
+public:
+    void write(char const*, std::size_t) override {}
+};
+
+// Value of the sample line starting with the series
+double value(std::string const& out, std::string const& series)
+{
+    auto pos = out.find('\n' + series + ' ');
+    assert(pos != std::string::npos);
+    return std::strtod(out.c_str() + pos + series.size() + 2, nullptr);
+}
+
+} // namespace
+
+int main()
+{
+    Registry r;
+    auto& requests = r.family(Counter("requests", "Requests", {"thread"}));
+    auto& more = r.family(Counter("more", "", {"i"}));
+    auto& counter = r.add(Counter("counter"));
+    auto& sharded = r.add(ShardedCounter("sharded"));
+    auto& dense = r.add(DenseCounter("dense", {{"code", {"200", "500"}}}));
+    auto& gauge = r.add(Gauge<Unsigned>("gauge"));
+    auto& real = r.add(RealCounter("real"));
+    auto& local = r.add(Counter("local"));
+    auto& histogram = r.add(Histogram("histogram", Buckets{1, 10}));
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < THREADS; ++t)
+        threads.emplace_back([&, t]{
+            LocalCounter batched{local, 100, r};
+            // get-or-create of series shared by threads and of their own
+            auto& shared = requests.labels("shared");
+            auto& own = requests.labels(std::to_string(t));
+            for (Unsigned i = 0; i < ITERATIONS; ++i) {
+                counter.inc();
+                sharded.inc();
+                dense.at(i % 2).inc();
+                gauge.inc();
+                real.inc(0.5);
+                batched.inc();
+                shared.inc();
+                own.inc();
+                histogram.observe(i % 20);
+                if (i % 64 == 0)
+                    counter.inc(0, {{"trace_id", std::to_string(i)}});
+                gauge.dec();
+            }
+        });
+
+    // flushing and registering meanwhile
+    std::thread flusher([&]{
+        NullSink sink;
+        auto formats = {Format::Text, Format::OpenMetrics, Format::Protobuf};
+        while (!stop.load())
+            for (auto f: formats) {
+                r.flush(sink, f);
+                r.flush(sink, f, 3);
+            }
+    });
+    std::thread registrar([&]{
+        for (int i = 0; !stop.load(); ++i)
+            more.labels(std::to_string(i % 5000)).inc();
+    });
+
+    for (auto& t: threads)
+        t.join();
+    stop = true;
+    flusher.join();
+    registrar.join();
+
+    std::stringstream ss;
+    r.flush(ss);
+    auto const out = ss.str();
+    double const total = double(THREADS * ITERATIONS);
+    assert(value(out, "counter") == total);
+    assert(value(out, "sharded") == total);
+    assert(value(out, "dense{code=\"200\"}") == total / 2);
+    assert(value(out, "dense{code=\"500\"}") == total / 2);
+    assert(value(out, "gauge") == 0);
+    assert(value(out, "real") == total / 2);
+    assert(value(out, "local") == total);
+    assert(value(out, "requests{thread=\"shared\"}") == total);
+    for (unsigned t = 0; t < THREADS; ++t)
+        assert(value(out, "requests{thread=\"" + std::to_string(t) + "\"}") == ITERATIONS);
+    // 0 and 1 of every 20, 2 to 10, then the rest
+    assert(value(out, "histogram_bucket{le=\"1\"}") == total / 10);
+    assert(value(out, "histogram_bucket{le=\"10\"}") == total * 11 / 20);
+    assert(value(out, "histogram_bucket{le=\"+Inf\"}") == total);
+    assert(value(out, "histogram_sum") == total * 19 / 2);
+    assert(value(out, "histogram_count") == total);
+}
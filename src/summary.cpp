@@ -0,0 +1,260 @@
+#include <promxx/summary.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace promxx
+{
+namespace
+{
+
+std::string const QUANTILE = "quantile";
+std::string const _SUM = "_sum";
+std::string const _COUNT = "_count";
+
+// Smaller magnitudes are counted as zero
+double const MIN_VALUE = 1e-9;
+
+std::vector<std::string> summary_keys(std::vector<std::string> keys)
+{
+    if (std::find(keys.begin(), keys.end(), QUANTILE) != keys.end())
+        throw Error{"\"quantile\" is not allowed as label name in summary"};
+    return keys;
+}
+
+std::string format_quantile(double q)
+{
+    char buf[Writer::NUMBER_SIZE];
+    return std::string(buf, Writer::number(buf, q));
+}
+
+} // namespace
+
+Summary::Summary(std::string name, Quantiles quantiles,
+                 std::string help, std::vector<std::string> keys,
+                 std::chrono::seconds max_age, std::size_t age_buckets,
+                 double accuracy)
+    : detail::MetricMeta(name, summary_keys(std::move(keys)), std::move(help))
+    , quantiles_(std::move(quantiles))
+    , max_age_(max_age)
+    , age_buckets_(age_buckets)
+    , accuracy_(accuracy)
+{
+    for (auto q: quantiles_)
+        if (!(q >= 0 && q <= 1))
+            throw Error{"Summary '" + name + "' quantiles must be from 0 to 1"};
+    if (max_age_.count() <= 0 || age_buckets_ == 0)
+        throw Error{"Summary '" + name + "' max age and age buckets must be positive"};
+    if (!(accuracy_ > 0 && accuracy_ < 1))
+        throw Error{"Summary '" + name + "' accuracy must be between 0 and 1"};
+}
+
+ISummary::ISummary(Summary const& s)
+    : gamma_((1 + s.accuracy()) / (1 - s.accuracy()))
+    , inv_log_gamma_(1 / std::log(gamma_))
+    , width_(std::max<Clock::duration>(
+          std::chrono::duration_cast<Clock::duration>(s.max_age()) / s.age_buckets(),
+          Clock::duration(1)))
+    , size_(s.age_buckets())
+{
+    auto const min_key = long(std::floor(std::log(MIN_VALUE) * inv_log_gamma_));
+    auto const max_key = long(std::ceil(std::log(std::numeric_limits<double>::max()) * inv_log_gamma_));
+    windows_.reserve(size_);
+    for (std::size_t i = 0; i < size_; ++i)
+        windows_.emplace_back(new Window(min_key, max_key));
+}
+
+long long ISummary::epoch(Clock::time_point t) const noexcept
+{
+    return t.time_since_epoch() / width_;
+}
+
+void ISummary::observe(double v) noexcept
+{
+    // dropped as a whole if its bucket can't be had
+    if (!std::isnan(v) && !add_window(v))
+        return;
+    count_.fetch_add(1, detail::MEMORY_ORDER);
+    detail::atomic_add(sum_, v);
+}
+
+bool ISummary::add_window(double v) noexcept
+{
+    auto const e = epoch(Clock::now());
+    auto& w = *windows_[std::size_t(e) % size_];
+    auto we = w.epoch.load(std::memory_order_acquire);
+    if (we != e) {
+        // The first thread in a new step resets the stale window. Updates
+        // racing with the reset may be lost, they are a tiny fraction.
+        if (we > e)
+            return true;
+        if (w.epoch.compare_exchange_strong(we, e, std::memory_order_acq_rel)) {
+            w.zero.store(0, detail::MEMORY_ORDER);
+            w.positive.clear();
+            w.negative.clear();
+        }
+    }
+
+    auto const a = std::fabs(v);
+    if (a < MIN_VALUE) {
+        w.zero.fetch_add(1, detail::MEMORY_ORDER);
+        return true;
+    }
+    auto key = long(std::ceil(std::log(std::min(a, std::numeric_limits<double>::max())) * inv_log_gamma_));
+    return (v > 0 ? w.positive : w.negative).add(key, 1);
+}
+
+void ISummary::snapshot_windows(std::vector<Unsigned>& cells) const
+{
+    // windows still inside max age
+    auto const now = epoch(Clock::now());
+    auto const zero = cells.size();
+    cells.push_back(0);
+    for (auto counts: {&Window::positive, &Window::negative}) {
+        auto const n = cells.size();
+        cells.push_back(0);
+        for (auto& w: windows_) {
+            auto const e = w->epoch.load(std::memory_order_acquire);
+            if (e <= now - (long long)size_ || e > now)
+                continue;
+            if (counts == &Window::positive)
+                cells[zero] += w->zero.load(detail::MEMORY_ORDER);
+            ((*w).*counts).for_each([&cells](long k, Unsigned c){
+                cells.push_back(detail::to_cell(k));
+                cells.push_back(c);
+            });
+        }
+        cells[n] = (cells.size() - n - 1) / 2;
+    }
+}
+
+Unsigned const* ISummary::quantiles(Quantiles const& q, Unsigned const* cells,
+                                    std::vector<double>& out) const
+{
+    // windows merged by key
+    auto const zero = *cells++;
+    std::vector<std::pair<long, Unsigned>> pos, neg;
+    for (auto v: {&pos, &neg}) {
+        auto const n = *cells++;
+        v->reserve(n);
+        for (Unsigned i = 0; i < n; ++i)
+            v->emplace_back(detail::from_cell<long>(cells[2 * i]), cells[2 * i + 1]);
+        cells += 2 * n;
+        std::sort(v->begin(), v->end());
+        std::size_t m = 0;
+        for (std::size_t i = 0; i < v->size(); ++i) {
+            if (m > 0 && (*v)[m - 1].first == (*v)[i].first)
+                (*v)[m - 1].second += (*v)[i].second;
+            else
+                (*v)[m++] = (*v)[i];
+        }
+        v->resize(m);
+    }
+
+    Unsigned total = zero;
+    for (auto& b: pos)
+        total += b.second;
+    for (auto& b: neg)
+        total += b.second;
+
+    // middle of the bucket, which is within accuracy of any value in it
+    auto value = [this](long key){ return 2 * std::pow(gamma_, key) / (gamma_ + 1); };
+
+    out.clear();
+    for (auto p: q) {
+        if (total == 0) {
+            out.push_back(std::numeric_limits<double>::quiet_NaN());
+            continue;
+        }
+        auto const rank = p * (total - 1);
+        Unsigned cum = 0;
+        double r = 0;
+        bool found = false;
+        for (auto it = neg.rbegin(); it != neg.rend() && !found; ++it)
+            if ((cum += it->second) > rank) {
+                r = -value(it->first);
+                found = true;
+            }
+        if (!found && (cum += zero) > rank)
+            found = true;
+        for (auto it = pos.begin(); it != pos.end() && !found; ++it)
+            if ((cum += it->second) > rank) {
+                r = value(it->first);
+                found = true;
+            }
+        out.push_back(r);
+    }
+    return cells;
+}
+
+namespace detail
+{
+
+MetricImpl<Summary>::MetricImpl(Summary const& s, std::vector<std::string> const& values)
+    : Metric("summary", s, values, QUANTILE)
+    , ISummary(s)
+    , quantiles_(s.quantiles())
+{
+    for (auto q: quantiles_)
+        lines_.add(header({}, QUANTILE, format_quantile(q)));
+    lines_.add(header(_SUM));
+    lines_.add(header(_COUNT));
+}
+
+void MetricImpl<Summary>::snapshot(std::vector<Unsigned>& cells) const
+{
+    cells.push_back(to_cell(sum_.load(MEMORY_ORDER)));
+    cells.push_back(count_.load(MEMORY_ORDER));
+    snapshot_windows(cells);
+}
+
+Unsigned const* MetricImpl<Summary>::format(Writer& w, Unsigned const* cells) const
+{
+    std::vector<double> q;
+    auto const next = quantiles(quantiles_, cells + 2, q);
+    auto const n = quantiles_.size();
+    for (std::size_t i = 0; i < n; ++i)
+        lines_.write(w, i) << q[i] << '\n';
+    lines_.write(w, n) << from_cell<double>(cells[0]) << '\n';
+    lines_.write(w, n + 1) << cells[1] << '\n';
+    return next;
+}
+
+Unsigned const* MetricImpl<Summary>::encode(ProtoWriter& p, Unsigned const* cells,
+                                             Unsigned const*) const
+{
+    std::vector<double> q;
+    auto const next = quantiles(quantiles_, cells + 2, q);
+    p.begin(pb::FAMILY_METRIC);
+    label_pairs(p);
+    p.begin(pb::METRIC_SUMMARY);
+    p.uint(pb::SAMPLE_COUNT, cells[1]);
+    p.real(pb::SAMPLE_SUM, from_cell<double>(cells[0]));
+    for (std::size_t i = 0; i < quantiles_.size(); ++i) {
+        p.begin(pb::SUMMARY_QUANTILE);
+        p.real(pb::QUANTILE_QUANTILE, quantiles_[i]);
+        p.real(pb::QUANTILE_VALUE, q[i]);
+        p.end();
+    }
+    p.end();
+    p.end();
+    return next;
+}
+
+Unsigned const* MetricImpl<Summary>::remote_write(ProtoWriter& p, Unsigned const* cells,
+                                                   long long timestamp) const
+{
+    std::vector<double> q;
+    auto const next = quantiles(quantiles_, cells + 2, q);
+    char buf[Writer::NUMBER_SIZE];
+    for (std::size_t i = 0; i < quantiles_.size(); ++i)
+        remote_sample(p, timestamp, q[i], {}, QUANTILE,
+                      StringRef(buf, Writer::number(buf, quantiles_[i])));
+    remote_sample(p, timestamp, from_cell<double>(cells[0]), _SUM);
+    remote_sample(p, timestamp, double(cells[1]), _COUNT);
+    return next;
+}
+
+} // namespace detail
+} // namespace promxx
@@ -0,0 +1,386 @@
+#include <promxx/writer.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace promxx
+{
+namespace
+{
+
+char const DIGITS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Writes digits backwards ending at `end`, returns the first char
+char* format_backwards(char* end, unsigned long long v) noexcept
+{
+    while (v >= 100) {
+        auto i = (v % 100) * 2;
+        v /= 100;
+        *--end = DIGITS[i + 1];
+        *--end = DIGITS[i];
+    }
+    if (v < 10)
+        *--end = char('0' + v);
+    else {
+        *--end = DIGITS[v * 2 + 1];
+        *--end = DIGITS[v * 2];
+    }
+    return end;
+}
+
+double const MAX_EXACT = 9007199254740992.0; // 2^53
+
+double const POW10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+    1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17
+};
+
+unsigned long long const UPOW10[] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+    10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+    100000000000ull, 1000000000000ull, 10000000000000ull,
+    100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+    100000000000000000ull
+};
+
+// Unsigned integer of up to WORDS * 32 bits, enough for the scaled
+// values of any double in shortest()
+class Big
+{
+    static std::size_t const WORDS = 40;
+    std::uint32_t w_[WORDS] = {};
+    std::size_t n_ = 0; // used words, the top one non-zero
+
+public:
+    explicit Big(std::uint64_t v = 0) noexcept
+    {
+        for (; v; v >>= 32)
+            w_[n_++] = std::uint32_t(v);
+    }
+
+    void mul(std::uint32_t m) noexcept
+    {
+        std::uint64_t carry = 0;
+        for (std::size_t i = 0; i < n_; ++i) {
+            carry += std::uint64_t(w_[i]) * m;
+            w_[i] = std::uint32_t(carry);
+            carry >>= 32;
+        }
+        if (carry)
+            w_[n_++] = std::uint32_t(carry);
+    }
+
+    void mul_pow10(int k) noexcept
+    {
+        for (; k >= 9; k -= 9)
+            mul(1000000000);
+        if (k > 0)
+            mul(std::uint32_t(UPOW10[k]));
+    }
+
+    void shl(int bits) noexcept
+    {
+        for (; bits >= 31; bits -= 31)
+            mul(1u << 31);
+        if (bits > 0)
+            mul(1u << bits);
+    }
+
+    void add(Big const& b) noexcept
+    {
+        std::uint64_t carry = 0;
+        for (std::size_t i = 0; i < b.n_ || (carry && i < WORDS); ++i) {
+            if (i == n_)
+                w_[n_++] = 0;
+            carry += std::uint64_t(w_[i]) + (i < b.n_ ? b.w_[i] : 0);
+            w_[i] = std::uint32_t(carry);
+            carry >>= 32;
+        }
+    }
+
+    // b must not be greater
+    void sub(Big const& b) noexcept
+    {
+        std::int64_t borrow = 0;
+        for (std::size_t i = 0; i < n_; ++i) {
+            borrow += std::int64_t(w_[i]) - (i < b.n_ ? b.w_[i] : 0);
+            w_[i] = std::uint32_t(borrow);
+            borrow = borrow < 0 ? -1 : 0;
+        }
+        while (n_ && !w_[n_ - 1])
+            --n_;
+    }
+
+    friend int compare(Big const& a, Big const& b) noexcept
+    {
+        if (a.n_ != b.n_)
+            return a.n_ < b.n_ ? -1 : 1;
+        for (std::size_t i = a.n_; i-- > 0;)
+            if (a.w_[i] != b.w_[i])
+                return a.w_[i] < b.w_[i] ? -1 : 1;
+        return 0;
+    }
+};
+
+// Shortest digits that read back as positive finite a, by the free-format
+// algorithm of Steele & White and Burger & Dybvig with exact integers.
+// Sets point so that a is 0.digits * 10^point, returns the number of digits.
+std::size_t shortest(double a, char* digits, int& point) noexcept
+{
+    std::uint64_t bits;
+    std::memcpy(&bits, &a, sizeof bits);
+    auto const biased = int(bits >> 52);
+    auto f = bits & ((1ull << 52) - 1);
+    auto e = -1074;
+    if (biased) {
+        f |= 1ull << 52;
+        e = biased - 1075;
+    }
+    // a = f * 2^e, exact ties read back to even f
+    bool const even = (f & 1) == 0;
+    // the gap below is half the one above at powers of two
+    bool const uneven = f == 1ull << 52 && biased > 1;
+
+    // value r / s, half gaps to the neighbors m_minus / s and m_plus / s
+    Big r(f), s(1), m_minus(1), m_plus(1);
+    int const shift = uneven ? 2 : 1;
+    if (e >= 0) {
+        r.shl(e + shift);
+        s.shl(shift);
+        m_minus.shl(e);
+        m_plus.shl(e + shift - 1);
+    }
+    else {
+        r.shl(shift);
+        s.shl(-e + shift);
+        m_plus.shl(shift - 1);
+    }
+
+    // scaled by 10^k, the estimate is at most one too small
+    auto k = int(std::ceil(std::log10(a) - 1e-10));
+    if (k >= 0)
+        s.mul_pow10(k);
+    else {
+        r.mul_pow10(-k);
+        m_minus.mul_pow10(-k);
+        m_plus.mul_pow10(-k);
+    }
+    Big high = r;
+    high.add(m_plus);
+    if (compare(high, s) >= (even ? 0 : 1)) {
+        s.mul(10);
+        ++k;
+    }
+    point = k;
+
+    std::size_t n = 0;
+    for (;;) {
+        r.mul(10);
+        m_minus.mul(10);
+        m_plus.mul(10);
+        int d = 0;
+        while (compare(r, s) >= 0) {
+            r.sub(s);
+            ++d;
+        }
+        high = r;
+        high.add(m_plus);
+        bool const low_end = compare(r, m_minus) < (even ? 1 : 0);
+        bool const high_end = compare(high, s) > (even ? -1 : 0);
+        if (low_end && high_end) {
+            // the closer one, up on a tie
+            Big twice = r;
+            twice.mul(2);
+            if (compare(twice, s) >= 0)
+                ++d;
+        }
+        else if (high_end)
+            ++d;
+        digits[n++] = char('0' + d);
+        if (low_end || high_end)
+            return n;
+    }
+}
+
+// Shortest round-trip digits as printf %g does them, at least 15 digits
+// of precision. Doesn't depend on the locale, unlike printf and strtod.
+std::size_t format_shortest(char* out, double v) noexcept
+{
+    char digits[20];
+    int point;
+    auto const n = int(shortest(std::fabs(v), digits, point));
+    auto const x = point - 1;
+    auto p = out;
+    if (v < 0)
+        *p++ = '-';
+    if (x < -4 || x >= std::max(n, 15)) {
+        *p++ = digits[0];
+        if (n > 1) {
+            *p++ = '.';
+            std::memcpy(p, digits + 1, n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = x < 0 ? '-' : '+';
+        auto const ax = x < 0 ? -x : x;
+        if (ax < 10)
+            *p++ = '0';
+        p = std::copy(format_backwards(digits + sizeof digits, (unsigned long long)ax),
+                      digits + sizeof digits, p);
+    }
+    else if (x < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (int z = -1; z > x; --z)
+            *p++ = '0';
+        std::memcpy(p, digits, n);
+        p += n;
+    }
+    else {
+        for (int i = 0; i <= x; ++i)
+            *p++ = i < n ? digits[i] : '0';
+        if (n > x + 1) {
+            *p++ = '.';
+            std::memcpy(p, digits + x + 1, n - x - 1);
+            p += n - x - 1;
+        }
+    }
+    return p - out;
+}
+
+} // namespace
+
+Sink::~Sink() = default;
+
+void OstreamSink::write(char const* data, std::size_t size)
+{
+    os_.write(data, size);
+}
+
+void Writer::flush()
+{
+    if (pos_ > 0) {
+        sink_.write(buf_, pos_);
+        flushed_ += pos_;
+        pos_ = 0;
+    }
+}
+
+void Writer::write_long(char const* data, std::size_t size)
+{
+    flush();
+    if (size < size_) {
+        std::memcpy(buf_, data, size);
+        pos_ = size;
+    }
+    else {
+        sink_.write(data, size);
+        flushed_ += size;
+    }
+}
+
+std::size_t Writer::number(char* out, unsigned long long v) noexcept
+{
+    char tmp[NUMBER_SIZE];
+    auto end = tmp + NUMBER_SIZE;
+    auto begin = format_backwards(end, v);
+    std::memcpy(out, begin, end - begin);
+    return end - begin;
+}
+
+std::size_t Writer::number(char* out, long long v) noexcept
+{
+    if (v >= 0)
+        return number(out, static_cast<unsigned long long>(v));
+    *out = '-';
+    // negate in unsigned to handle the minimal value
+    return 1 + number(out + 1, 0ull - static_cast<unsigned long long>(v));
+}
+
+std::size_t Writer::number(char* out, double v) noexcept
+{
+    if (std::isnan(v)) {
+        std::memcpy(out, "NaN", 3);
+        return 3;
+    }
+    if (std::isinf(v)) {
+        std::memcpy(out, v > 0 ? "+Inf" : "-Inf", 4);
+        return 4;
+    }
+    // integers are the most common values, format them exactly
+    if (std::fabs(v) <= MAX_EXACT && v == std::floor(v)) {
+        if (v >= 0)
+            return number(out, static_cast<unsigned long long>(v));
+        return number(out, static_cast<long long>(v));
+    }
+
+    // Fixed notation with the fewest fractional digits that round-trip.
+    // n / 10^k is correctly rounded, so equality means strtod reads the
+    // decimal back as the same value.
+    auto const a = std::fabs(v);
+    if (a >= 1e-5 && a < 1e15) {
+        for (std::size_t k = 1; k < 18; ++k) {
+            auto const x = a * POW10[k];
+            if (x >= MAX_EXACT)
+                break;
+            auto const n = static_cast<unsigned long long>(x + 0.5);
+            if (double(n) / POW10[k] != a)
+                continue;
+
+            auto p = out;
+            if (v < 0)
+                *p++ = '-';
+            p += number(p, n / UPOW10[k]);
+            *p++ = '.';
+            auto frac = n % UPOW10[k];
+            char digits[NUMBER_SIZE];
+            auto end = digits + NUMBER_SIZE;
+            auto begin = format_backwards(end, frac);
+            for (auto z = std::size_t(end - begin); z < k; ++z)
+                *p++ = '0';
+            while (end[-1] == '0')
+                --end;
+            std::memcpy(p, begin, end - begin);
+            return p + (end - begin) - out;
+        }
+    }
+    return format_shortest(out, v);
+}
+
+void ProtoWriter::real(unsigned field, double v)
+{
+    tag(field, FIXED64);
+    unsigned long long bits;
+    std::memcpy(&bits, &v, sizeof bits);
+    char le[8];
+    for (auto& c: le) {
+        c = char(bits & 0xff);
+        bits >>= 8;
+    }
+    buf_.append(le, sizeof le);
+}
+
+void ProtoWriter::end()
+{
+    auto const at = open_.back();
+    open_.pop_back();
+    auto const size = buf_.size() - at - 1;
+    char len[VARINT_SIZE];
+    auto const n = varint(len, size);
+    if (n > 1)
+        buf_.insert(at + 1, n - 1, '\0');
+    std::memcpy(&buf_[at], len, n);
+}
+
+} // namespace promxx
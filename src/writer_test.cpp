@@ -0,0 +1,221 @@
+#include <clocale>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <cassert>
+
+#include <promxx/format.hpp>
+#include <promxx/snappy.hpp>
+#include <promxx/writer.hpp>
+
+#ifdef PROMXX_HAVE_ZLIB
+#include <promxx/gzip.hpp>
+#include <zlib.h>
+#endif
+
+using namespace promxx;
+
+namespace
+{
+
+template<class T>
+std::string format(T v)
+{
+    std::string s;
+    StringSink sink{s};
+    Writer w{sink};
+    w << v;
+    w.flush();
+    return s;
+}
+
+#ifdef PROMXX_HAVE_ZLIB
+std::string gunzip(std::string const& in)
+{
+    std::string out(in.size() * 100 + 100, '\0');
+    z_stream z{};
+    inflateInit2(&z, 16 + 15);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    z.avail_in = uInt(in.size());
+    z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    z.avail_out = uInt(out.size());
+    auto rc = inflate(&z, Z_FINISH);
+    assert(rc == Z_STREAM_END);
+    (void)rc;
+    out.resize(z.total_out);
+    inflateEnd(&z);
+    return out;
+}
+#endif
+
+} // namespace
+
+int main()
+{
+    assert(format(0u) == "0");
+    assert(format(7u) == "7");
+    assert(format(42u) == "42");
+    assert(format(100u) == "100");
+    assert(format(1234567890ull) == "1234567890");
+    assert(format(std::numeric_limits<unsigned long long>::max()) == "18446744073709551615");
+
+    assert(format(0) == "0");
+    assert(format(-5) == "-5");
+    assert(format(-1234567) == "-1234567");
+    assert(format(std::numeric_limits<long long>::min()) == "-9223372036854775808");
+
+    assert(format(0.0) == "0");
+    assert(format(45.0) == "45");
+    assert(format(-3.0f) == "-3");
+    assert(format(0.5) == "0.5");
+    assert(format(0.1) == "0.1");
+    assert(format(0.99) == "0.99");
+    assert(format(-0.25) == "-0.25");
+    assert(format(123.456) == "123.456");
+    assert(format(0.007) == "0.007");
+    assert(format(5000002.55) == "5000002.55");
+    assert(format(0.1 + 0.2) == "0.30000000000000004");
+    assert(format(1.0905077326652577) == "1.0905077326652577");
+    assert(format(1e-9) == "1e-09");
+    assert(format(2.938735877055719e-39) == "2.938735877055719e-39");
+    assert(format(1e300) == "1e+300");
+    assert(format(std::numeric_limits<double>::infinity()) == "+Inf");
+    assert(format(-std::numeric_limits<double>::infinity()) == "-Inf");
+    assert(format(std::numeric_limits<double>::quiet_NaN()) == "NaN");
+    assert(format(1.5e-6) == "1.5e-06");
+    assert(format(1e16) == "1e+16");
+    assert(format(1e23) == "1e+23");
+    assert(format(-1000000000000000.5) == "-1000000000000000.5");
+    assert(format(5e-324) == "5e-324");
+    assert(format(std::numeric_limits<double>::max()) == "1.7976931348623157e+308");
+    assert(format(2.2250738585072014e-308) == "2.2250738585072014e-308");
+
+    // the shortest digits that read back as the same value
+    {
+        std::mt19937_64 random(1);
+        for (int i = 0; i < 100000; ++i) {
+            auto bits = random();
+            double v;
+            std::memcpy(&v, &bits, sizeof v);
+            if (std::isnan(v) || std::isinf(v))
+                continue;
+            auto const s = format(v);
+            assert(std::strtod(s.c_str(), nullptr) == v);
+        }
+    }
+
+    // not in the locale's decimal separator
+    if (std::setlocale(LC_NUMERIC, "de_DE.UTF-8")) {
+        assert(format(1.5e-6) == "1.5e-06");
+        assert(format(0.1 + 0.2) == "0.30000000000000004");
+        assert(format(2.938735877055719e-39) == "2.938735877055719e-39");
+        assert(format(123.456) == "123.456");
+        std::setlocale(LC_NUMERIC, "C");
+    }
+
+    // output larger than the buffer goes through in chunks
+    {
+        std::string s;
+        StringSink sink{s};
+        char buf[Writer::NUMBER_SIZE];
+        Writer w{sink, buf, sizeof(buf)};
+        std::string expected;
+        for (unsigned i = 0; i < 1000; ++i) {
+            w << "v" << i << ' ';
+            expected += "v" + std::to_string(i) + ' ';
+        }
+        w << std::string(100, 'x');
+        expected += std::string(100, 'x');
+        w.flush();
+        assert(s == expected);
+    }
+
+    {
+        ProtoWriter p;
+        p.uint(1, 300);
+        assert(p.data() == "\x08\xac\x02");
+
+        p.clear();
+        p.sint(2, -1);
+        p.real(1, 1.0);
+        assert(p.data() == std::string("\x10\x01\x09\0\0\0\0\0\0\xf0\x3f", 11));
+        assert(ProtoWriter::zigzag(1) == 2);
+        assert(ProtoWriter::zigzag(std::numeric_limits<long long>::min()) ==
+               std::numeric_limits<unsigned long long>::max());
+
+        // the reserved length byte is widened for longer messages
+        p.clear();
+        p.begin(2);
+        p.begin(1);
+        p.bytes(1, std::string(200, 'a'));
+        p.end();
+        p.bytes(3, "b");
+        p.end();
+        assert(p.data() == "\x12\xd1\x01\x0a\xcb\x01\x0a\xc8\x01" + std::string(200, 'a') + "\x1a\x01" "b");
+    }
+
+    assert(negotiate("") == Format::Text);
+    assert(negotiate("text/plain;version=0.0.4") == Format::Text);
+    assert(negotiate("application/json") == Format::Text);
+    assert(negotiate("application/openmetrics-text;version=1.0.0,text/plain;q=0.5") == Format::OpenMetrics);
+    assert(negotiate("application/vnd.google.protobuf;proto=io.prometheus.client.MetricFamily;"
+                     "encoding=delimited;q=0.7,text/plain;version=0.0.4;q=0.3,*/*;q=0.1") == Format::Protobuf);
+    assert(negotiate("application/vnd.google.protobuf;proto=other;encoding=delimited") == Format::Text);
+    assert(negotiate("text/plain;q=0.5, application/openmetrics-text; q=0.9") == Format::OpenMetrics);
+    assert(std::string(content_type(Format::Text)) == "text/plain; version=0.0.4; charset=utf-8");
+
+#ifdef PROMXX_HAVE_ZLIB
+    // compressed as written, reusable after finish
+    {
+        std::string s;
+        StringSink sink{s};
+        GzipSink gz{sink};
+        std::string expected;
+        for (int round = 0; round < 2; ++round) {
+            s.clear();
+            Writer w{gz};
+            for (unsigned i = 0; i < 10000; ++i) {
+                w << "metric{i=\"" << i % 100 << "\"} " << i << '\n';
+                if (round == 0)
+                    expected += "metric{i=\"" + std::to_string(i % 100) + "\"} " + std::to_string(i) + '\n';
+            }
+            w.flush();
+            gz.finish();
+            assert(s.size() < expected.size() / 4);
+            assert(gunzip(s) == expected);
+        }
+    }
+#endif
+
+    // snappy round trips, with literals and copies of all lengths
+    {
+        std::string text;
+        for (int i = 0; i < 20000; ++i)
+            text += "requests_total{path=\"/p" + std::to_string(i % 700) + "\"} " + std::to_string(i * 31) + "\n";
+        std::string noise;
+        unsigned x = 1;
+        for (int i = 0; i < 70000; ++i) {
+            x = x * 1103515245 + 12345;
+            noise += char(x >> 16);
+        }
+        for (auto in: {std::string(), std::string("abc"), std::string(100, 'a'), text, noise, text + noise}) {
+            std::string packed, unpacked;
+            snappy_compress(in.data(), in.size(), packed);
+            assert(snappy_uncompress(packed.data(), packed.size(), unpacked));
+            assert(unpacked == in);
+        }
+        std::string packed;
+        snappy_compress(text.data(), text.size(), packed);
+        assert(packed.size() < text.size() / 2);
+        std::string out;
+        assert(!snappy_uncompress(packed.data(), packed.size() - 1, out));
+        out.clear();
+        assert(!snappy_uncompress("\x05\x08" "ab", 4, out));
+        out.clear();
+        // a copy from before the start
+        assert(!snappy_uncompress("\x08\x05\x10", 3, out));
+    }
+}